@@ -0,0 +1,100 @@
+/*
+ * siphash24 -- SipHash-2-4, based on the reference implementation:
+ *
+ * "SipHash was designed by Jean-Philippe Aumasson and Daniel J. Bernstein.
+ * The reference code is released into the public domain (CC0)."
+ *
+ * References:
+ *	https://github.com/veorq/SipHash
+ *	https://131002.net/siphash/siphash.pdf
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "utils.h"
+
+#define	ROTL64(x, b)	(uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define	SIPROUND							\
+do {									\
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);	\
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;			\
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;			\
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);	\
+} while (/* CONSTCOND */ 0)
+
+uint64_t
+siphash24(const void *key, size_t len, uint64_t k0, uint64_t k1)
+{
+	const uint8_t *data = key;
+	uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+	uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+	uint64_t v3 = 0x7465646279746573ULL ^ k1;
+	uint64_t b = (uint64_t)len << 56;
+
+	while (len >= sizeof(uint64_t)) {
+		uint64_t m;
+
+		/* Little-endian load, independent of the host byte order. */
+		m  = (uint64_t)data[0];
+		m |= (uint64_t)data[1] << 8;
+		m |= (uint64_t)data[2] << 16;
+		m |= (uint64_t)data[3] << 24;
+		m |= (uint64_t)data[4] << 32;
+		m |= (uint64_t)data[5] << 40;
+		m |= (uint64_t)data[6] << 48;
+		m |= (uint64_t)data[7] << 56;
+
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+
+		data += sizeof(uint64_t);
+		len -= sizeof(uint64_t);
+	}
+
+	/*
+	 * Handle the last few bytes of the input array.
+	 */
+	switch (len) {
+	case 7:
+		b |= (uint64_t)data[6] << 48;
+		/* FALLTHROUGH */
+	case 6:
+		b |= (uint64_t)data[5] << 40;
+		/* FALLTHROUGH */
+	case 5:
+		b |= (uint64_t)data[4] << 32;
+		/* FALLTHROUGH */
+	case 4:
+		b |= (uint64_t)data[3] << 24;
+		/* FALLTHROUGH */
+	case 3:
+		b |= (uint64_t)data[2] << 16;
+		/* FALLTHROUGH */
+	case 2:
+		b |= (uint64_t)data[1] << 8;
+		/* FALLTHROUGH */
+	case 1:
+		b |= (uint64_t)data[0];
+	}
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+
+	/*
+	 * Finalisation: four rounds.
+	 */
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
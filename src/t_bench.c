@@ -0,0 +1,582 @@
+/*
+ * Copyright (c) 2018 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Adversarial benchmark: the keys are crafted (brute-forced) to share
+ * the root slot and the first four levels of the trie under the default
+ * (zero) seed.  The depth of the trie and the lookup latency are compared
+ * against the random keys, with the default seed, the random seed
+ * (THMAP_RANDSEED) and the keyed hash (THMAP_SIPHASH).
+ *
+ * Note: the depth is computed by replaying the hashing of thmap.c.
+ *
+ * Prefetch benchmark: the lookups of the random keys in a large map,
+ * with and without the incremental prefetch of the next keys.
+ *
+ * Cache benchmark: the lookups of a small set of hot keys in a large
+ * map, with and without the lookup cache.
+ *
+ * Join benchmark: the intersection of two large maps with the same seed
+ * (the lockstep walk) and with different seeds (walk and probe).
+ *
+ * Digest benchmark: the comparison of two large maps with a few
+ * differences, with and without the subtree digests.
+ *
+ * Reclamation benchmark: the lookups of the random keys in a large map,
+ * with the barrier-based (epoch) G/C, THMAP_HAZARD and THMAP_GRACE; and
+ * the memory not reclaimed while a reader is stalled (between the lookups)
+ * and the keys keep changing, with the time spent in thmap_gc().  With the
+ * epoch G/C, the staged memory is held until the reader passes the barrier;
+ * with the hazard pointers or the grace periods, it is released.
+ *
+ * Intrusive benchmark: the inserts of the random keys referenced by the
+ * objects (THMAP_NOCOPY) and of the entries embedded in the objects
+ * (THMAP_INTRUSIVE), with the number of allocations per insert once the
+ * intermediate nodes are in place.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "thmap.h"
+#include "utils.h"
+
+#define	NKEYS		64
+#define	NLOOKUPS	(4 * 1000 * 1000)
+
+#define	PF_NKEYS	(1024 * 1024)
+#define	PF_BATCH	16
+
+#define	HOT_NKEYS	256
+
+#define	HZ_NCYCLES	64
+#define	HZ_NCHURN	4096
+
+#define	IN_NOBJS	(16 * 1024)
+#define	IN_NROUNDS	32
+
+static uint32_t
+hash_block(unsigned flags, const uint64_t seed[2], const uint64_t *key,
+    unsigned i)
+{
+	if (flags & THMAP_SIPHASH) {
+		return (uint32_t)siphash24(key, sizeof(uint64_t),
+		    seed[0] + i, seed[1]);
+	}
+	return murmurhash3(key, sizeof(uint64_t), (uint32_t)seed[0] + i);
+}
+
+static unsigned
+hash_digit(unsigned flags, const uint64_t seed[2], const uint64_t *key,
+    unsigned level)
+{
+	const unsigned offset = level * 4;
+	const uint32_t h = hash_block(flags, seed, key, offset >> 5);
+	return (h >> (offset & 31)) & 0xf;
+}
+
+static unsigned
+hash_rslot(unsigned flags, const uint64_t seed[2], const uint64_t *key)
+{
+	const uint32_t h = hash_block(flags, seed, key, 0);
+	return ((h >> 26) ^ sizeof(uint64_t)) & 0x3f;
+}
+
+/*
+ * key_depth: the number of intermediate nodes on the path to the key,
+ * i.e. one plus the longest common prefix of the slots with any other
+ * key in the same root slot.
+ */
+static unsigned
+key_depth(unsigned flags, const uint64_t seed[2], const uint64_t *keys,
+    unsigned i)
+{
+	unsigned depth = 1;
+
+	for (unsigned j = 0; j < NKEYS; j++) {
+		unsigned level = 0;
+
+		if (j == i || hash_rslot(flags, seed, &keys[i]) !=
+		    hash_rslot(flags, seed, &keys[j])) {
+			continue;
+		}
+		while (hash_digit(flags, seed, &keys[i], level) ==
+		    hash_digit(flags, seed, &keys[j], level)) {
+			level++;
+		}
+		depth = MAX(depth, level + 1);
+	}
+	return depth;
+}
+
+static uint64_t
+fast_random(void)
+{
+	static uint64_t x = 0x9e3779b97f4a7c15;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+static uint64_t
+elapsed_nsec(const struct timespec *tv)
+{
+	return (tv[1].tv_sec - tv[0].tv_sec) * 1000000000ULL +
+	    tv[1].tv_nsec - tv[0].tv_nsec;
+}
+
+static void
+craft_keys(uint64_t *keys, unsigned n)
+{
+	uint64_t key = 0;
+
+	/*
+	 * Root slot zero and the lower 16 bits of the first hash block
+	 * (i.e. levels 0-3) set to zero: about 2^22 attempts per key.
+	 */
+	for (unsigned i = 0; i < n; key++) {
+		const uint32_t h = murmurhash3(&key, sizeof(key), 0);
+
+		if ((((h >> 26) ^ sizeof(key)) & 0x3f) == 0 &&
+		    (h & 0xffff) == 0) {
+			keys[i++] = key;
+		}
+	}
+}
+
+static void
+run_bench(const char *name, unsigned flags, const uint64_t *keys)
+{
+	unsigned depth = 0, max_depth = 0;
+	struct timespec tv[2];
+	uint64_t seed[2], nsec;
+	thmap_t *map;
+
+	map = thmap_create(0, NULL, flags);
+	for (unsigned i = 0; i < NKEYS; i++) {
+		void *val = (void *)(uintptr_t)(i + 1);
+		thmap_put(map, &keys[i], sizeof(uint64_t), val);
+	}
+	thmap_getseed(map, seed);
+	for (unsigned i = 0; i < NKEYS; i++) {
+		const unsigned d = key_depth(flags, seed, keys, i);
+		max_depth = MAX(max_depth, d);
+		depth += d;
+	}
+
+	/* Warm up, then measure. */
+	for (unsigned n = 0; n < 2; n++) {
+		clock_gettime(CLOCK_MONOTONIC, &tv[0]);
+		for (unsigned i = 0; i < NLOOKUPS; i++) {
+			const uint64_t *key = &keys[i % NKEYS];
+
+			if (thmap_get(map, key, sizeof(uint64_t)) == NULL) {
+				abort();
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &tv[1]);
+	}
+	nsec = elapsed_nsec(tv);
+
+	printf("%-24s depth avg %5.2f max %2u %8.1f ns/lookup\n", name,
+	    (double)depth / NKEYS, max_depth, (double)nsec / NLOOKUPS);
+	thmap_destroy(map);
+}
+
+static void
+run_prefetch_bench(void)
+{
+	thmap_prefetch_t pf[PF_BATCH];
+	struct timespec tv[2];
+	uint64_t *keys, nsec;
+	thmap_t *map;
+
+	keys = malloc(PF_NKEYS * sizeof(uint64_t));
+	map = thmap_create(0, NULL, 0);
+	for (unsigned i = 0; i < PF_NKEYS; i++) {
+		keys[i] = fast_random();
+		thmap_put(map, &keys[i], sizeof(uint64_t), &keys[i]);
+	}
+
+	for (unsigned depth = 0; depth <= 1; depth++) {
+		clock_gettime(CLOCK_MONOTONIC, &tv[0]);
+		for (unsigned n = 0; n < NLOOKUPS; n += PF_BATCH) {
+			const uint64_t *batch[PF_BATCH];
+			bool more = depth != 0;
+
+			for (unsigned i = 0; i < PF_BATCH; i++) {
+				batch[i] = &keys[fast_random() % PF_NKEYS];
+			}
+
+			/*
+			 * Advance the prefetch of all keys in the batch,
+			 * one level at a time, before the lookups.
+			 */
+			for (unsigned i = 0; more && i < PF_BATCH; i++) {
+				thmap_prefetch_start(map, &pf[i],
+				    batch[i], sizeof(uint64_t));
+			}
+			while (more) {
+				more = false;
+				for (unsigned i = 0; i < PF_BATCH; i++) {
+					more |= thmap_prefetch_step(map,
+					    &pf[i]) != 0;
+				}
+			}
+			for (unsigned i = 0; i < PF_BATCH; i++) {
+				if (thmap_get(map, batch[i],
+				    sizeof(uint64_t)) != batch[i]) {
+					abort();
+				}
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &tv[1]);
+		nsec = elapsed_nsec(tv);
+
+		printf("%-24s %8.1f ns/lookup\n", depth ?
+		    "1M keys, prefetch" : "1M keys, no prefetch",
+		    (double)nsec / NLOOKUPS);
+	}
+	thmap_destroy(map);
+	free(keys);
+}
+
+static void
+run_cache_bench(void)
+{
+	struct timespec tv[2];
+	uint64_t *keys, nsec;
+	thmap_cache_t *cache;
+	thmap_t *map;
+
+	keys = malloc(PF_NKEYS * sizeof(uint64_t));
+	map = thmap_create(0, NULL, 0);
+	for (unsigned i = 0; i < PF_NKEYS; i++) {
+		keys[i] = fast_random();
+		thmap_put(map, &keys[i], sizeof(uint64_t), &keys[i]);
+	}
+	cache = thmap_cache_create(map, 4 * HOT_NKEYS);
+
+	for (unsigned cached = 0; cached <= 1; cached++) {
+		clock_gettime(CLOCK_MONOTONIC, &tv[0]);
+		for (unsigned n = 0; n < NLOOKUPS; n++) {
+			const uint64_t *key = &keys[fast_random() % HOT_NKEYS];
+			void *val = cached ?
+			    thmap_cache_get(cache, key, sizeof(uint64_t)) :
+			    thmap_get(map, key, sizeof(uint64_t));
+
+			if (val != key) {
+				abort();
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &tv[1]);
+		nsec = elapsed_nsec(tv);
+
+		printf("%-24s %8.1f ns/lookup\n", cached ?
+		    "1M keys, hot, cache" : "1M keys, hot, no cache",
+		    (double)nsec / NLOOKUPS);
+	}
+	thmap_cache_destroy(cache);
+	thmap_destroy(map);
+	free(keys);
+}
+
+static void
+join_func(const void *key, size_t len, void *aval, void *bval, void *arg)
+{
+	unsigned *nkeys = arg;
+
+	(void)key; (void)len; (void)aval; (void)bval;
+	(*nkeys)++;
+}
+
+static void
+run_join_bench(void)
+{
+	struct timespec tv[2];
+	uint64_t *keys, nsec;
+	thmap_t *a, *b;
+
+	keys = malloc(PF_NKEYS * sizeof(uint64_t));
+	for (unsigned i = 0; i < PF_NKEYS; i++) {
+		keys[i] = fast_random();
+	}
+	a = thmap_create(0, NULL, 0);
+	for (unsigned i = 0; i < PF_NKEYS / 2 + PF_NKEYS / 4; i++) {
+		thmap_put(a, &keys[i], sizeof(uint64_t), &keys[i]);
+	}
+
+	for (unsigned aligned = 0; aligned <= 1; aligned++) {
+		unsigned nkeys = 0;
+
+		b = thmap_create(0, NULL, aligned ? 0 : THMAP_RANDSEED);
+		for (unsigned i = PF_NKEYS / 4; i < PF_NKEYS; i++) {
+			thmap_put(b, &keys[i], sizeof(uint64_t), &keys[i]);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &tv[0]);
+		if (thmap_intersect(a, b, join_func, &nkeys) == -1 ||
+		    nkeys != PF_NKEYS / 2) {
+			abort();
+		}
+		clock_gettime(CLOCK_MONOTONIC, &tv[1]);
+		nsec = elapsed_nsec(tv);
+
+		printf("%-24s %8.1f ms\n", aligned ?
+		    "intersect, same seed" : "intersect, other seed",
+		    (double)nsec / 1000000);
+		thmap_destroy(b);
+	}
+	thmap_destroy(a);
+	free(keys);
+}
+
+static void
+run_digest_bench(void)
+{
+	struct timespec tv[2];
+	uint64_t *keys, nsec;
+	thmap_t *a, *b;
+
+	keys = malloc(PF_NKEYS * sizeof(uint64_t));
+	for (unsigned i = 0; i < PF_NKEYS; i++) {
+		keys[i] = fast_random();
+	}
+	for (unsigned digest = 0; digest <= 1; digest++) {
+		const unsigned flags = digest ? THMAP_DIGEST : 0;
+		unsigned nkeys = 0;
+
+		a = thmap_create(0, NULL, flags);
+		b = thmap_create(0, NULL, flags);
+		for (unsigned i = 0; i < PF_NKEYS; i++) {
+			thmap_put(a, &keys[i], sizeof(uint64_t), &keys[i]);
+			thmap_put(b, &keys[i], sizeof(uint64_t), &keys[i]);
+		}
+		for (unsigned i = 0; i < 16; i++) {
+			thmap_del(b, &keys[i * 1024], sizeof(uint64_t));
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &tv[0]);
+		if (thmap_compare(a, b, join_func, &nkeys) == -1 ||
+		    nkeys != 16) {
+			abort();
+		}
+		clock_gettime(CLOCK_MONOTONIC, &tv[1]);
+		nsec = elapsed_nsec(tv);
+
+		printf("%-24s %8.1f ms\n", digest ?
+		    "compare, THMAP_DIGEST" : "compare, no digests",
+		    (double)nsec / 1000000);
+		thmap_destroy(a);
+		thmap_destroy(b);
+	}
+	free(keys);
+}
+
+static size_t	bench_allocated;
+static size_t	bench_nallocs;
+
+static uintptr_t
+bench_alloc(size_t len)
+{
+	bench_allocated += len;
+	bench_nallocs++;
+	return (uintptr_t)malloc(len);
+}
+
+static void
+bench_free(uintptr_t addr, size_t len)
+{
+	bench_allocated -= len;
+	free((void *)addr);
+}
+
+static const thmap_ops_t bench_ops = {
+	.alloc = bench_alloc,
+	.free = bench_free
+};
+
+static void
+run_reclaim_bench(void)
+{
+	static const struct {
+		const char *	name;
+		unsigned	flags;
+	} modes[] = {
+		{ "epoch",	0		},
+		{ "hazard",	THMAP_HAZARD	},
+		{ "grace",	THMAP_GRACE	},
+	};
+	void *refs[HZ_NCYCLES];
+	struct timespec tv[2];
+	uint64_t *keys, nsec;
+	thmap_t *map;
+
+	keys = malloc(PF_NKEYS * sizeof(uint64_t));
+	for (unsigned i = 0; i < PF_NKEYS; i++) {
+		keys[i] = fast_random();
+	}
+	for (unsigned m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		const unsigned flags = modes[m].flags;
+		size_t live, peak = 0;
+		char label[32];
+
+		map = thmap_create(0, &bench_ops, flags);
+		for (unsigned i = 0; i < PF_NKEYS; i++) {
+			thmap_put(map, &keys[i], sizeof(uint64_t), &keys[i]);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &tv[0]);
+		for (unsigned n = 0; n < NLOOKUPS; n++) {
+			const uint64_t *key = &keys[fast_random() % PF_NKEYS];
+
+			if (thmap_get(map, key, sizeof(uint64_t)) != key) {
+				abort();
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &tv[1]);
+		nsec = elapsed_nsec(tv);
+
+		snprintf(label, sizeof(label), "1M keys, %s", modes[m].name);
+		printf("%-24s %8.1f ns/lookup\n", label,
+		    (double)nsec / NLOOKUPS);
+
+		/*
+		 * Re-insert the keys, i.e. replace the leaves, and stage
+		 * the old ones.  The epoch G/C has to wait for the stalled
+		 * reader; the hazard pointer and grace period G/C do not,
+		 * since the reader is not inside a lookup.
+		 */
+		live = bench_allocated;
+		nsec = 0;
+		for (unsigned c = 0; c < HZ_NCYCLES; c++) {
+			for (unsigned i = 0; i < HZ_NCHURN; i++) {
+				uint64_t *key = &keys[c * HZ_NCHURN + i];
+
+				thmap_del(map, key, sizeof(uint64_t));
+				thmap_put(map, key, sizeof(uint64_t), key);
+			}
+			refs[c] = thmap_stage_gc(map);
+			if (flags) {
+				clock_gettime(CLOCK_MONOTONIC, &tv[0]);
+				thmap_gc(map, refs[c]);
+				clock_gettime(CLOCK_MONOTONIC, &tv[1]);
+				nsec += elapsed_nsec(tv);
+			}
+			peak = MAX(peak, bench_allocated - live);
+		}
+		if (!flags) {
+			/* The reader resumed and passed the barrier. */
+			clock_gettime(CLOCK_MONOTONIC, &tv[0]);
+			for (unsigned c = 0; c < HZ_NCYCLES; c++) {
+				thmap_gc(map, refs[c]);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &tv[1]);
+			nsec = elapsed_nsec(tv);
+		}
+		snprintf(label, sizeof(label), "stalled reader, %s",
+		    modes[m].name);
+		printf("%-24s %8.1f KB unreclaimed %8.1f us/gc\n", label,
+		    (double)peak / 1024, (double)nsec / HZ_NCYCLES / 1000);
+		thmap_destroy(map);
+	}
+	free(keys);
+}
+
+typedef struct {
+	thmap_entry_t	entry;
+	uint64_t	key;
+} bench_obj_t;
+
+static void
+run_intrusive_bench(void)
+{
+	struct timespec tv[2];
+	bench_obj_t *objs;
+	thmap_t *map;
+
+	objs = calloc(IN_NOBJS, sizeof(bench_obj_t));
+	for (unsigned i = 0; i < IN_NOBJS; i++) {
+		objs[i].key = fast_random();
+	}
+	for (unsigned intrusive = 0; intrusive <= 1; intrusive++) {
+		uint64_t nsec = UINT64_MAX;
+		size_t nallocs = 0;
+
+		map = thmap_create(0, &bench_ops, THMAP_LAZYDEL |
+		    (intrusive ? THMAP_INTRUSIVE : THMAP_NOCOPY));
+
+		/*
+		 * Insert and delete the keys a few times, taking the best
+		 * round; the intermediate nodes are kept (THMAP_LAZYDEL).
+		 */
+		for (unsigned round = 0; round < IN_NROUNDS; round++) {
+			const size_t n = bench_nallocs;
+
+			clock_gettime(CLOCK_MONOTONIC, &tv[0]);
+			for (unsigned i = 0; i < IN_NOBJS; i++) {
+				bench_obj_t *obj = &objs[i];
+				void *ret;
+
+				ret = intrusive ?
+				    thmap_put_entry(map, &obj->entry,
+				    &obj->key, sizeof(uint64_t), obj) :
+				    thmap_put(map, &obj->key,
+				    sizeof(uint64_t), obj);
+				if (ret != obj) {
+					abort();
+				}
+			}
+			clock_gettime(CLOCK_MONOTONIC, &tv[1]);
+			nsec = MIN(nsec, elapsed_nsec(tv));
+			if (round) {
+				nallocs += bench_nallocs - n;
+			}
+
+			for (unsigned i = 0; i < IN_NOBJS; i++) {
+				thmap_del(map, &objs[i].key, sizeof(uint64_t));
+			}
+			thmap_gc(map, thmap_stage_gc(map));
+		}
+		printf("%-24s %8.1f ns/insert %8.2f allocs/insert\n",
+		    intrusive ? "insert, THMAP_INTRUSIVE" :
+		    "insert, THMAP_NOCOPY", (double)nsec / IN_NOBJS,
+		    (double)nallocs / IN_NOBJS / (IN_NROUNDS - 1));
+		thmap_destroy(map);
+	}
+	free(objs);
+}
+
+int
+main(void)
+{
+	uint64_t rkeys[NKEYS], ckeys[NKEYS];
+
+	for (unsigned i = 0; i < NKEYS; i++) {
+		rkeys[i] = fast_random();
+	}
+	craft_keys(ckeys, NKEYS);
+
+	run_bench("random, zero seed", 0, rkeys);
+	run_bench("crafted, zero seed", 0, ckeys);
+	run_bench("random, THMAP_RANDSEED", THMAP_RANDSEED, rkeys);
+	run_bench("crafted, THMAP_RANDSEED", THMAP_RANDSEED, ckeys);
+	run_bench("random, THMAP_SIPHASH", THMAP_SIPHASH, rkeys);
+	run_bench("crafted, THMAP_SIPHASH", THMAP_SIPHASH, ckeys);
+	run_prefetch_bench();
+	run_cache_bench();
+	run_join_bench();
+	run_digest_bench();
+	run_reclaim_bench();
+	run_intrusive_bench();
+	puts("ok");
+	return 0;
+}
@@ -7,6 +7,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -248,14 +250,1341 @@ fuzz_multi_512(void *arg)
 	return fuzz_multi(arg, 0x1ff);
 }
 
+static void *
+fuzz_prefetch(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+	thmap_prefetch_t pf;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		uint64_t key = fast_random() & 0x1ff;
+		void *keyval = (void *)(uintptr_t)key;
+		void *val;
+
+		switch (fast_random() & 3) {
+		case 0:
+		case 1: // prefetch and lookup, concurrently with the updates
+			thmap_prefetch_start(map, &pf, &key, sizeof(key));
+			while (thmap_prefetch_step(map, &pf))
+				;
+			val = thmap_get(map, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+			break;
+		case 2:
+			val = thmap_put(map, &key, sizeof(key), keyval);
+			CHECK_TRUE(val == keyval);
+			break;
+		case 3:
+			val = thmap_del(map, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+			break;
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) for (uint64_t key = 0; key <= 0x1ff; key++) {
+		thmap_del(map, &key, sizeof(key));
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void *
+fuzz_compact(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		uint64_t key = fast_random() & 0x1ff;
+		void *keyval = (void *)(uintptr_t)key;
+		void *val;
+
+		/*
+		 * THMAP_LAZYDEL: the empty nodes are left behind by the
+		 * deletes and collapsed by the primary thread, concurrently
+		 * with the lookups and the inserts into them.
+		 */
+		if (id == 0 && (n & 0xff) == 0) {
+			thmap_compact(map);
+			continue;
+		}
+		switch (fast_random() & 3) {
+		case 0:
+		case 1:
+			val = thmap_get(map, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+			break;
+		case 2:
+			val = thmap_put(map, &key, sizeof(key), keyval);
+			CHECK_TRUE(val == keyval);
+			break;
+		case 3:
+			val = thmap_del(map, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+			break;
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		for (uint64_t key = 0; key <= 0x1ff; key++) {
+			thmap_del(map, &key, sizeof(key));
+		}
+		thmap_compact(map);
+		CHECK_TRUE(thmap_compact(map) == 0);
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void *
+fuzz_del_batch(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 100 * 1000;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		uint64_t keys[16];
+		const void *kptrs[16];
+		size_t lens[16];
+		void *vals[16];
+
+		/*
+		 * Insert a few keys and delete a batch of the keys from
+		 * a range of 512 (which ought to create multiple levels).
+		 */
+		for (unsigned i = 0; i < 4; i++) {
+			uint64_t key = fast_random() & 0x1ff;
+			void *keyval = (void *)(uintptr_t)(key + 1);
+			CHECK_TRUE(thmap_put(map, &key, sizeof(key),
+			    keyval) == keyval);
+		}
+		for (unsigned i = 0; i < 16; i++) {
+			keys[i] = fast_random() & 0x1ff;
+			kptrs[i] = &keys[i];
+			lens[i] = sizeof(uint64_t);
+		}
+		thmap_del_batch(map, kptrs, lens, vals, 16);
+		for (unsigned i = 0; i < 16; i++) {
+			CHECK_TRUE(!vals[i] ||
+			    vals[i] == (void *)(uintptr_t)(keys[i] + 1));
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) for (uint64_t key = 0; key <= 0x1ff; key++) {
+		thmap_del(map, &key, sizeof(key));
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void *
+fuzz_del_if(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	void *myval = (void *)(uintptr_t)(id + 1);
+	unsigned n = 1 * 1000 * 1000;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		/*
+		 * Key range of 16 values: each thread inserts its own
+		 * value and the others must not be able to remove it.
+		 */
+		uint64_t key = fast_random() & 0xf;
+		void *val;
+
+		val = thmap_put(map, &key, sizeof(key), myval);
+		if (val == myval) {
+			CHECK_TRUE(thmap_del_if(map, &key,
+			    sizeof(key), myval) == 0);
+		} else {
+			CHECK_TRUE(thmap_del_if(map, &key,
+			    sizeof(key), myval) == -1);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) for (uint64_t key = 0; key <= 0xf; key++) {
+		CHECK_TRUE(thmap_get(map, &key, sizeof(key)) == NULL);
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void *
+fuzz_cache(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	const uint64_t mykey = 0x100 + id;
+	void *myval = (void *)(uintptr_t)(mykey + 1);
+	unsigned n = 1 * 1000 * 1000;
+	thmap_cache_t *cache;
+
+	cache = thmap_cache_create(map, 8);
+	CHECK_TRUE(cache != NULL);
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		/*
+		 * Key range of 32 values shared by all threads, plus the
+		 * own key: its cached entry must never be stale.
+		 */
+		uint64_t key = fast_random() & 0x1f;
+		void *keyval = (void *)(uintptr_t)(key + 1), *val;
+
+		switch (fast_random() & 0x3) {
+		case 0:
+			thmap_put(map, &key, sizeof(key), keyval);
+			break;
+		case 1:
+			thmap_del(map, &key, sizeof(key));
+			break;
+		case 2:
+			CHECK_TRUE(thmap_put(map, &mykey,
+			    sizeof(mykey), myval) == myval);
+			CHECK_TRUE(thmap_cache_get(cache, &mykey,
+			    sizeof(mykey)) == myval);
+			CHECK_TRUE(thmap_del(map, &mykey,
+			    sizeof(mykey)) == myval);
+			CHECK_TRUE(thmap_cache_get(cache, &mykey,
+			    sizeof(mykey)) == NULL);
+			break;
+		default:
+			val = thmap_cache_get(cache, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+			break;
+		}
+	}
+	pthread_barrier_wait(&barrier);
+	thmap_cache_destroy(cache);
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void
+join_check(const void *key, size_t len, void *aval, void *bval, void *arg)
+{
+	uint64_t k;
+
+	CHECK_TRUE(len == sizeof(k));
+	memcpy(&k, key, sizeof(k));
+	CHECK_TRUE(!aval || aval == (void *)(uintptr_t)(k + 1));
+	CHECK_TRUE(!bval || bval == (void *)(uintptr_t)(k + 1));
+	(*(unsigned *)arg)++;
+}
+
+static void *
+fuzz_join(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		/*
+		 * Key range of 512 values: thread 0 joins the map with
+		 * itself, walking both sides concurrently with the updates.
+		 */
+		uint64_t key = fast_random() & 0x1ff;
+		void *keyval = (void *)(uintptr_t)(key + 1);
+		unsigned nkeys = 0;
+
+		if (id == 0 && (n & 0xff) == 0) {
+			CHECK_TRUE(thmap_union(map, map,
+			    join_check, &nkeys) == 0);
+			CHECK_TRUE(nkeys <= 2 * 0x200);
+			continue;
+		}
+		if (fast_random() & 0x1) {
+			thmap_put(map, &key, sizeof(key), keyval);
+		} else {
+			thmap_del(map, &key, sizeof(key));
+		}
+	}
+	pthread_barrier_wait(&barrier);
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void *
+fuzz_digest(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		/*
+		 * Key range of 512 values: concurrent inserts and deletes
+		 * (which expand and collapse the levels) must keep the
+		 * subtree digests consistent.
+		 */
+		uint64_t key = fast_random() & 0x1ff;
+		void *keyval = (void *)(uintptr_t)(key + 1);
+
+		if (fast_random() & 0x1) {
+			thmap_put(map, &key, sizeof(key), keyval);
+		} else {
+			thmap_del(map, &key, sizeof(key));
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		thmap_t *copy = thmap_create(0, NULL, THMAP_DIGEST);
+		uint64_t digest, cdigest;
+		unsigned ndiffs = 0;
+
+		/* Rebuild the map: the digests must match. */
+		for (uint64_t key = 0; key <= 0x1ff; key++) {
+			void *val = thmap_get(map, &key, sizeof(key));
+
+			if (val) {
+				thmap_put(copy, &key, sizeof(key), val);
+			}
+		}
+		CHECK_TRUE(thmap_digest(copy, &cdigest) == 0);
+		CHECK_TRUE(thmap_digest(map, &digest) == 0);
+		CHECK_TRUE(digest == cdigest);
+		CHECK_TRUE(thmap_compare(map, copy,
+		    join_check, &ndiffs) == 0);
+		CHECK_TRUE(ndiffs == 0);
+		thmap_destroy(copy);
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void
+sample_check(const void *key, size_t len, void *val, void *arg)
+{
+	uint64_t k;
+
+	CHECK_TRUE(len == sizeof(k));
+	memcpy(&k, key, sizeof(k));
+	CHECK_TRUE(val == (void *)(uintptr_t)(k + 1));
+	(void)arg;
+}
+
+static void *
+fuzz_sample(void *arg)
+{
+	unsigned n = 1 * 1000 * 1000;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		/*
+		 * Key range of 512 values: sample concurrently with the
+		 * inserts and deletes.
+		 */
+		uint64_t key = fast_random() & 0x1ff;
+		void *keyval = (void *)(uintptr_t)(key + 1);
+
+		switch (fast_random() & 0x3) {
+		case 0:
+			thmap_sample(map, 1, sample_check, NULL);
+			break;
+		case 1:
+			thmap_del(map, &key, sizeof(key));
+			break;
+		default:
+			thmap_put(map, &key, sizeof(key), keyval);
+			break;
+		}
+	}
+	pthread_barrier_wait(&barrier);
+	pthread_exit(NULL);
+	(void)arg;
+	return NULL;
+}
+
+static void *
+fuzz_incr(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		/*
+		 * Key range of 32 values: contended increments and the
+		 * concurrent inserts of the same counter.
+		 */
+		uint64_t key = fast_random() & 0x1f;
+		uintptr_t cnt = thmap_incr(map, &key, sizeof(key), 1);
+		CHECK_TRUE(cnt > 0);
+	}
+	pthread_barrier_wait(&barrier);
+
+	/* The primary thread validates the total and cleans up. */
+	if (id == 0) {
+		uintptr_t total = 0;
+
+		for (uint64_t key = 0; key <= 0x1f; key++) {
+			total += (uintptr_t)thmap_del(map, &key, sizeof(key));
+		}
+		CHECK_TRUE(total == nworkers * 1000 * 1000);
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * The increments racing with the deletes of the counters: each one must
+ * be counted exactly once, either by a delete or in the final count.
+ */
+static atomic_uintptr_t	incr_ndeleted;
+
+static void *
+fuzz_incr_del(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000, nincr = 0;
+	uintptr_t ndeleted = 0;
+
+	if (id == 0) {
+		atomic_store_relaxed(&incr_ndeleted, 0);
+	}
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		uint64_t key = fast_random() & 0x7;
+
+		if ((fast_random() & 0xf) == 0) {
+			ndeleted += (uintptr_t)thmap_del(map,
+			    &key, sizeof(key));
+			continue;
+		}
+		CHECK_TRUE(thmap_incr(map, &key, sizeof(key), 1) > 0);
+		nincr++;
+	}
+	atomic_fetch_add(&incr_ndeleted, ndeleted - nincr);
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		uintptr_t total = atomic_load(&incr_ndeleted);
+
+		for (uint64_t key = 0; key <= 0x7; key++) {
+			total += (uintptr_t)thmap_del(map, &key, sizeof(key));
+		}
+		CHECK_TRUE(total == 0);
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void *
+fuzz_multimap(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+	void *vals[16];
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		uint64_t key = fast_random() & 0x7;
+		void *val = (void *)(uintptr_t)((fast_random() & 0xf) + 1);
+		size_t nvals;
+
+		switch (fast_random() & 7) {
+		case 0:
+		case 1:
+		case 2: // ~40% lookups
+			nvals = thmap_get_multi(map, &key, sizeof(key),
+			    vals, 16);
+			for (unsigned i = 0; i < MIN(nvals, 16); i++) {
+				CHECK_TRUE(vals[i] && (uintptr_t)vals[i] <= 16);
+			}
+			break;
+		case 3:
+		case 4:
+		case 5: // appends, concurrent with the sealing by del
+			CHECK_TRUE(thmap_put_multi(map, &key,
+			    sizeof(key), val) == 0);
+			break;
+		case 6:
+			thmap_del_value(map, &key, sizeof(key), val);
+			break;
+		case 7:
+			thmap_del(map, &key, sizeof(key));
+			break;
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) for (uint64_t key = 0; key <= 0x7; key++) {
+		thmap_del(map, &key, sizeof(key));
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * Appends to the partly full value chunks (or into the removed slots),
+ * racing with the deletion of the key: a successful put must be visible,
+ * unless the key got deleted after the append started.
+ */
+static atomic_uint		seal_ndels_started[4];
+static atomic_uint		seal_ndels_done[4];
+
+static void *
+fuzz_multi_seal(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+	void *vals[64];
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		const unsigned k = fast_random() & 0x3;
+		uint64_t key = k;
+		void *val = (void *)(uintptr_t)(((uintptr_t)id << 24) |
+		    ((n & 0xffffff) + 1));
+		unsigned ndels;
+		size_t nvals;
+		bool found;
+
+		switch (fast_random() & 3) {
+		case 0:
+			atomic_fetch_add(&seal_ndels_started[k], 1);
+			thmap_del(map, &key, sizeof(key));
+			atomic_fetch_add(&seal_ndels_done[k], 1);
+			break;
+		default:
+			ndels = atomic_load(&seal_ndels_done[k]);
+			CHECK_TRUE(thmap_put_multi(map, &key,
+			    sizeof(key), val) == 0);
+			nvals = thmap_get_multi(map, &key, sizeof(key),
+			    vals, 64);
+			if (nvals > 64) {
+				/* Too many to check; drop them. */
+				break;
+			}
+			found = false;
+			for (unsigned i = 0; i < nvals; i++) {
+				found |= vals[i] == val;
+			}
+			CHECK_TRUE(found ||
+			    atomic_load(&seal_ndels_started[k]) != ndels);
+			if (n & 1) {
+				/* Leave a removed slot to be re-used. */
+				thmap_del_value(map, &key, sizeof(key), val);
+			}
+			break;
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) for (uint64_t key = 0; key <= 0x3; key++) {
+		thmap_del(map, &key, sizeof(key));
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static atomic_uint		feed_nproducers;
+static uint64_t			feed_lastseq[16];
+static bool			feed_present[16];
+
+static void
+feed_apply(const thmap_rec_t *rec, void *arg)
+{
+	uint64_t key;
+
+	CHECK_TRUE(rec->len == sizeof(key));
+	memcpy(&key, rec->key, sizeof(key));
+	CHECK_TRUE(key < 16);
+
+	/* Last writer wins: the records are ordered by the sequence. */
+	if (rec->seq > feed_lastseq[key]) {
+		feed_lastseq[key] = rec->seq;
+		feed_present[key] = rec->op == THMAP_OP_PUT;
+	}
+	if (rec->op == THMAP_OP_PUT) {
+		CHECK_TRUE(rec->val == (void *)(uintptr_t)(key + 1));
+	}
+	(void)arg;
+}
+
+static void *
+fuzz_feed(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 100 * 1000;
+
+	/*
+	 * The primary thread is the consumer: it replicates the map
+	 * from the feed and then validates the replica.
+	 */
+	if (id == 0) {
+		CHECK_TRUE(thmap_feed_init(map, nworkers, 128 * 1024) == 0);
+		atomic_store_relaxed(&feed_nproducers, nworkers - 1);
+		memset(feed_lastseq, 0, sizeof(feed_lastseq));
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		while (atomic_load_acquire(&feed_nproducers)) {
+			thmap_feed_drain(map, feed_apply, NULL, 1024);
+		}
+		thmap_feed_drain(map, feed_apply, NULL, SIZE_MAX);
+		CHECK_TRUE(thmap_feed_lost(map) == 0);
+
+		for (uint64_t key = 0; key < 16; key++) {
+			void *val = thmap_get(map, &key, sizeof(key));
+			CHECK_TRUE((val != NULL) == feed_present[key]);
+			thmap_del(map, &key, sizeof(key));
+		}
+		pthread_exit(NULL);
+	}
+
+	while (n--) {
+		uint64_t key = fast_random() & 0xf;
+		void *val = (void *)(uintptr_t)(key + 1);
+
+		if (fast_random() & 1) {
+			thmap_put(map, &key, sizeof(key), val);
+		} else {
+			thmap_del(map, &key, sizeof(key));
+		}
+	}
+	atomic_fetch_sub_explicit(&feed_nproducers, 1, memory_order_release);
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static thmap_handle_t *		handle;
+static atomic_uint		handle_done;
+
+static thmap_t *
+build_gen_map(uintptr_t gen)
+{
+	thmap_t *m = thmap_create(0, NULL, 0);
+
+	CHECK_TRUE(m != NULL);
+	for (uint64_t key = 0; key < 1024; key++) {
+		void *val = (void *)((gen << 16) | (key + 1));
+		CHECK_TRUE(thmap_put(m, &key, sizeof(key), val) == val);
+	}
+	return m;
+}
+
+static void *
+fuzz_handle(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+
+	/*
+	 * The primary thread periodically rebuilds and publishes a new
+	 * map; the others check that they never see a partial map or a
+	 * mix of the generations within a batch.
+	 */
+	if (id == 0) {
+		handle = thmap_handle_create(build_gen_map(0));
+		atomic_store_relaxed(&handle_done, 0);
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		for (uintptr_t gen = 1; gen <= 100; gen++) {
+			thmap_t *m = build_gen_map(gen);
+			CHECK_TRUE(thmap_handle_publish(handle, m) == 0);
+		}
+		atomic_store_relaxed(&handle_done, 1);
+	} else {
+		while (!atomic_load_relaxed(&handle_done)) {
+			thmap_t *m = thmap_handle_get(handle);
+			uintptr_t gen = UINTPTR_MAX;
+
+			for (unsigned i = 0; i < 16; i++) {
+				uint64_t key = fast_random() & 0x3ff;
+				uintptr_t val = (uintptr_t)thmap_get(m,
+				    &key, sizeof(key));
+
+				CHECK_TRUE((val & 0xffff) == key + 1);
+				CHECK_TRUE(gen == UINTPTR_MAX || gen == val >> 16);
+				gen = val >> 16;
+			}
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	/*
+	 * No G/C while running: the old maps are chained through the
+	 * G/C lists and get destroyed here, in one go.
+	 */
+	if (id == 0) {
+		thmap_handle_destroy(handle);
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static atomic_uint		reseed_done;
+static atomic_ulong		reseed_nincr;
+
+static void *
+fuzz_reseed(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+
+	/*
+	 * The primary thread keeps migrating the map to the new seeds,
+	 * a few root slots at a time; the others insert, look up and
+	 * remove the keys, as well as increment the counters.  The keys
+	 * 0x400-0x4ff are never removed, hence must always be found.
+	 */
+	if (id == 0) {
+		for (uint64_t key = 0x400; key < 0x500; key++) {
+			void *val = (void *)(uintptr_t)(key + 1);
+			CHECK_TRUE(thmap_put(map, &key, sizeof(key), val) == val);
+		}
+		atomic_store_relaxed(&reseed_done, 0);
+		atomic_store_relaxed(&reseed_nincr, 0);
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		while (atomic_load_relaxed(&reseed_done) < nworkers - 1) {
+			if (thmap_reseed_step(map, 1) == 0) {
+				CHECK_TRUE(thmap_reseed_start(map) == 0);
+			}
+		}
+		while (thmap_reseed_step(map, 64))
+			;
+	} else {
+		while (n--) {
+			const unsigned r = fast_random();
+			uint64_t key = r & 0x4ff;
+			void *val = (void *)(uintptr_t)(key + 1), *ret;
+
+			switch ((r >> 12) & 0x3) {
+			case 0:
+				if (key < 0x400) {
+					ret = thmap_put(map, &key,
+					    sizeof(key), val);
+					CHECK_TRUE(ret == val);
+				}
+				break;
+			case 1:
+				if (key < 0x400) {
+					ret = thmap_del(map, &key,
+					    sizeof(key));
+					CHECK_TRUE(!ret || ret == val);
+				}
+				break;
+			case 2:
+				key |= 0x800;
+				CHECK_TRUE(thmap_incr(map, &key,
+				    sizeof(key), 1) > 0);
+				atomic_fetch_add(&reseed_nincr, 1);
+				break;
+			default:
+				ret = thmap_get(map, &key, sizeof(key));
+				CHECK_TRUE(ret == val || (!ret && key < 0x400));
+				break;
+			}
+		}
+		atomic_fetch_add(&reseed_done, 1);
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		uintptr_t total = 0;
+
+		for (uint64_t key = 0; key < 0x500; key++) {
+			void *val = (void *)(uintptr_t)(key + 1), *ret;
+
+			ret = thmap_del(map, &key, sizeof(key));
+			CHECK_TRUE(ret == val || (!ret && key < 0x400));
+		}
+		for (uint64_t key = 0x800; key < 0xd00; key++) {
+			total += (uintptr_t)thmap_del(map, &key, sizeof(key));
+		}
+		CHECK_TRUE(total == atomic_load_relaxed(&reseed_nincr));
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+#define	TXN_NPAIRS	64
+#define	TXN_NTOKENS	128
+
+static void *
+fuzz_txn(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+	uintptr_t ver[TXN_NPAIRS];
+
+	/*
+	 * The pairs of keys (0x0-0x7f) are replaced together, each pair
+	 * by its own thread, with the increasing versions: the version of
+	 * the second key, looked up after the first one, must not be lower.
+	 * The tokens are moved between the keys 0x100-0x17f by all threads,
+	 * hence their number must not change.  The keys 0x200-0x3ff are
+	 * inserted and removed to expand and collapse the levels, while
+	 * the primary thread keeps reseeding the map.
+	 */
+	for (unsigned p = 0; p < TXN_NPAIRS; p++) {
+		ver[p] = 1;
+	}
+	if (id == 0) {
+		for (uint64_t key = 0; key < 2 * TXN_NPAIRS; key++) {
+			thmap_put(map, &key, sizeof(key), (void *)ver[0]);
+		}
+		for (uint64_t t = 0; t < TXN_NTOKENS; t += 2) {
+			uint64_t key = 0x100 | t;
+			void *val = (void *)(uintptr_t)(key + 1);
+
+			thmap_put(map, &key, sizeof(key), val);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	while (n--) {
+		const unsigned r = fast_random();
+		const unsigned p = r % TXN_NPAIRS;
+		uint64_t k0 = 2 * p, k1 = 2 * p + 1;
+		thmap_txn_t *txn;
+		void *v0, *v1;
+
+		switch ((r >> 8) & 0x3) {
+		case 0:
+			if (p % nworkers != id) {
+				break;
+			}
+			v0 = (void *)++ver[p];
+			txn = thmap_txn_begin(map);
+			CHECK_TRUE(thmap_txn_replace(txn,
+			    &k0, sizeof(k0), v0) == 0);
+			CHECK_TRUE(thmap_txn_replace(txn,
+			    &k1, sizeof(k1), v0) == 0);
+			CHECK_TRUE(thmap_txn_commit(txn) == 0);
+			break;
+		case 1:
+			v0 = thmap_get(map, &k0, sizeof(k0));
+			v1 = thmap_get(map, &k1, sizeof(k1));
+			CHECK_TRUE(v0 && v1 && (uintptr_t)v1 >= (uintptr_t)v0);
+			break;
+		case 2:
+			k0 = 0x100 | ((r >> 12) % TXN_NTOKENS);
+			k1 = 0x100 | ((r >> 20) % TXN_NTOKENS);
+			if (k0 == k1) {
+				break;
+			}
+			txn = thmap_txn_begin(map);
+			thmap_txn_del(txn, &k0, sizeof(k0));
+			thmap_txn_put(txn, &k1, sizeof(k1),
+			    (void *)(uintptr_t)(k1 + 1));
+			thmap_txn_commit(txn);
+			break;
+		default:
+			k0 = 0x200 | ((r >> 12) & 0x1ff);
+			if (r & (1U << 24)) {
+				thmap_put(map, &k0, sizeof(k0),
+				    (void *)(uintptr_t)(k0 + 1));
+			} else {
+				thmap_del(map, &k0, sizeof(k0));
+			}
+			break;
+		}
+		if (id == 0 && (n & 0xfff) == 0 &&
+		    thmap_reseed_step(map, 1) == 0) {
+			CHECK_TRUE(thmap_reseed_start(map) == 0);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		thmap_t *copy = thmap_create(0, NULL, THMAP_DIGEST);
+		uint64_t digest, cdigest, seed[2];
+		unsigned ntokens = 0;
+
+		/* The digests depend on the seed. */
+		while (thmap_reseed_step(map, 64))
+			;
+		thmap_getseed(map, seed);
+		CHECK_TRUE(thmap_setseed(copy, seed) == 0);
+		for (uint64_t key = 0; key < 0x400; key++) {
+			void *val = thmap_get(map, &key, sizeof(key));
+
+			if (key >= 0x100 && val) {
+				CHECK_TRUE(val == (void *)(uintptr_t)(key + 1));
+				ntokens += key < 0x100 + TXN_NTOKENS;
+			}
+			if (val) {
+				thmap_put(copy, &key, sizeof(key), val);
+			}
+		}
+		CHECK_TRUE(ntokens == TXN_NTOKENS / 2);
+		CHECK_TRUE(thmap_digest(map, &digest) == 0);
+		CHECK_TRUE(thmap_digest(copy, &cdigest) == 0);
+		CHECK_TRUE(digest == 0 || digest == cdigest);
+		thmap_destroy(copy);
+
+		for (uint64_t key = 0; key < 0x400; key++) {
+			thmap_del(map, &key, sizeof(key));
+		}
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+#define	MOVE_NOBJS	64
+
+static atomic_uint		move_nstarted[MOVE_NOBJS];
+static atomic_uint		move_ndone[MOVE_NOBJS];
+
+static void *
+fuzz_move(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+
+	/*
+	 * Each object is moved back and forth between its two keys
+	 * (0x100+o and 0x200+o) by its own thread.  If at most one move
+	 * has committed meanwhile, then looking up A, B and A again must
+	 * find the object, whichever way it moved.  The keys 0x400-0x5ff
+	 * are inserted and removed, while the primary thread is reseeding.
+	 */
+	if (id == 0) {
+		for (uint64_t o = 0; o < MOVE_NOBJS; o++) {
+			uint64_t key = 0x100 | o;
+
+			atomic_store_relaxed(&move_nstarted[o], 0);
+			atomic_store_relaxed(&move_ndone[o], 0);
+			thmap_put(map, &key, sizeof(key), (void *)(o + 1));
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	while (n--) {
+		const unsigned r = fast_random();
+		const unsigned o = r % MOVE_NOBJS;
+		uint64_t ka = 0x100 | o, kb = 0x200 | o;
+		unsigned d, s;
+		void *va, *vb, *va2;
+
+		switch ((r >> 8) & 0x3) {
+		case 0:
+			if (o % nworkers != id) {
+				break;
+			}
+			d = atomic_load_relaxed(&move_ndone[o]);
+			atomic_store_relaxed(&move_nstarted[o], d + 1);
+			atomic_thread_fence(memory_order_seq_cst);
+			if (d & 1) {
+				CHECK_TRUE(thmap_move(map, &kb, sizeof(kb),
+				    &ka, sizeof(ka)) == 0);
+			} else {
+				CHECK_TRUE(thmap_move(map, &ka, sizeof(ka),
+				    &kb, sizeof(kb)) == 0);
+			}
+			atomic_store_release(&move_ndone[o], d + 1);
+			break;
+		case 1:
+			d = atomic_load_acquire(&move_ndone[o]);
+			va = thmap_get(map, &ka, sizeof(ka));
+			vb = thmap_get(map, &kb, sizeof(kb));
+			va2 = thmap_get(map, &ka, sizeof(ka));
+			atomic_thread_fence(memory_order_seq_cst);
+			s = atomic_load_relaxed(&move_nstarted[o]);
+			if (s - d <= 1) {
+				CHECK_TRUE(va || vb || va2);
+			}
+			CHECK_TRUE(!va || va == (void *)(uintptr_t)(o + 1));
+			CHECK_TRUE(!vb || vb == (void *)(uintptr_t)(o + 1));
+			break;
+		default:
+			ka = 0x400 | ((r >> 12) & 0x1ff);
+			if (r & (1U << 24)) {
+				thmap_put(map, &ka, sizeof(ka),
+				    (void *)(uintptr_t)(ka + 1));
+			} else {
+				thmap_del(map, &ka, sizeof(ka));
+			}
+			break;
+		}
+		if (id == 0 && (n & 0xfff) == 0 &&
+		    thmap_reseed_step(map, 1) == 0) {
+			CHECK_TRUE(thmap_reseed_start(map) == 0);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		for (uint64_t o = 0; o < MOVE_NOBJS; o++) {
+			const bool moved = move_ndone[o] & 1;
+			uint64_t ka = 0x100 | o, kb = 0x200 | o;
+
+			CHECK_TRUE(thmap_del(map, &ka, sizeof(ka)) ==
+			    (moved ? NULL : (void *)(o + 1)));
+			CHECK_TRUE(thmap_del(map, &kb, sizeof(kb)) ==
+			    (moved ? (void *)(o + 1) : NULL));
+		}
+		for (uint64_t key = 0x400; key < 0x600; key++) {
+			thmap_del(map, &key, sizeof(key));
+		}
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void *
+fuzz_reserve(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		/*
+		 * Key range of 4k values, inserted and removed while the
+		 * primary thread keeps topping up the pool.
+		 */
+		const unsigned r = fast_random();
+		uint64_t key = r & 0xfff;
+		void *keyval = (void *)(uintptr_t)(key + 1), *val;
+
+		if (r & 0x10000) {
+			val = thmap_put(map, &key, sizeof(key), keyval);
+			CHECK_TRUE(val == keyval);
+		} else {
+			val = thmap_del(map, &key, sizeof(key));
+			CHECK_TRUE(val == NULL || val == keyval);
+		}
+		if (id == 0 && (n & 0xff) == 0) {
+			CHECK_TRUE(thmap_reserve(map, 512) == 0);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) for (uint64_t key = 0; key <= 0xfff; key++) {
+		thmap_del(map, &key, sizeof(key));
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static atomic_uint		dtor_nlive;
+
 static void
-run_test(void *func(void *))
+dtor_free(void *val, void *arg)
+{
+	(void)arg;
+	atomic_fetch_sub(&dtor_nlive, 1);
+	free(val);
+}
+
+static void *
+fuzz_dtor(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+
+	/*
+	 * The values are allocated and destroyed by the G/C, which runs
+	 * in between the rounds.  Each value holds its key modulo 0x200;
+	 * the key is moved to the other half (XOR 0x200) or its value is
+	 * replaced.  The values which are found, removed or moved away
+	 * must be intact (still not destroyed) and none may be leaked.
+	 */
+	if (id == 0) {
+		atomic_store_relaxed(&dtor_nlive, 0);
+		CHECK_TRUE(thmap_setdtor(map, dtor_free, NULL) == 0);
+	}
+	pthread_barrier_wait(&barrier);
+
+	while (n--) {
+		const unsigned r = fast_random();
+		uint64_t key = r & 0x3ff, nkey = key ^ 0x200;
+		unsigned *val, *ret;
+		thmap_txn_t *txn;
+
+		switch ((r >> 10) & 0x3) {
+		case 0:
+			val = malloc(sizeof(unsigned));
+			*val = key & 0x1ff;
+			atomic_fetch_add(&dtor_nlive, 1);
+			ret = thmap_put(map, &key, sizeof(key), val);
+			if (ret != val) {
+				atomic_fetch_sub(&dtor_nlive, 1);
+				free(val);
+			}
+			CHECK_TRUE(*ret == (key & 0x1ff));
+			break;
+		case 1:
+			ret = thmap_del(map, &key, sizeof(key));
+			CHECK_TRUE(!ret || *ret == (key & 0x1ff));
+			break;
+		case 2:
+			thmap_move(map, &key, sizeof(key), &nkey, sizeof(nkey));
+			ret = thmap_get(map, &nkey, sizeof(nkey));
+			CHECK_TRUE(!ret || *ret == (key & 0x1ff));
+			break;
+		default:
+			val = malloc(sizeof(unsigned));
+			*val = key & 0x1ff;
+			atomic_fetch_add(&dtor_nlive, 1);
+			txn = thmap_txn_begin(map);
+			CHECK_TRUE(txn != NULL);
+			CHECK_TRUE(thmap_txn_replace(txn, &key,
+			    sizeof(key), val) == 0);
+			if (thmap_txn_commit(txn) == -1) {
+				atomic_fetch_sub(&dtor_nlive, 1);
+				free(val);
+			}
+			break;
+		}
+		if ((n & 0xffff) == 0) {
+			/* No references are held: run the G/C. */
+			pthread_barrier_wait(&barrier);
+			if (id == 0) {
+				thmap_gc(map, thmap_stage_gc(map));
+			}
+			pthread_barrier_wait(&barrier);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		for (uint64_t key = 0; key < 0x400; key++) {
+			thmap_del(map, &key, sizeof(key));
+		}
+		thmap_gc(map, thmap_stage_gc(map));
+		CHECK_TRUE(atomic_load_relaxed(&dtor_nlive) == 0);
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+#define	INTR_NKEYS	512
+
+typedef struct {
+	thmap_entry_t	entry;
+	uint64_t	key;
+	unsigned	state;
+} intr_obj_t;
+
+static intr_obj_t		intr_objs[INTR_NKEYS * 2];
+
+static void *
+fuzz_intrusive(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+
+	/*
+	 * THMAP_INTRUSIVE: each key has two objects, each owned by some
+	 * thread, which links and unlinks its entry.  The entry removed
+	 * is not re-used until the G/C round, since the lookups may still
+	 * reference it.  The primary thread is reseeding.
+	 */
+	if (id == 0) {
+		for (unsigned o = 0; o < INTR_NKEYS * 2; o++) {
+			intr_objs[o].key = o % INTR_NKEYS;
+			intr_objs[o].state = 0;
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	while (n--) {
+		const unsigned r = fast_random();
+		const unsigned o = r % (INTR_NKEYS * 2);
+		intr_obj_t *obj = &intr_objs[o], *ret;
+		uint64_t key = o % INTR_NKEYS;
+
+		if ((r >> 12) & 0x1) {
+			ret = thmap_get(map, &key, sizeof(key));
+			CHECK_TRUE(!ret || ret->key == key);
+		} else if (o % nworkers == id && obj->state == 0) {
+			ret = thmap_put_entry(map, &obj->entry, &obj->key,
+			    sizeof(obj->key), obj);
+			CHECK_TRUE(ret && ret->key == key);
+			obj->state = ret == obj;
+		} else if (o % nworkers == id && obj->state == 1) {
+			CHECK_TRUE(thmap_del_entry(map, &obj->entry) == 0);
+			obj->state = 2;
+		}
+		if (id == 0 && (n & 0xfff) == 0 &&
+		    thmap_reseed_step(map, 1) == 0) {
+			CHECK_TRUE(thmap_reseed_start(map) == 0);
+		}
+		if ((n & 0xffff) == 0) {
+			/* The removed entries may be re-used after G/C. */
+			pthread_barrier_wait(&barrier);
+			if (id == 0) {
+				thmap_gc(map, thmap_stage_gc(map));
+			}
+			for (unsigned i = id; i < INTR_NKEYS * 2;
+			    i += nworkers) {
+				if (intr_objs[i].state == 2) {
+					intr_objs[i].state = 0;
+				}
+			}
+			pthread_barrier_wait(&barrier);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		while (thmap_reseed_step(map, 64))
+			;
+		for (unsigned o = 0; o < INTR_NKEYS * 2; o++) {
+			intr_obj_t *obj = &intr_objs[o];
+
+			if (obj->state) {
+				CHECK_TRUE(thmap_del_entry(map, &obj->entry) ==
+				    (obj->state == 1 ? 0 : -1));
+			}
+		}
+		for (uint64_t key = 0; key < INTR_NKEYS; key++) {
+			CHECK_TRUE(thmap_get(map, &key, sizeof(key)) == NULL);
+		}
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static atomic_uint		lookup_gc_done;
+
+static void *
+lookup_gc_reader(void *arg)
+{
+	unsigned n = (uintptr_t)arg;
+
+	while (n--) {
+		uint64_t key = fast_random() & 0x4ff;
+		void *val = (void *)(uintptr_t)(key + 1), *ret;
+
+		ret = thmap_get(map, &key, sizeof(key));
+		CHECK_TRUE(ret == val || (!ret && key < 0x400));
+	}
+	return NULL;
+}
+
+static void *
+fuzz_lookup(void *arg, bool threads, unsigned nlookups)
+{
+	const unsigned id = (uintptr_t)arg;
+
+	/*
+	 * THMAP_HAZARD or THMAP_GRACE: the primary thread is the only
+	 * writer and runs G/C right after each batch of changes, with no
+	 * synchronisation with the lookups, as well as migrates the map
+	 * to the new seeds and moves the keys using the transactions.
+	 * The keys 0x400-0x4ff are never removed, hence must always be
+	 * found.  The lookups may run in the short-lived threads, which
+	 * re-use the records of the exited ones (THMAP_GRACE), or in more
+	 * threads than the hazard pointer records of a block (THMAP_HAZARD).
+	 */
+	if (id == 0) {
+		for (uint64_t key = 0x400; key < 0x500; key++) {
+			void *val = (void *)(uintptr_t)(key + 1), *ret;
+
+			ret = thmap_put(map, &key, sizeof(key), val);
+			CHECK_TRUE(ret == val);
+		}
+		atomic_store_relaxed(&lookup_gc_done, 0);
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		while (atomic_load_relaxed(&lookup_gc_done) < nworkers - 1) {
+			const unsigned r = fast_random();
+			uint64_t key = r & 0x3ff, nkey = (r >> 10) & 0x3ff;
+			void *val = (void *)(uintptr_t)(key + 1);
+			thmap_txn_t *txn;
+
+			switch ((r >> 20) & 0x3) {
+			case 0:
+				CHECK_TRUE(thmap_put(map, &key,
+				    sizeof(key), val) == val);
+				break;
+			case 1:
+				thmap_del(map, &key, sizeof(key));
+				break;
+			case 2:
+				txn = thmap_txn_begin(map);
+				CHECK_TRUE(txn != NULL);
+				thmap_txn_del(txn, &key, sizeof(key));
+				thmap_txn_put(txn, &nkey, sizeof(nkey),
+				    (void *)(uintptr_t)(nkey + 1));
+				thmap_txn_commit(txn);
+				break;
+			default:
+				if (thmap_reseed_step(map, 1) > 0 ||
+				    (r & 0xff) != 0) {
+					break;
+				}
+				CHECK_TRUE(thmap_reseed_start(map) == 0);
+				break;
+			}
+			if ((r & 0xf) == 0) {
+				thmap_gc(map, thmap_stage_gc(map));
+			}
+		}
+		while (thmap_reseed_step(map, 64))
+			;
+	} else if (threads) {
+		for (unsigned i = 0; i < 1000; i++) {
+			pthread_t thr;
+
+			if ((errno = pthread_create(&thr, NULL,
+			    lookup_gc_reader, (void *)(uintptr_t)1000)) != 0) {
+				err(EXIT_FAILURE, "pthread_create");
+			}
+			pthread_join(thr, NULL);
+		}
+		atomic_fetch_add(&lookup_gc_done, 1);
+	} else {
+		lookup_gc_reader((void *)(uintptr_t)nlookups);
+		atomic_fetch_add(&lookup_gc_done, 1);
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) for (uint64_t key = 0; key < 0x500; key++) {
+		thmap_del(map, &key, sizeof(key));
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void *
+fuzz_lookup_gc(void *arg)
+{
+	return fuzz_lookup(arg, false, 1000 * 1000);
+}
+
+static void *
+fuzz_lookup_gc_threads(void *arg)
+{
+	return fuzz_lookup(arg, true, 0);
+}
+
+static void *
+fuzz_lookup_gc_many(void *arg)
+{
+	return fuzz_lookup(arg, false, 50 * 1000);
+}
+
+static void
+run_test_workers(void *func(void *), unsigned flags, unsigned n)
 {
 	pthread_t *thr;
 
 	puts(".");
-	map = thmap_create(0, NULL, 0);
-	nworkers = sysconf(_SC_NPROCESSORS_CONF) + 1;
+	map = thmap_create(0, NULL, flags);
+	nworkers = n;
 
 	thr = malloc(sizeof(pthread_t) * nworkers);
 	pthread_barrier_init(&barrier, NULL, nworkers);
@@ -274,6 +1603,18 @@ run_test(void *func(void *))
 	free(thr);
 }
 
+static void
+run_test_flags(void *func(void *), unsigned flags)
+{
+	run_test_workers(func, flags, sysconf(_SC_NPROCESSORS_CONF) + 1);
+}
+
+static void
+run_test(void *func(void *))
+{
+	run_test_flags(func, 0);
+}
+
 int
 main(void)
 {
@@ -283,6 +1624,40 @@ main(void)
 	run_test(fuzz_multi_collision);
 	run_test(fuzz_multi_128);
 	run_test(fuzz_multi_512);
+	run_test_flags(fuzz_compact, THMAP_LAZYDEL);
+	run_test(fuzz_prefetch);
+	run_test(fuzz_del_batch);
+	run_test(fuzz_del_if);
+	run_test(fuzz_cache);
+	run_test(fuzz_join);
+	run_test(fuzz_sample);
+	run_test_flags(fuzz_digest, THMAP_DIGEST);
+	run_test_flags(fuzz_digest, THMAP_DIGEST | THMAP_LAZYDEL);
+	run_test(fuzz_incr);
+	run_test_flags(fuzz_incr, THMAP_DIGEST);
+	run_test(fuzz_incr_del);
+	run_test_flags(fuzz_incr_del, THMAP_DIGEST);
+	run_test_flags(fuzz_multimap, THMAP_MULTI);
+	run_test_flags(fuzz_multi_seal, THMAP_MULTI);
+	run_test(fuzz_feed);
+	run_test(fuzz_handle);
+	run_test(fuzz_reseed);
+	run_test(fuzz_txn);
+	run_test_flags(fuzz_txn, THMAP_DIGEST);
+	run_test_flags(fuzz_txn, THMAP_LAZYDEL);
+	run_test(fuzz_move);
+	run_test_flags(fuzz_move, THMAP_DIGEST);
+	run_test(fuzz_reserve);
+	run_test(fuzz_dtor);
+	run_test_flags(fuzz_dtor, THMAP_DIGEST);
+	run_test_flags(fuzz_intrusive, THMAP_INTRUSIVE);
+	run_test_flags(fuzz_intrusive, THMAP_INTRUSIVE | THMAP_LAZYDEL);
+	run_test_flags(fuzz_lookup_gc, THMAP_HAZARD);
+	run_test_flags(fuzz_lookup_gc, THMAP_HAZARD | THMAP_DIGEST);
+	run_test_workers(fuzz_lookup_gc_many, THMAP_HAZARD, 512);
+	run_test_flags(fuzz_lookup_gc, THMAP_GRACE);
+	run_test_flags(fuzz_lookup_gc, THMAP_GRACE | THMAP_LAZYDEL);
+	run_test_flags(fuzz_lookup_gc_threads, THMAP_GRACE);
 	puts("ok");
 	return 0;
 }
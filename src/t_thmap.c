@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <inttypes.h>
 #include <assert.h>
@@ -152,6 +153,107 @@ test_longkey(void)
 	free(buf);
 }
 
+static void
+test_incr(void)
+{
+	const unsigned nitems = 1024;
+	thmap_t *hmap;
+	uintptr_t cnt;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+
+	for (unsigned n = 1; n <= 3; n++) {
+		for (unsigned i = 0; i < nitems; i++) {
+			cnt = thmap_incr(hmap, &i, sizeof(int), i + 1);
+			assert(cnt == n * (i + 1));
+		}
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		void *ret = thmap_get(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(3 * (i + 1)));
+
+		cnt = thmap_incr(hmap, &i, sizeof(int), (uintptr_t)-1);
+		assert(cnt == 3 * (i + 1) - 1);
+
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(cnt));
+	}
+	thmap_destroy(hmap);
+}
+
+static void
+test_multi(void)
+{
+	const unsigned nkeys = 64, nvals = 100;
+	void *vals[128];
+	thmap_t *hmap;
+	size_t n;
+
+	hmap = thmap_create(0, NULL, THMAP_MULTI);
+	assert(hmap != NULL);
+
+	for (unsigned v = 1; v <= nvals; v++) {
+		for (unsigned i = 0; i < nkeys; i++) {
+			int ret = thmap_put_multi(hmap, &i, sizeof(int),
+			    NUM2PTR(v));
+			assert(ret == 0);
+		}
+	}
+	assert(thmap_put_multi(hmap, "x", 1, NULL) == -1);
+
+	for (unsigned i = 0; i < nkeys; i++) {
+		n = thmap_get_multi(hmap, &i, sizeof(int), vals, 128);
+		assert(n == nvals);
+		for (unsigned v = 0; v < nvals; v++) {
+			assert(vals[v] == NUM2PTR(v + 1));
+		}
+
+		/* Partial copy still returns the total count. */
+		n = thmap_get_multi(hmap, &i, sizeof(int), vals, 1);
+		assert(n == nvals && vals[0] == NUM2PTR(1));
+
+		/* Remove every even value. */
+		for (unsigned v = 2; v <= nvals; v += 2) {
+			int ret = thmap_del_value(hmap, &i, sizeof(int),
+			    NUM2PTR(v));
+			assert(ret == 0);
+		}
+		assert(thmap_del_value(hmap, &i, sizeof(int),
+		    NUM2PTR(2)) == -1);
+
+		n = thmap_get_multi(hmap, &i, sizeof(int), vals, 128);
+		assert(n == nvals / 2);
+		for (unsigned v = 0; v < n; v++) {
+			assert(vals[v] == NUM2PTR(2 * v + 1));
+		}
+
+		/* The removed slots are re-used, rather than appended. */
+		for (unsigned v = 2; v <= nvals; v += 2) {
+			int ret = thmap_put_multi(hmap, &i, sizeof(int),
+			    NUM2PTR(v));
+			assert(ret == 0);
+		}
+		n = thmap_get_multi(hmap, &i, sizeof(int), vals, 128);
+		assert(n == nvals);
+		for (unsigned v = 0; v < nvals; v++) {
+			assert(vals[v] == NUM2PTR(v + 1));
+		}
+	}
+	assert(thmap_put_multi(hmap, "x", 1, (void *)UINTPTR_MAX) == -1);
+	for (unsigned i = 0; i < nkeys; i++) {
+		/* The values are not exposed by the single-value calls. */
+		assert(thmap_get(hmap, &i, sizeof(int)) == NULL);
+		assert(thmap_del(hmap, &i, sizeof(int)) ==
+		    THMAP_MULTI_DELETED);
+		assert(thmap_del(hmap, &i, sizeof(int)) == NULL);
+		n = thmap_get_multi(hmap, &i, sizeof(int), vals, 128);
+		assert(n == 0);
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+}
+
 static void *
 generate_unique_key(unsigned idx, int *rlen)
 {
@@ -291,6 +393,1650 @@ test_mem(void)
 	assert(space_allocated == 0);
 }
 
+static size_t
+fill_prefix_keys(thmap_t *hmap, unsigned nitems, bool del)
+{
+	char key[64];
+	void *ret;
+	int len;
+
+	for (unsigned i = 0; i < nitems; i++) {
+		len = snprintf(key, sizeof(key), "/tenant/123/bucket/%u", i);
+		if (del) {
+			ret = thmap_del(hmap, key, len);
+		} else {
+			ret = thmap_put(hmap, key, len, NUM2PTR(i));
+		}
+		assert(ret == NUM2PTR(i));
+	}
+	return space_allocated;
+}
+
+static void
+test_prefix(void)
+{
+	uintptr_t baseptr = (uintptr_t)(void *)space;
+	const unsigned nitems = 256;
+	size_t used, pused;
+	char key[512];
+	thmap_t *hmap;
+	void *ret;
+	int len;
+
+	hmap = thmap_create(baseptr, &thmap_test_ops,
+	    THMAP_NOCOPY | THMAP_KEYPREFIX);
+	assert(hmap == NULL);
+	hmap = thmap_create(baseptr, &thmap_test_ops,
+	    THMAP_SETROOT | THMAP_KEYPREFIX);
+	assert(hmap == NULL);
+
+	/* Baseline: the memory used by the full key copies. */
+	hmap = thmap_create(baseptr, &thmap_test_ops, 0);
+	assert(hmap != NULL);
+	used = fill_prefix_keys(hmap, nitems, false);
+	fill_prefix_keys(hmap, nitems, true);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+	assert(space_allocated == 0);
+
+	hmap = thmap_create(baseptr, &thmap_test_ops, THMAP_KEYPREFIX);
+	assert(hmap != NULL);
+
+	/* Note: the shorter prefix must not be preferred. */
+	assert(thmap_add_prefix(hmap, "/tenant/", 8) == 0);
+	assert(thmap_add_prefix(hmap, "/tenant/123/bucket/", 19) == 0);
+	pused = fill_prefix_keys(hmap, nitems, false);
+	assert(pused < used);
+
+	/* Keys not matching any prefix, including a long one. */
+	ret = thmap_put(hmap, "/other", 6, NUM2PTR(0x55));
+	assert(ret == NUM2PTR(0x55));
+	memset(key, 'x', sizeof(key));
+	memcpy(key, "/tenant/", 8);
+	ret = thmap_put(hmap, key, sizeof(key), NUM2PTR(0x66));
+	assert(ret == NUM2PTR(0x66));
+
+	for (unsigned i = 0; i < nitems; i++) {
+		len = snprintf(key, sizeof(key), "/tenant/123/bucket/%u", i);
+		ret = thmap_get(hmap, key, len);
+		assert(ret == NUM2PTR(i));
+
+		/* Same suffix, but a different prefix. */
+		len = snprintf(key, sizeof(key), "/tenant/124/bucket/%u", i);
+		ret = thmap_get(hmap, key, len);
+		assert(ret == NULL);
+	}
+	assert(thmap_get(hmap, "/other", 6) == NUM2PTR(0x55));
+	assert(thmap_del(hmap, "/other", 6) == NUM2PTR(0x55));
+
+	memset(key, 'x', sizeof(key));
+	memcpy(key, "/tenant/", 8);
+	assert(thmap_del(hmap, key, sizeof(key)) == NUM2PTR(0x66));
+
+	fill_prefix_keys(hmap, nitems, true);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+
+	/* All space must be freed, including the prefixes. */
+	assert(space_allocated == 0);
+}
+
+static void
+feed_collect(const thmap_rec_t *rec, void *arg)
+{
+	thmap_rec_t *recs = arg;
+	unsigned i = 0;
+
+	while (recs[i].op) {
+		i++;
+	}
+	recs[i] = *rec;
+
+	/* The key is valid only during the call: keep the first byte. */
+	recs[i].key = NULL;
+	recs[i].len = (rec->len << 8) | *(const unsigned char *)rec->key;
+}
+
+static void
+test_feed(void)
+{
+	thmap_rec_t recs[16];
+	char key[100];
+	thmap_t *hmap;
+	size_t n;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+	assert(thmap_feed_drain(hmap, feed_collect, recs, 16) == 0);
+
+	assert(thmap_feed_init(hmap, 1, 0) == -1);
+	assert(thmap_feed_init(hmap, 1, 3) == 0); // rounded up to 4
+	assert(thmap_feed_init(hmap, 1, 4) == -1);
+
+	/* Only the successful operations are recorded. */
+	thmap_put(hmap, "a", 1, NUM2PTR(0x55));
+	thmap_put(hmap, "a", 1, NUM2PTR(0x66));
+	thmap_del(hmap, "b", 1);
+	thmap_del(hmap, "a", 1);
+	memset(key, 'k', sizeof(key));
+	thmap_put(hmap, key, sizeof(key), NUM2PTR(0x77));
+
+	memset(recs, 0, sizeof(recs));
+	n = thmap_feed_drain(hmap, feed_collect, recs, 16);
+	assert(n == 3);
+	assert(recs[0].op == THMAP_OP_PUT && recs[0].val == NUM2PTR(0x55));
+	assert(recs[0].len == ((1 << 8) | 'a'));
+	assert(recs[1].op == THMAP_OP_DEL && recs[1].val == NUM2PTR(0x55));
+	assert(recs[2].op == THMAP_OP_PUT && recs[2].val == NUM2PTR(0x77));
+	assert(recs[2].len == ((sizeof(key) << 8) | 'k'));
+	assert(recs[0].seq < recs[1].seq && recs[1].seq < recs[2].seq);
+	assert(thmap_feed_lost(hmap) == 0);
+
+	/* Bounded drain and the overflow. */
+	assert(thmap_incr(hmap, "c", 1, 2) == 2);
+	assert(thmap_incr(hmap, "c", 1, 3) == 5);
+	memset(recs, 0, sizeof(recs));
+	assert(thmap_feed_drain(hmap, feed_collect, recs, 1) == 1);
+	assert(recs[0].op == THMAP_OP_INCR && recs[0].val == NUM2PTR(2));
+
+	for (unsigned i = 0; i < 8; i++) {
+		thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+	}
+	assert(thmap_feed_lost(hmap) == 5);
+	memset(recs, 0, sizeof(recs));
+	assert(thmap_feed_drain(hmap, feed_collect, recs, 16) == 4);
+	assert(recs[0].op == THMAP_OP_INCR && recs[0].val == NUM2PTR(3));
+	assert(recs[3].op == THMAP_OP_PUT && recs[3].val == NUM2PTR(2));
+
+	/* Leave some records (including a long key) in the rings. */
+	thmap_del(hmap, key, sizeof(key));
+	thmap_del(hmap, "c", 1);
+	for (unsigned i = 0; i < 8; i++) {
+		thmap_del(hmap, &i, sizeof(int));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+}
+
+static void
+test_handle(void)
+{
+	uintptr_t baseptr = (uintptr_t)(void *)space;
+	thmap_handle_t *hdl;
+	thmap_t *hmap, *nmap, *omap;
+	size_t used;
+
+	hmap = thmap_create(baseptr, &thmap_test_ops, 0);
+	assert(hmap != NULL);
+	for (unsigned i = 0; i < 128; i++) {
+		thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+	}
+	hdl = thmap_handle_create(hmap);
+	assert(hdl != NULL);
+	assert(thmap_handle_get(hdl) == hmap);
+
+	/* Rebuild a new map and publish it. */
+	used = space_allocated;
+	nmap = thmap_create(baseptr, &thmap_test_ops, 0);
+	assert(nmap != NULL);
+	for (unsigned i = 0; i < 64; i++) {
+		thmap_put(nmap, &i, sizeof(int), NUM2PTR(i + 1));
+	}
+	used = space_allocated - used;
+
+	assert(thmap_handle_publish(hdl, NULL) == -1);
+
+	/* The G/C of these does not wait for the handle readers. */
+	omap = thmap_create(0, NULL, THMAP_HAZARD);
+	assert(omap != NULL);
+	assert(thmap_handle_create(omap) == NULL);
+	assert(thmap_handle_publish(hdl, omap) == -1);
+	thmap_destroy(omap);
+	omap = thmap_create(0, NULL, THMAP_GRACE);
+	assert(omap != NULL);
+	assert(thmap_handle_publish(hdl, omap) == -1);
+	thmap_destroy(omap);
+
+	assert(thmap_handle_publish(hdl, nmap) == 0);
+	assert(thmap_handle_get(hdl) == nmap);
+	assert(thmap_get(thmap_handle_get(hdl), "\0\0\0\0", 4) == NUM2PTR(1));
+
+	/* The old map (and its entries) is destroyed on G/C. */
+	thmap_gc(nmap, thmap_stage_gc(nmap));
+	assert(space_allocated == used);
+
+	/* The entries of the present map are released on destruction. */
+	thmap_handle_destroy(hdl);
+	assert(space_allocated == 0);
+}
+
+static void
+test_seed(void)
+{
+	uintptr_t baseptr = (uintptr_t)(void *)space;
+	const unsigned nitems = 64 * 1024;
+	uint64_t seed[2], oseed[2];
+	thmap_t *hmap, *omap;
+	uint8_t msg[16];
+	void *ret;
+
+	/* Random per-map seeds. */
+	hmap = thmap_create(0, NULL, THMAP_RANDSEED);
+	assert(hmap != NULL);
+	omap = thmap_create(0, NULL, THMAP_RANDSEED);
+	assert(omap != NULL);
+	thmap_getseed(hmap, seed);
+	thmap_getseed(omap, oseed);
+	assert(seed[0] != oseed[0] || seed[1] != oseed[1]);
+	thmap_destroy(omap);
+	thmap_destroy(hmap);
+
+	/* Keyed hash: the reference test vector (the 15-byte message). */
+	for (unsigned i = 0; i < 16; i++) {
+		msg[i] = i;
+	}
+	assert(siphash24(msg, 15, 0x0706050403020100ULL,
+	    0x0f0e0d0c0b0a0908ULL) == 0xa129ca6149be45e5ULL);
+
+	hmap = thmap_create(0, NULL, THMAP_SIPHASH);
+	assert(hmap != NULL);
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	assert(thmap_setseed(hmap, seed) == -1);
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_get(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+
+	/* Attach to the map in shared memory, using its seed. */
+	hmap = thmap_create(baseptr, &thmap_test_ops, THMAP_SIPHASH);
+	assert(hmap != NULL);
+	for (unsigned i = 0; i < 64; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	omap = thmap_create(baseptr, &thmap_test_ops,
+	    THMAP_SETROOT | THMAP_SIPHASH);
+	assert(omap != NULL);
+	thmap_getseed(hmap, seed);
+	assert(thmap_setseed(omap, seed) == 0);
+	assert(thmap_setroot(omap, thmap_getroot(hmap)) == 0);
+	for (unsigned i = 0; i < 64; i++) {
+		ret = thmap_get(omap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_destroy(omap);
+	thmap_destroy(hmap);
+	assert(space_allocated == 0);
+}
+
+static void
+test_reseed(void)
+{
+	uintptr_t baseptr = (uintptr_t)(void *)space;
+	const unsigned nitems = 64 * 1024;
+	uint64_t seed[2], oseed[2];
+	unsigned n = nitems;
+	thmap_t *hmap;
+	void *ret;
+	int left;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+	assert(thmap_reseed_step(hmap, 1) == 0);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_getseed(hmap, oseed);
+	assert(thmap_reseed_start(hmap) == 0);
+	assert(thmap_reseed_start(hmap) == -1);
+
+	/*
+	 * Move a few slots at a time, while the keys are being looked
+	 * up, removed and inserted in both generations.
+	 */
+	do {
+		left = thmap_reseed_step(hmap, 3);
+		assert(left >= 0);
+
+		for (unsigned i = n - nitems; i < n; i += 7) {
+			ret = thmap_get(hmap, &i, sizeof(int));
+			assert(ret == NUM2PTR(i));
+		}
+		for (unsigned i = 0; i < 256; i++, n++) {
+			const unsigned k = n - nitems;
+
+			ret = thmap_del(hmap, &k, sizeof(int));
+			assert(ret == NUM2PTR(k));
+			ret = thmap_put(hmap, &n, sizeof(int), NUM2PTR(n));
+			assert(ret == NUM2PTR(n));
+		}
+	} while (left);
+
+	thmap_getseed(hmap, seed);
+	assert(seed[0] != oseed[0] || seed[1] != oseed[1]);
+	for (unsigned i = n - nitems; i < n; i++) {
+		ret = thmap_get(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+
+	/* Not supported with the externally set root. */
+	hmap = thmap_create(baseptr, &thmap_test_ops, THMAP_SETROOT);
+	assert(hmap != NULL);
+	assert(thmap_reseed_start(hmap) == -1);
+	thmap_destroy(hmap);
+
+	/* All space must be freed, including the interrupted migration. */
+	for (unsigned i = 0; i < 2; i++) {
+		hmap = thmap_create(baseptr, &thmap_test_ops, 0);
+		assert(hmap != NULL);
+		for (unsigned j = 0; j < 128; j++) {
+			ret = thmap_put(hmap, &j, sizeof(int), NUM2PTR(j));
+			assert(ret == NUM2PTR(j));
+		}
+		assert(thmap_reseed_start(hmap) == 0);
+		left = thmap_reseed_step(hmap, i ? 64 : 32);
+		assert(left == (i ? 0 : 32));
+		for (unsigned j = 0; j < 128; j++) {
+			ret = thmap_get(hmap, &j, sizeof(int));
+			assert(ret == NUM2PTR(j));
+		}
+		thmap_destroy(hmap);
+		assert(space_allocated == 0);
+	}
+}
+
+static size_t	heap_allocated;
+
+static uintptr_t
+alloc_count_wrapper(size_t len)
+{
+	heap_allocated += len;
+	return (uintptr_t)malloc(len);
+}
+
+static void
+free_count_wrapper(uintptr_t addr, size_t len)
+{
+	assert(heap_allocated >= len);
+	heap_allocated -= len;
+	free((void *)addr);
+}
+
+static const thmap_ops_t thmap_count_ops = {
+	.alloc = alloc_count_wrapper,
+	.free = free_count_wrapper
+};
+
+static void
+test_lazydel(void)
+{
+	const unsigned nitems = 128;
+	size_t used, empty;
+	thmap_t *hmap;
+	void *ret;
+
+	hmap = thmap_create(0, &thmap_count_ops, THMAP_LAZYDEL);
+	assert(hmap != NULL);
+	empty = heap_allocated;
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	used = heap_allocated;
+	assert(thmap_compact(hmap) == 0);
+
+	/*
+	 * The empty nodes are left in place and re-used by the
+	 * subsequent inserts of the same keys.
+	 */
+	for (unsigned n = 0; n < 2; n++) {
+		for (unsigned i = 0; i < nitems; i++) {
+			ret = thmap_del(hmap, &i, sizeof(int));
+			assert(ret == NUM2PTR(i));
+			ret = thmap_get(hmap, &i, sizeof(int));
+			assert(ret == NULL);
+		}
+		thmap_gc(hmap, thmap_stage_gc(hmap));
+		assert(heap_allocated > empty);
+
+		for (unsigned i = 0; i < nitems; i++) {
+			ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+			assert(ret == NUM2PTR(i));
+		}
+		assert(heap_allocated == used);
+	}
+
+	/* Compact: only the root must remain. */
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	assert(thmap_compact(hmap) > 0);
+	assert(thmap_compact(hmap) == 0);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(heap_allocated == empty);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_destroy(hmap);
+	assert(heap_allocated == 0);
+}
+
+static void
+test_del_batch(void)
+{
+	const unsigned nitems = 4096, nbatch = 1024;
+	const void *keys[1024];
+	size_t lens[1024];
+	void *vals[1024];
+	uint64_t *ids;
+	thmap_t *hmap;
+	void *ret;
+
+	ids = calloc(nitems, sizeof(uint64_t));
+	assert(ids != NULL);
+	for (unsigned i = 0; i < nitems; i++) {
+		ids[i] = i;
+	}
+
+	for (unsigned m = 0; m < 2; m++) {
+		const unsigned flags = m ? THMAP_LAZYDEL : 0;
+
+		hmap = thmap_create(0, &thmap_count_ops, flags);
+		assert(hmap != NULL);
+
+		/* Every other key is present. */
+		for (unsigned i = 0; i < nitems; i += 2) {
+			ret = thmap_put(hmap, &ids[i], sizeof(uint64_t),
+			    NUM2PTR(i + 1));
+			assert(ret == NUM2PTR(i + 1));
+		}
+
+		/*
+		 * Remove in batches: the present and absent keys, with
+		 * a duplicate of the first key in each batch.
+		 */
+		for (unsigned b = 0; b < nitems; b += nbatch - 1) {
+			const unsigned n = MIN(nbatch - 1, nitems - b);
+			size_t ndel = 0;
+
+			for (unsigned i = 0; i < n; i++) {
+				keys[i] = &ids[b + i];
+				lens[i] = sizeof(uint64_t);
+				ndel += ((b + i) & 1) == 0;
+			}
+			keys[n] = keys[0];
+			lens[n] = lens[0];
+
+			assert(thmap_del_batch(hmap, keys, lens,
+			    vals, n + 1) == ndel);
+			for (unsigned i = 0; i < n; i++) {
+				const unsigned k = b + i;
+				ret = (k & 1) ? NULL : NUM2PTR(k + 1);
+				assert(vals[i] == ret);
+			}
+			assert(vals[n] == NULL);
+		}
+		for (unsigned i = 0; i < nitems; i++) {
+			ret = thmap_get(hmap, &ids[i], sizeof(uint64_t));
+			assert(ret == NULL);
+		}
+		assert(thmap_del_batch(hmap, keys, lens, NULL, 1) == 0);
+
+		thmap_compact(hmap);
+		thmap_gc(hmap, thmap_stage_gc(hmap));
+		thmap_destroy(hmap);
+		assert(heap_allocated == 0);
+	}
+	free(ids);
+}
+
+static void
+test_del_if(void)
+{
+	const unsigned nitems = 1024;
+	thmap_t *hmap;
+	void *ret;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		/* Another value: must stay. */
+		ret = NUM2PTR(i + 1);
+		assert(thmap_del_if(hmap, &i, sizeof(int), ret) == -1);
+		ret = thmap_get(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+
+		assert(thmap_del_if(hmap, &i, sizeof(int), NUM2PTR(i)) == 0);
+		ret = thmap_get(hmap, &i, sizeof(int));
+		assert(ret == NULL);
+		assert(thmap_del_if(hmap, &i, sizeof(int), NUM2PTR(i)) == -1);
+	}
+
+	/* Counters. */
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(thmap_incr(hmap, &i, sizeof(int), 5) == 5);
+		assert(thmap_del_if(hmap, &i, sizeof(int), NUM2PTR(4)) == -1);
+		assert(thmap_del_if(hmap, &i, sizeof(int), NUM2PTR(5)) == 0);
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+
+	/* Not applicable to the multimaps. */
+	hmap = thmap_create(0, NULL, THMAP_MULTI);
+	assert(hmap != NULL);
+	assert(thmap_put_multi(hmap, "a", 1, NUM2PTR(1)) == 0);
+	assert(thmap_del_if(hmap, "a", 1, NUM2PTR(1)) == -1);
+	thmap_destroy(hmap);
+}
+
+static void
+test_prefetch(void)
+{
+	const unsigned nitems = 64 * 1024;
+	thmap_prefetch_t pf;
+	thmap_t *hmap;
+	void *ret;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+
+	/* Empty map. */
+	thmap_prefetch(hmap, "x", 1);
+	thmap_prefetch_start(hmap, &pf, "x", 1);
+	assert(thmap_prefetch_step(hmap, &pf) == 0);
+	assert(thmap_prefetch_step(hmap, &pf) == 0);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	for (unsigned i = 0; i < 2 * nitems; i++) {
+		unsigned nsteps = 1;
+
+		/*
+		 * Present keys: at least the root slot, the top level,
+		 * the leaf and the key.
+		 */
+		thmap_prefetch(hmap, &i, sizeof(int));
+		thmap_prefetch_start(hmap, &pf, &i, sizeof(int));
+		while (thmap_prefetch_step(hmap, &pf)) {
+			nsteps++;
+		}
+		assert(i >= nitems || nsteps >= 3);
+		assert(nsteps < 16);
+
+		ret = thmap_get(hmap, &i, sizeof(int));
+		assert(ret == (i < nitems ? NUM2PTR(i) : NULL));
+	}
+	thmap_destroy(hmap);
+}
+
+static void
+test_cache(void)
+{
+	const unsigned nitems = 1024;
+	thmap_cache_t *cache;
+	thmap_t *hmap;
+	void *ret;
+
+	hmap = thmap_create(0, &thmap_count_ops, THMAP_MULTI);
+	assert(hmap != NULL);
+	assert(thmap_cache_create(hmap, 16) == NULL);
+	thmap_destroy(hmap);
+
+	hmap = thmap_create(0, &thmap_count_ops, 0);
+	assert(hmap != NULL);
+	assert(thmap_cache_create(hmap, 0) == NULL);
+
+	/* Small cache: the entries are replaced on collisions. */
+	cache = thmap_cache_create(hmap, 5);
+	assert(cache != NULL);
+	assert(thmap_cache_get(cache, "x", 1) == NULL);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	for (unsigned n = 0; n < 2; n++) {
+		for (unsigned i = 0; i < 2 * nitems; i++) {
+			ret = thmap_cache_get(cache, &i, sizeof(int));
+			assert(ret == (i < nitems ? NUM2PTR(i) : NULL));
+		}
+	}
+
+	/*
+	 * The deleted keys must not be returned, even if the leaves
+	 * are not yet reclaimed.  Re-inserted keys have the new values.
+	 */
+	for (unsigned i = 0; i < 8; i++) {
+		assert(thmap_cache_get(cache, &i, sizeof(int)) == NUM2PTR(i));
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+		assert(thmap_cache_get(cache, &i, sizeof(int)) == NULL);
+
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i + 1));
+		assert(ret == NUM2PTR(i + 1));
+		assert(thmap_cache_get(cache, &i, sizeof(int)) ==
+		    NUM2PTR(i + 1));
+	}
+
+	/* Cache the leaves, then reclaim them: no use-after-free. */
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_cache_get(cache, &i, sizeof(int));
+		assert(ret != NULL);
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret != NULL);
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_cache_get(cache, &i, sizeof(int));
+		assert(ret == NULL);
+	}
+	thmap_cache_destroy(cache);
+	thmap_destroy(hmap);
+	assert(heap_allocated == 0);
+}
+
+typedef struct {
+	unsigned	nboth;
+	unsigned	nleft;
+	unsigned	nright;
+} join_count_t;
+
+static void
+join_count(const void *key, size_t len, void *aval, void *bval, void *arg)
+{
+	join_count_t *cnt = arg;
+	unsigned i;
+
+	assert(len == sizeof(int));
+	memcpy(&i, key, sizeof(int));
+
+	/* The map a has [0, 3000) and the map b has [2000, 4000). */
+	if (aval && bval) {
+		assert(i >= 2000 && i < 3000);
+		assert(aval == NUM2PTR(i + 1) && bval == NUM2PTR(i + 2));
+		cnt->nboth++;
+	} else if (aval) {
+		assert(i < 2000 && aval == NUM2PTR(i + 1));
+		cnt->nleft++;
+	} else {
+		assert(i >= 3000 && i < 4000 && bval == NUM2PTR(i + 2));
+		cnt->nright++;
+	}
+}
+
+static void
+test_join(void)
+{
+	static const unsigned bflags[] = {
+		0, THMAP_RANDSEED, THMAP_KEYPREFIX
+	};
+	const unsigned all = THMAP_JOIN_BOTH | THMAP_JOIN_LEFT |
+	    THMAP_JOIN_RIGHT;
+
+	for (unsigned n = 0; n < 3; n++) {
+		join_count_t cnt;
+		thmap_t *a, *b;
+		void *ret;
+
+		/*
+		 * Aligned (the same seed, including the front-coded keys)
+		 * and not aligned maps.
+		 */
+		a = thmap_create(0, NULL, 0);
+		assert(a != NULL);
+		b = thmap_create(0, NULL, bflags[n]);
+		assert(b != NULL);
+
+		memset(&cnt, 0, sizeof(cnt));
+		assert(thmap_union(a, b, join_count, &cnt) == 0);
+		assert(cnt.nboth == 0 && cnt.nleft == 0 && cnt.nright == 0);
+
+		for (unsigned i = 0; i < 3000; i++) {
+			ret = thmap_put(a, &i, sizeof(int), NUM2PTR(i + 1));
+			assert(ret == NUM2PTR(i + 1));
+		}
+		for (unsigned i = 2000; i < 4000; i++) {
+			ret = thmap_put(b, &i, sizeof(int), NUM2PTR(i + 2));
+			assert(ret == NUM2PTR(i + 2));
+		}
+
+		memset(&cnt, 0, sizeof(cnt));
+		assert(thmap_intersect(a, b, join_count, &cnt) == 0);
+		assert(cnt.nboth == 1000 && cnt.nleft == 0 && cnt.nright == 0);
+
+		memset(&cnt, 0, sizeof(cnt));
+		assert(thmap_diff(a, b, join_count, &cnt) == 0);
+		assert(cnt.nboth == 0 && cnt.nleft == 2000 && cnt.nright == 0);
+
+		memset(&cnt, 0, sizeof(cnt));
+		assert(thmap_union(a, b, join_count, &cnt) == 0);
+		assert(cnt.nboth == 1000 && cnt.nleft == 2000 &&
+		    cnt.nright == 1000);
+
+		/* The root slots partition the keys. */
+		memset(&cnt, 0, sizeof(cnt));
+		for (unsigned i = 0; i < THMAP_JOIN_NSLOTS; i++) {
+			assert(thmap_join(a, b, all, i, 1,
+			    join_count, &cnt) == 0);
+		}
+		assert(cnt.nboth == 1000 && cnt.nleft == 2000 &&
+		    cnt.nright == 1000);
+		assert(thmap_join(a, b, all, THMAP_JOIN_NSLOTS, 1,
+		    join_count, &cnt) == -1);
+
+		thmap_destroy(a);
+		thmap_destroy(b);
+	}
+}
+
+static void
+digest_count(const void *key, size_t len, void *aval, void *bval, void *arg)
+{
+	unsigned *ndiffs = arg, i;
+
+	assert(len == sizeof(int));
+	memcpy(&i, key, sizeof(int));
+
+	/* See test_digest(): the key 5 deleted, 7 changed, 5000 added. */
+	assert((i == 5 && aval && !bval) ||
+	    (i == 7 && aval == NUM2PTR(i + 1) && bval == NUM2PTR(i)) ||
+	    (i == 5000 && !aval && bval));
+	(*ndiffs)++;
+}
+
+static uint64_t
+map_digest(thmap_t *hmap)
+{
+	uint64_t digest;
+
+	assert(thmap_digest(hmap, &digest) == 0);
+	return digest;
+}
+
+static void
+test_digest(void)
+{
+	static const unsigned cflags[] = {
+		THMAP_DIGEST, THMAP_DIGEST | THMAP_KEYPREFIX,
+		THMAP_DIGEST | THMAP_RANDSEED, 0
+	};
+	const unsigned nitems = 2000;
+	thmap_t *a, *b, *c;
+	unsigned ndiffs, i;
+	uint64_t digest;
+	void *ret;
+
+	assert(thmap_create(0, NULL, THMAP_DIGEST | THMAP_MULTI) == NULL);
+	a = thmap_create(0, NULL, THMAP_DIGEST);
+	assert(a != NULL);
+	b = thmap_create(0, NULL, THMAP_DIGEST);
+	assert(b != NULL);
+	assert(map_digest(a) == 0);
+
+	/* The same keys and values, inserted in the different order. */
+	for (i = 0; i < nitems; i++) {
+		const unsigned j = nitems - i - 1;
+
+		ret = thmap_put(a, &i, sizeof(int), NUM2PTR(i + 1));
+		assert(ret == NUM2PTR(i + 1));
+		ret = thmap_put(b, &j, sizeof(int), NUM2PTR(j + 1));
+		assert(ret == NUM2PTR(j + 1));
+	}
+	assert(map_digest(a) != 0);
+	assert(map_digest(a) == map_digest(b));
+
+	ndiffs = 0;
+	assert(thmap_compare(a, b, digest_count, &ndiffs) == 0);
+	assert(ndiffs == 0);
+
+	/* Delete, replace and add a key. */
+	i = 5;
+	ret = thmap_del(b, &i, sizeof(int));
+	assert(ret == NUM2PTR(i + 1));
+	i = 7;
+	ret = thmap_del(b, &i, sizeof(int));
+	assert(ret == NUM2PTR(i + 1));
+	ret = thmap_put(b, &i, sizeof(int), NUM2PTR(i));
+	assert(ret == NUM2PTR(i));
+	i = 5000;
+	ret = thmap_put(b, &i, sizeof(int), NUM2PTR(i));
+	assert(ret == NUM2PTR(i));
+	assert(map_digest(a) != map_digest(b));
+
+	/*
+	 * Compare against the same content with the digests, with the
+	 * front-coded keys, with a different seed and without digests.
+	 */
+	for (unsigned n = 0; n < 4; n++) {
+		c = thmap_create(0, NULL, cflags[n]);
+		assert(c != NULL);
+		for (i = 0; i < nitems; i++) {
+			ret = thmap_put(c, &i, sizeof(int), NUM2PTR(i + 1));
+			assert(ret == NUM2PTR(i + 1));
+		}
+		ndiffs = 0;
+		assert(thmap_compare(c, b, digest_count, &ndiffs) == 0);
+		assert(ndiffs == 3);
+		thmap_destroy(c);
+	}
+
+	/* The digests of the counters. */
+	for (i = 0; i < nitems; i++) {
+		const unsigned j = nitems - i - 1;
+
+		thmap_incr(a, &i, sizeof(int), 1);
+		thmap_incr(b, &j, sizeof(int), 1);
+	}
+	for (i = 0; i < nitems; i++) {
+		ret = thmap_del(a, &i, sizeof(int));
+		assert(ret != NULL);
+	}
+	assert(map_digest(a) == 0);
+	thmap_gc(a, thmap_stage_gc(a));
+	thmap_destroy(a);
+	thmap_destroy(b);
+
+	a = thmap_create(0, NULL, THMAP_DIGEST);
+	b = thmap_create(0, NULL, THMAP_DIGEST);
+	for (i = 0; i < nitems; i++) {
+		const unsigned j = nitems - i - 1;
+
+		assert(thmap_incr(a, &i, sizeof(int), i) == i);
+		assert(thmap_incr(a, &i, sizeof(int), 1) == i + 1);
+		assert(thmap_incr(b, &j, sizeof(int), 1) == 1);
+		assert(thmap_incr(b, &j, sizeof(int), j) == j + 1);
+	}
+	assert(map_digest(a) == map_digest(b));
+
+	/* Not available while reseeding: the seeds differ. */
+	assert(thmap_reseed_start(a) == 0);
+	assert(thmap_digest(a, &digest) == -1);
+	while (thmap_reseed_step(a, 1) > 0) {
+		assert(thmap_digest(a, &digest) == -1);
+	}
+	assert(thmap_digest(a, &digest) == 0);
+	assert(digest != 0);
+	thmap_gc(a, thmap_stage_gc(a));
+	thmap_destroy(a);
+	thmap_destroy(b);
+}
+
+static void
+sample_count(const void *key, size_t len, void *val, void *arg)
+{
+	unsigned *counts = arg, i;
+
+	assert(len == sizeof(int));
+	memcpy(&i, key, sizeof(int));
+	assert(val == NUM2PTR(i + 1));
+	counts[i]++;
+}
+
+static void
+test_sample(void)
+{
+	const unsigned nitems = 1000, nsamples = 200 * 1000;
+	unsigned *counts;
+	double chi2 = 0;
+	thmap_t *hmap;
+	void *ret;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+	counts = calloc(nitems, sizeof(unsigned));
+	assert(counts != NULL);
+
+	assert(thmap_sample(hmap, 1, sample_count, counts) == 0);
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i + 1));
+		assert(ret == NUM2PTR(i + 1));
+	}
+
+	/*
+	 * The leaves are at the different depths: the samples must be
+	 * approximately uniform nevertheless (chi-squared test; 999
+	 * degrees of freedom, the critical value for p = 1e-6 is ~1250).
+	 */
+	assert(thmap_sample(hmap, nsamples, sample_count, counts) == nsamples);
+	for (unsigned i = 0; i < nitems; i++) {
+		const double e = (double)nsamples / nitems;
+		const double d = counts[i] - e;
+		chi2 += d * d / e;
+	}
+	assert(chi2 < 1300);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i + 1));
+	}
+	assert(thmap_sample(hmap, 1, sample_count, counts) == 0);
+	thmap_destroy(hmap);
+	free(counts);
+}
+
+static void
+test_txn(void)
+{
+	static const unsigned tflags[] = {
+		0, THMAP_DIGEST, THMAP_LAZYDEL, THMAP_KEYPREFIX
+	};
+	const unsigned nitems = 1024;
+	static unsigned keys[1024];
+	thmap_txn_t *txn;
+	thmap_t *hmap;
+	void *ret;
+
+	/* The keys must stay valid until the commit. */
+	for (unsigned i = 0; i < nitems; i++) {
+		keys[i] = i;
+	}
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+
+	/* Insert into the empty map. */
+	txn = thmap_txn_begin(hmap);
+	assert(txn != NULL);
+	assert(thmap_txn_put(txn, "a", 1, NUM2PTR(1)) == 0);
+	assert(thmap_txn_put(txn, "b", 1, NUM2PTR(2)) == 0);
+	assert(thmap_txn_del(txn, "a", 1) == -1); // the same key
+	assert(thmap_txn_commit(txn) == 0);
+	assert(thmap_get(hmap, "a", 1) == NUM2PTR(1));
+	assert(thmap_get(hmap, "b", 1) == NUM2PTR(2));
+
+	/* Move the value: delete one key and insert another. */
+	txn = thmap_txn_begin(hmap);
+	assert(thmap_txn_del(txn, "a", 1) == 0);
+	assert(thmap_txn_put(txn, "c", 1, NUM2PTR(1)) == 0);
+	assert(thmap_txn_replace(txn, "b", 1, NUM2PTR(3)) == 0);
+	assert(thmap_txn_commit(txn) == 0);
+	assert(thmap_get(hmap, "a", 1) == NULL);
+	assert(thmap_get(hmap, "b", 1) == NUM2PTR(3));
+	assert(thmap_get(hmap, "c", 1) == NUM2PTR(1));
+
+	/* Any unmet condition: none of the changes are applied. */
+	txn = thmap_txn_begin(hmap);
+	assert(thmap_txn_put(txn, "d", 1, NUM2PTR(4)) == 0);
+	assert(thmap_txn_replace(txn, "b", 1, NUM2PTR(5)) == 0);
+	assert(thmap_txn_put(txn, "c", 1, NUM2PTR(6)) == 0);
+	assert(thmap_txn_commit(txn) == -1);
+	txn = thmap_txn_begin(hmap);
+	assert(thmap_txn_replace(txn, "b", 1, NUM2PTR(5)) == 0);
+	assert(thmap_txn_del(txn, "a", 1) == 0);
+	assert(thmap_txn_commit(txn) == -1);
+	assert(thmap_get(hmap, "b", 1) == NUM2PTR(3));
+	assert(thmap_get(hmap, "c", 1) == NUM2PTR(1));
+	assert(thmap_get(hmap, "d", 1) == NULL);
+
+	/* Abort. */
+	txn = thmap_txn_begin(hmap);
+	assert(thmap_txn_del(txn, "b", 1) == 0);
+	thmap_txn_abort(txn);
+	assert(thmap_get(hmap, "b", 1) == NUM2PTR(3));
+
+	/* The limit. */
+	txn = thmap_txn_begin(hmap);
+	for (unsigned i = 0; i < THMAP_TXN_MAX; i++) {
+		assert(thmap_txn_put(txn, &keys[i], sizeof(int),
+		    NUM2PTR(1)) == 0);
+	}
+	assert(thmap_txn_put(txn, "e", 1, NUM2PTR(1)) == -1);
+	thmap_txn_abort(txn);
+
+	assert(thmap_del(hmap, "b", 1) == NUM2PTR(3));
+	assert(thmap_del(hmap, "c", 1) == NUM2PTR(1));
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+
+	/*
+	 * Many keys, expanding and collapsing the levels: insert in
+	 * groups, then move each key to another one and replace the
+	 * values, finally delete.
+	 */
+	for (unsigned f = 0; f < 4; f++) {
+		thmap_t *copy;
+
+		hmap = thmap_create(0, NULL, tflags[f]);
+		assert(hmap != NULL);
+		if (tflags[f] & THMAP_KEYPREFIX) {
+			assert(thmap_add_prefix(hmap, "\0\0", 2) == 0);
+		}
+		for (unsigned i = 0; i < nitems; i += 4) {
+			txn = thmap_txn_begin(hmap);
+			for (unsigned j = i; j < i + 4; j++) {
+				assert(thmap_txn_put(txn, &keys[j],
+				    sizeof(int), NUM2PTR(j + 1)) == 0);
+			}
+			assert(thmap_txn_commit(txn) == 0);
+		}
+		for (unsigned i = 0; i < nitems; i += 2) {
+			unsigned k0 = i, k1 = i + 1, k2 = i + nitems;
+
+			txn = thmap_txn_begin(hmap);
+			assert(thmap_txn_del(txn, &k0, sizeof(int)) == 0);
+			assert(thmap_txn_put(txn, &k2, sizeof(int),
+			    NUM2PTR(k0 + 1)) == 0);
+			assert(thmap_txn_replace(txn, &k1, sizeof(int),
+			    NUM2PTR(k1 + 2)) == 0);
+			assert(thmap_txn_commit(txn) == 0);
+		}
+
+		copy = thmap_create(0, NULL, tflags[f] & THMAP_DIGEST);
+		for (unsigned i = 0; i < 2 * nitems; i++) {
+			const unsigned odd = i % 2;
+			void *val = NUM2PTR(i < nitems ? (odd ? i + 2 : 0) :
+			    i - nitems + 1);
+
+			ret = thmap_get(hmap, &i, sizeof(int));
+			assert(ret == (odd && i >= nitems ? NULL : val));
+			if (ret) {
+				thmap_put(copy, &i, sizeof(int), ret);
+			}
+		}
+		assert(map_digest(hmap) == map_digest(copy));
+		thmap_destroy(copy);
+
+		for (unsigned i = 0; i < 2 * nitems; i++) {
+			txn = thmap_txn_begin(hmap);
+			assert(thmap_txn_del(txn, &i, sizeof(int)) == 0);
+			assert(thmap_txn_commit(txn) ==
+			    ((i % 2 == 0) == (i < nitems) ? -1 : 0));
+		}
+		assert(map_digest(hmap) == 0);
+		thmap_compact(hmap);
+		thmap_gc(hmap, thmap_stage_gc(hmap));
+		thmap_destroy(hmap);
+	}
+
+	/* Not applicable to the multimaps. */
+	hmap = thmap_create(0, NULL, THMAP_MULTI);
+	assert(hmap != NULL);
+	assert(thmap_txn_begin(hmap) == NULL);
+	thmap_destroy(hmap);
+}
+
+static void
+test_move(void)
+{
+	static const unsigned tflags[] = { 0, THMAP_DIGEST, THMAP_LAZYDEL };
+	const unsigned nitems = 1024;
+	thmap_t *hmap;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+	assert(thmap_put(hmap, "a", 1, NUM2PTR(1)) == NUM2PTR(1));
+	assert(thmap_put(hmap, "b", 1, NUM2PTR(2)) == NUM2PTR(2));
+
+	assert(thmap_move(hmap, "a", 1, "c", 1) == 0);
+	assert(thmap_get(hmap, "a", 1) == NULL);
+	assert(thmap_get(hmap, "c", 1) == NUM2PTR(1));
+
+	/* The new key is present, the old one is not or the same key. */
+	assert(thmap_move(hmap, "b", 1, "c", 1) == -1);
+	assert(thmap_move(hmap, "a", 1, "d", 1) == -1);
+	assert(thmap_move(hmap, "b", 1, "b", 1) == -1);
+	assert(thmap_get(hmap, "b", 1) == NUM2PTR(2));
+	assert(thmap_get(hmap, "c", 1) == NUM2PTR(1));
+	assert(thmap_get(hmap, "d", 1) == NULL);
+
+	assert(thmap_del(hmap, "b", 1) == NUM2PTR(2));
+	assert(thmap_del(hmap, "c", 1) == NUM2PTR(1));
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+
+	/* Move all keys to the other range and back. */
+	for (unsigned f = 0; f < 3; f++) {
+		thmap_t *copy;
+
+		hmap = thmap_create(0, NULL, tflags[f]);
+		assert(hmap != NULL);
+		for (unsigned i = 0; i < nitems; i++) {
+			thmap_put(hmap, &i, sizeof(int), NUM2PTR(i + 1));
+		}
+		for (unsigned i = 0; i < nitems; i++) {
+			unsigned k = i + nitems;
+			assert(thmap_move(hmap, &i, sizeof(int),
+			    &k, sizeof(int)) == 0);
+		}
+		copy = thmap_create(0, NULL, tflags[f] & THMAP_DIGEST);
+		for (unsigned i = 0; i < 2 * nitems; i++) {
+			void *ret = thmap_get(hmap, &i, sizeof(int));
+
+			assert(ret == (i < nitems ?
+			    NULL : NUM2PTR(i - nitems + 1)));
+			if (ret) {
+				thmap_put(copy, &i, sizeof(int), ret);
+			}
+		}
+		assert(map_digest(hmap) == map_digest(copy));
+		thmap_destroy(copy);
+
+		for (unsigned i = 0; i < nitems; i++) {
+			unsigned k = i + nitems;
+			assert(thmap_move(hmap, &k, sizeof(int),
+			    &i, sizeof(int)) == 0);
+			assert(thmap_del(hmap, &i, sizeof(int)) ==
+			    NUM2PTR(i + 1));
+		}
+		assert(map_digest(hmap) == 0);
+		thmap_compact(hmap);
+		thmap_gc(hmap, thmap_stage_gc(hmap));
+		thmap_destroy(hmap);
+	}
+
+	hmap = thmap_create(0, NULL, THMAP_MULTI);
+	assert(hmap != NULL);
+	assert(thmap_move(hmap, "a", 1, "b", 1) == -1);
+	thmap_destroy(hmap);
+}
+
+static void
+test_reserve(void)
+{
+	const unsigned nitems = 512;
+	static unsigned keys[512];
+	size_t used;
+	thmap_t *hmap;
+	void *ret;
+
+	for (unsigned i = 0; i < nitems; i++) {
+		keys[i] = i;
+	}
+	hmap = thmap_create(0, &thmap_count_ops, THMAP_NOCOPY);
+	assert(hmap != NULL);
+
+	/* The puts take the leaves and nodes from the pool. */
+	assert(thmap_reserve(hmap, 2 * nitems) == 0);
+	used = heap_allocated;
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &keys[i], sizeof(int), NUM2PTR(i + 1));
+		assert(ret == NUM2PTR(i + 1));
+	}
+	assert(heap_allocated == used);
+
+	/* Top up what was taken; nothing if the pool is full. */
+	assert(thmap_reserve(hmap, 2 * nitems) == 0);
+	assert(heap_allocated > used);
+	used = heap_allocated;
+	assert(thmap_reserve(hmap, 2 * nitems) == 0);
+	assert(heap_allocated == used);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(thmap_get(hmap, &keys[i], sizeof(int)) ==
+		    NUM2PTR(i + 1));
+	}
+	for (unsigned i = 0; i < nitems / 2; i++) {
+		assert(thmap_del(hmap, &keys[i], sizeof(int)) ==
+		    NUM2PTR(i + 1));
+	}
+
+	/*
+	 * G/C recycles the leaves and nodes into the pool: the same
+	 * keys can be inserted again without the allocator.
+	 */
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	used = heap_allocated;
+	for (unsigned i = 0; i < nitems / 8; i++) {
+		ret = thmap_put(hmap, &keys[i], sizeof(int), NUM2PTR(i + 1));
+		assert(ret == NUM2PTR(i + 1));
+	}
+	assert(heap_allocated == used);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		thmap_del(hmap, &keys[i], sizeof(int));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+
+	/* All memory is freed, including the pool. */
+	assert(heap_allocated == 0);
+}
+
+static void
+test_gc_step(void)
+{
+	const unsigned nitems = 1024;
+	unsigned nsteps = 0;
+	size_t used, prev;
+	thmap_t *hmap;
+	void *ref, *ret;
+
+	hmap = thmap_create(0, &thmap_count_ops, 0);
+	assert(hmap != NULL);
+	used = heap_allocated;
+
+	/* Nothing staged: nothing to do. */
+	assert(thmap_gc_step(hmap, thmap_stage_gc(hmap), 1, 0) == NULL);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i + 1));
+		assert(ret == NUM2PTR(i + 1));
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i + 1));
+	}
+
+	/*
+	 * Release a few objects at a time: each step makes progress,
+	 * at least a leaf and a key per item have to be released.
+	 */
+	ref = thmap_stage_gc(hmap);
+	prev = heap_allocated;
+	while ((ref = thmap_gc_step(hmap, ref, 16, 0)) != NULL) {
+		assert(heap_allocated < prev);
+		prev = heap_allocated;
+		nsteps++;
+	}
+	assert(nsteps >= (2 * nitems) / 16 - 1);
+	assert(heap_allocated == used);
+
+	/* Time-bounded steps, finished with thmap_gc(). */
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i + 1));
+		assert(ret == NUM2PTR(i + 1));
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i + 1));
+	}
+	ref = thmap_gc_step(hmap, thmap_stage_gc(hmap), 0, 1);
+	thmap_gc(hmap, ref);
+	assert(heap_allocated == used);
+
+	thmap_destroy(hmap);
+	assert(heap_allocated == 0);
+}
+
+static void
+test_hazard(void)
+{
+	const unsigned nitems = 1024;
+	unsigned okey, nkey;
+	thmap_txn_t *txn;
+	thmap_t *hmap;
+	void *ret;
+
+	/* The value lists are not protected. */
+	hmap = thmap_create(0, NULL, THMAP_HAZARD | THMAP_MULTI);
+	assert(hmap == NULL);
+
+	hmap = thmap_create(0, &thmap_count_ops, THMAP_HAZARD);
+	assert(hmap != NULL);
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i + 1));
+		assert(ret == NUM2PTR(i + 1));
+	}
+
+	/* The lookups across the generations, while migrating. */
+	assert(thmap_reseed_start(hmap) == 0);
+	while (thmap_reseed_step(hmap, 1) > 0) {
+		for (unsigned i = 0; i < nitems; i += 7) {
+			ret = thmap_get(hmap, &i, sizeof(int));
+			assert(ret == NUM2PTR(i + 1));
+		}
+		thmap_gc(hmap, thmap_stage_gc(hmap));
+	}
+
+	/* Move a key using the transaction. */
+	okey = 0;
+	nkey = nitems;
+	txn = thmap_txn_begin(hmap);
+	assert(thmap_txn_del(txn, &nkey, sizeof(int)) == 0);
+	assert(thmap_txn_commit(txn) == -1);
+	txn = thmap_txn_begin(hmap);
+	assert(thmap_txn_del(txn, &okey, sizeof(int)) == 0);
+	assert(thmap_txn_put(txn, &nkey, sizeof(int), NUM2PTR(1)) == 0);
+	assert(thmap_txn_commit(txn) == 0);
+	assert(thmap_get(hmap, &nkey, sizeof(int)) == NUM2PTR(1));
+	assert(thmap_get(hmap, &okey, sizeof(int)) == NULL);
+
+	for (unsigned i = 0; i <= nitems; i++) {
+		thmap_del(hmap, &i, sizeof(int));
+		assert(thmap_get(hmap, &i, sizeof(int)) == NULL);
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+	assert(heap_allocated == 0);
+}
+
+static void
+test_grace(void)
+{
+	const unsigned nitems = 1024;
+	thmap_t *hmap;
+	void *ret, *vals[2];
+
+	/* Either of the lookup protection schemes. */
+	hmap = thmap_create(0, NULL, THMAP_HAZARD | THMAP_GRACE);
+	assert(hmap == NULL);
+
+	hmap = thmap_create(0, &thmap_count_ops, THMAP_GRACE);
+	assert(hmap != NULL);
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i + 1));
+		assert(ret == NUM2PTR(i + 1));
+		assert(thmap_get(hmap, &i, sizeof(int)) == NUM2PTR(i + 1));
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i + 1));
+		assert(thmap_get(hmap, &i, sizeof(int)) == NULL);
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+	assert(heap_allocated == 0);
+
+	/* The value lists are looked up in the section too. */
+	hmap = thmap_create(0, &thmap_count_ops, THMAP_GRACE | THMAP_MULTI);
+	assert(hmap != NULL);
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(thmap_put_multi(hmap, &i, sizeof(int),
+		    NUM2PTR(i + 1)) == 0);
+		assert(thmap_get_multi(hmap, &i, sizeof(int), vals, 2) == 1);
+		assert(vals[0] == NUM2PTR(i + 1));
+		thmap_del(hmap, &i, sizeof(int));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+	assert(heap_allocated == 0);
+}
+
+typedef struct {
+	size_t		allocated;
+	unsigned	nbulk;
+} test_arena_t;
+
+static uintptr_t
+arena_alloc(void *ctx, size_t len)
+{
+	test_arena_t *arena = ctx;
+
+	arena->allocated += len;
+	return (uintptr_t)malloc(len);
+}
+
+static void
+arena_free(void *ctx, uintptr_t addr, size_t len)
+{
+	test_arena_t *arena = ctx;
+
+	assert(arena->allocated >= len);
+	arena->allocated -= len;
+	free((void *)addr);
+}
+
+static size_t
+arena_alloc_bulk(void *ctx, size_t len, uintptr_t *addrs, size_t n)
+{
+	test_arena_t *arena = ctx;
+
+	arena->nbulk++;
+	for (size_t i = 0; i < n; i++) {
+		addrs[i] = arena_alloc(ctx, len);
+	}
+	return n;
+}
+
+static void
+arena_free_bulk(void *ctx, const uintptr_t *addrs, const size_t *lens,
+    size_t n)
+{
+	test_arena_t *arena = ctx;
+
+	arena->nbulk++;
+	for (size_t i = 0; i < n; i++) {
+		arena_free(ctx, addrs[i], lens[i]);
+	}
+}
+
+static void
+test_ctx(void)
+{
+	const unsigned nitems = 256;
+	test_arena_t arena[2];
+	thmap_ops_t ops[2];
+	thmap_t *hmap[2];
+	size_t used;
+
+	/* Each map is backed by its own arena. */
+	memset(arena, 0, sizeof(arena));
+	for (unsigned i = 0; i < 2; i++) {
+		ops[i] = (thmap_ops_t){
+			.ctx = &arena[i],
+			.alloc_ctx = arena_alloc,
+			.free_ctx = arena_free,
+			.alloc_bulk = arena_alloc_bulk,
+			.free_bulk = arena_free_bulk,
+		};
+		hmap[i] = thmap_create(0, &ops[i], 0);
+		assert(hmap[i] != NULL);
+	}
+	used = arena[1].allocated;
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(thmap_put(hmap[0], &i, sizeof(int),
+		    NUM2PTR(i + 1)) == NUM2PTR(i + 1));
+	}
+	assert(arena[0].allocated > used);
+	assert(arena[1].allocated == used);
+
+	/* The G/C frees in bulk, the pool allocates in bulk. */
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(thmap_del(hmap[0], &i, sizeof(int)) == NUM2PTR(i + 1));
+	}
+	assert(arena[0].nbulk == 0);
+	thmap_gc(hmap[0], thmap_stage_gc(hmap[0]));
+	assert(arena[0].nbulk > 0);
+	assert(thmap_reserve(hmap[1], nitems) == 0);
+	assert(arena[1].nbulk > 0);
+	assert(arena[1].allocated > used);
+
+	for (unsigned i = 0; i < 2; i++) {
+		thmap_destroy(hmap[i]);
+		assert(arena[i].allocated == 0);
+	}
+
+	/* The context operations must be given in pairs. */
+	ops[0].free_ctx = NULL;
+	assert(thmap_create(0, &ops[0], 0) == NULL);
+}
+
+static void
+dtor_free(void *val, void *arg)
+{
+	unsigned *destroyed = arg;
+
+	*destroyed |= 1U << *(unsigned *)val;
+	free(val);
+}
+
+static void
+test_dtor(void)
+{
+	const void *keys[2] = { "c", "d" };
+	const size_t lens[2] = { 1, 1 };
+	unsigned *vals[9], destroyed = 0;
+	thmap_txn_t *txn;
+	thmap_t *hmap;
+	void *ref;
+
+	/* The value sets are not supported. */
+	hmap = thmap_create(0, NULL, THMAP_MULTI);
+	assert(hmap != NULL);
+	assert(thmap_setdtor(hmap, dtor_free, &destroyed) == -1);
+	thmap_destroy(hmap);
+
+	/* Nor the maps whose G/C does not wait for the lookups. */
+	hmap = thmap_create(0, NULL, THMAP_HAZARD);
+	assert(hmap != NULL);
+	assert(thmap_setdtor(hmap, dtor_free, &destroyed) == -1);
+	thmap_destroy(hmap);
+	hmap = thmap_create(0, NULL, THMAP_GRACE);
+	assert(hmap != NULL);
+	assert(thmap_setdtor(hmap, dtor_free, &destroyed) == -1);
+	thmap_destroy(hmap);
+
+	/* Neither are the counters, which are not pointers. */
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+	assert(thmap_incr(hmap, "k", 1, 5) == 5);
+	assert(thmap_setdtor(hmap, dtor_free, &destroyed) == -1);
+	thmap_destroy(hmap);
+
+	hmap = thmap_create(0, &thmap_count_ops, 0);
+	assert(hmap != NULL);
+	assert(thmap_setdtor(hmap, dtor_free, &destroyed) == 0);
+	assert(thmap_incr(hmap, "k", 1, 5) == 0);
+	assert(thmap_get(hmap, "k", 1) == NULL);
+	for (unsigned i = 0; i < 9; i++) {
+		vals[i] = malloc(sizeof(unsigned));
+		assert(vals[i] != NULL);
+		*vals[i] = i;
+	}
+	for (unsigned i = 0; i < 8; i++) {
+		const char key = 'a' + i;
+
+		assert(thmap_put(hmap, &key, 1, vals[i]) == vals[i]);
+	}
+
+	/* The deleted values stay valid until G/C. */
+	assert(thmap_del(hmap, "a", 1) == vals[0]);
+	assert(thmap_del_if(hmap, "b", 1, vals[1]) == 0);
+	assert(thmap_del_batch(hmap, keys, lens, NULL, 2) == 2);
+	ref = thmap_stage_gc(hmap);
+	assert(destroyed == 0 && *vals[0] == 0);
+	thmap_gc(hmap, ref);
+	assert(destroyed == 0xf);
+
+	/*
+	 * The replaced value is destroyed; the moved one and the one
+	 * replaced by itself are not.
+	 */
+	txn = thmap_txn_begin(hmap);
+	assert(thmap_txn_replace(txn, "e", 1, vals[8]) == 0);
+	assert(thmap_txn_replace(txn, "f", 1, vals[5]) == 0);
+	assert(thmap_txn_commit(txn) == 0);
+	assert(thmap_move(hmap, "g", 1, "x", 1) == 0);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(destroyed == 0x1f);
+	assert(thmap_get(hmap, "e", 1) == vals[8]);
+	assert(thmap_get(hmap, "f", 1) == vals[5]);
+	assert(thmap_get(hmap, "x", 1) == vals[6]);
+
+	/* The values still present are not destroyed with the map. */
+	thmap_destroy(hmap);
+	assert(destroyed == 0x1f);
+	assert(heap_allocated == 0);
+	free(vals[5]);
+	free(vals[6]);
+	free(vals[7]);
+	free(vals[8]);
+}
+
+typedef struct {
+	thmap_entry_t	entry;
+	unsigned	key;
+} test_obj_t;
+
+static void
+test_intrusive(void)
+{
+	static const unsigned tflags[] = {
+		THMAP_MULTI, THMAP_HAZARD, THMAP_GRACE, THMAP_KEYPREFIX
+	};
+	const unsigned nitems = 1024;
+	test_obj_t *objs, dup;
+	thmap_t *hmap;
+	size_t used;
+
+	for (unsigned i = 0; i < 4; i++) {
+		hmap = thmap_create(0, NULL, THMAP_INTRUSIVE | tflags[i]);
+		assert(hmap == NULL);
+	}
+	objs = calloc(nitems, sizeof(test_obj_t));
+	assert(objs != NULL);
+
+	hmap = thmap_create(0, &thmap_count_ops,
+	    THMAP_INTRUSIVE | THMAP_LAZYDEL);
+	assert(hmap != NULL);
+
+	/* The operations allocating the leaves are not supported. */
+	assert(thmap_put(hmap, "a", 1, NUM2PTR(1)) == NULL);
+	assert(thmap_incr(hmap, "a", 1, 1) == 0);
+	assert(thmap_txn_begin(hmap) == NULL);
+	assert(thmap_get(hmap, "a", 1) == NULL);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		test_obj_t *obj = &objs[i];
+
+		obj->key = i;
+		assert(thmap_put_entry(hmap, &obj->entry, &obj->key,
+		    sizeof(unsigned), obj) == obj);
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(thmap_get(hmap, &i, sizeof(unsigned)) == &objs[i]);
+	}
+
+	/* The duplicate is not linked. */
+	dup.key = 0;
+	assert(thmap_put_entry(hmap, &dup.entry, &dup.key,
+	    sizeof(unsigned), &dup) == &objs[0]);
+	assert(thmap_del_entry(hmap, &dup.entry) == -1);
+	assert(thmap_get(hmap, &dup.key, sizeof(unsigned)) == &objs[0]);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(thmap_del_entry(hmap, &objs[i].entry) == 0);
+		assert(thmap_del_entry(hmap, &objs[i].entry) == -1);
+		assert(thmap_get(hmap, &i, sizeof(unsigned)) == NULL);
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+
+	/*
+	 * Re-insert: the intermediate nodes are still in place, hence
+	 * the inserts and the deletes allocate and release nothing.
+	 */
+	used = heap_allocated;
+	for (unsigned i = 0; i < nitems; i++) {
+		test_obj_t *obj = &objs[i];
+
+		assert(thmap_put_entry(hmap, &obj->entry, &obj->key,
+		    sizeof(unsigned), obj) == obj);
+	}
+	assert(heap_allocated == used);
+	for (unsigned i = 0; i < nitems; i += 2) {
+		assert(thmap_del(hmap, &i, sizeof(unsigned)) == &objs[i]);
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(heap_allocated == used);
+
+	/* The entries still present are left to the caller. */
+	thmap_destroy(hmap);
+	assert(heap_allocated == 0);
+	free(objs);
+}
+
 int
 main(void)
 {
@@ -298,8 +2044,32 @@ main(void)
 	test_large();
 	test_delete();
 	test_longkey();
+	test_incr();
+	test_multi();
 	test_random();
 	test_mem();
+	test_prefix();
+	test_feed();
+	test_handle();
+	test_seed();
+	test_reseed();
+	test_lazydel();
+	test_del_batch();
+	test_del_if();
+	test_prefetch();
+	test_cache();
+	test_join();
+	test_digest();
+	test_sample();
+	test_txn();
+	test_move();
+	test_reserve();
+	test_gc_step();
+	test_hazard();
+	test_grace();
+	test_ctx();
+	test_dtor();
+	test_intrusive();
 	puts("ok");
 	return 0;
 }
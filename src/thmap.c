@@ -71,6 +71,14 @@
 #include <inttypes.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <sys/random.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#include <unistd.h>
+#endif
 
 #include "thmap.h"
 #include "utils.h"
@@ -92,6 +100,8 @@
 #define	ROOT_MASK	(ROOT_SIZE - 1)
 #define	ROOT_MSBITS	(HASHVAL_BITS - ROOT_BITS)
 
+static_assert(ROOT_SIZE == THMAP_JOIN_NSLOTS, "THMAP_JOIN_NSLOTS");
+
 #define	LEVEL_BITS	(4)
 #define	LEVEL_SIZE	(1 << LEVEL_BITS)
 #define	LEVEL_MASK	(LEVEL_SIZE - 1)
@@ -140,38 +150,349 @@ typedef struct {
 	atomic_thmap_ptr_t	slots[LEVEL_SIZE];
 } thmap_inode_t;
 
-#define	THMAP_INODE_LEN	sizeof(thmap_inode_t)
+/*
+ * Subtree digests (THMAP_DIGEST).  The intermediate node is followed by
+ * the sum of the digests of all leaves in its subtree.  The digests are
+ * updated, while holding the edge node lock, on the edge node and all of
+ * its ancestors; the ancestors cannot be collapsed, since they are not
+ * empty.  As the sums are commutative, the digest of a subtree depends
+ * only on its keys and values.
+ */
+typedef struct {
+	thmap_inode_t		node;
+	atomic_uint_least64_t	digest;
+} thmap_dinode_t;
+
+#define	THMAP_INODE_LEN(th)	(((th)->flags & THMAP_DIGEST) ? \
+    sizeof(thmap_dinode_t) : sizeof(thmap_inode_t))
 
 typedef struct {
 	thmap_ptr_t	key;
-	size_t		len;
-	void *		val;
+	uint32_t	len;		// up to THMAP_KEY_MAXLEN
+	atomic_uint	state;		// LEAF_DELETED and LEAF_NINCR
+	union {
+		void *			val;
+		atomic_uintptr_t	count;	// see thmap_incr()
+		thmap_ptr_t		vlist;	// THMAP_MULTI value chunks
+	};
 } thmap_leaf_t;
 
+/*
+ * With THMAP_INTRUSIVE, the leaves are the entries embedded in the
+ * objects of the caller, see thmap_put_entry().
+ */
+static_assert(sizeof(thmap_leaf_t) <= sizeof(thmap_entry_t),
+    "thmap_entry_t");
+
+#define	THMAP_KEY_MAXLEN	UINT32_MAX
+
+#define	LEAF_DELETED		(1U << 0)
+#define	LEAF_NINCR		(1U << 1)	// increments in progress
+
+/*
+ * Transactions.  Until the transaction is resolved, the slot of each key
+ * it changes points to a pending record, tagged with THMAP_PENDING_BIT
+ * in addition to THMAP_LEAF_BIT (the intermediate node slots never have
+ * the ROOT_MOVING bit).  The record references both the new and the
+ * current leaf; the lookups pick one of them depending on the status
+ * word shared by the records of the transaction, therefore all of its
+ * changes become visible at once.  The nodes holding the pending records
+ * stay locked, hence the writers never see them.
+ */
+
+#define	THMAP_PENDING_BIT	(0x2)
+#define	THMAP_PENDING_P(p)	(((uintptr_t)(p) & THMAP_PENDING_BIT) != 0)
+
+#define	TXN_PENDING		0
+#define	TXN_COMMITTED		1
+#define	TXN_ABORTED		2
+
+typedef struct {
+	thmap_ptr_t	leaf;		// the new leaf or NULL, if deleted
+	thmap_ptr_t	prev;		// the current leaf or NULL, if inserted
+	thmap_ptr_t	txrec;		// the transaction record
+} thmap_pending_t;
+
+typedef struct {
+	atomic_uint	status;		// TXN_PENDING, COMMITTED or ABORTED
+	thmap_pending_t	pending[];
+} thmap_txrec_t;
+
+#define	THMAP_TXREC_LEN(n)	(offsetof(thmap_txrec_t, pending[n]))
+
 typedef struct {
 	unsigned	rslot;		// root-level slot index
 	unsigned	level;		// current level in the tree
 	unsigned	hashidx;	// current hash index (block of bits)
 	uint32_t	hashval;	// current hash value
+	uint64_t	seq;		// feed sequence number of the insert
+	const struct thmap_gen *gen;	// hash generation
 } thmap_query_t;
 
+typedef void (*thmap_dtor_t)(thmap_t *, uintptr_t, size_t);
+
+/*
+ * The G/C records.  The objects staged together are recorded in the
+ * blocks, rather than one by one, to save the allocations.
+ */
+
+#define	GC_BLOCK_MIN	4
+#define	GC_BLOCK_MAX	32
+
 typedef struct {
 	uintptr_t	addr;
 	size_t		len;
-	void *		next;
+	thmap_dtor_t	dtor;		// if NULL, then ops->free
+} thmap_gcobj_t;
+
+typedef struct thmap_gc {
+	struct thmap_gc *next;
+	unsigned	nobjs;
+	unsigned	maxobjs;
+	thmap_gcobj_t	objs[];
 } thmap_gc_t;
 
+/*
+ * The G/C chain: the objects linked locally and then staged at once.
+ */
+typedef struct {
+	thmap_gc_t *	head;
+	thmap_gc_t *	tail;
+} thmap_gc_chain_t;
+
+/*
+ * Key prefix dictionary (THMAP_KEYPREFIX).  The copied keys are stored
+ * front-coded: a one byte header holding the prefix index (or zero, if
+ * no prefix matched) followed by the remaining suffix of the key.  The
+ * dictionary is append-only, therefore the prefixes never change once
+ * published and the leaves can reference them by the index.
+ */
+
+#define	THMAP_PREFIX_MAX	64
+#define	THMAP_KEYBUF_LEN	256
+
+typedef struct {
+	thmap_ptr_t	key;
+	size_t		len;
+} thmap_prefix_t;
+
+typedef struct {
+	uint8_t		prefix;		// prefix index + 1 or zero
+	unsigned char	suffix[];
+} thmap_pkey_t;
+
+#define	THMAP_PKEY_LEN(sfxlen)	(offsetof(thmap_pkey_t, suffix[sfxlen]))
+
+/*
+ * Value chunks (THMAP_MULTI).  The values of a key are stored in the
+ * append-only list of chunks.  The slots are reserved by incrementing
+ * the chunk's use count; NULL indicates a reserved slot which is not yet
+ * filled and THMAP_VAL_REMOVED indicates a removed value.  The list is
+ * sealed (THMAP_VCHUNK_SEALED) when the key gets deleted; so is the use
+ * count of each chunk (THMAP_VCHUNK_NSEALED), so that no more slots could
+ * be reserved in the chunks which are not full.  The removed slots are
+ * counted and re-used by the appends, so the list grows only with the
+ * number of the values present at once, not with all values ever added.
+ */
+
+#define	THMAP_VCHUNK_VALS	14
+#define	THMAP_VCHUNK_SEALED	((thmap_ptr_t)0x1)
+#define	THMAP_VCHUNK_NSEALED	(1U << 31)
+#define	THMAP_VAL_REMOVED	((void *)UINTPTR_MAX)
+
+typedef struct {
+	atomic_thmap_ptr_t	next;
+	atomic_uint		nused;
+	atomic_uint		nfree;	// removed slots not yet re-used
+	void * _Atomic		vals[THMAP_VCHUNK_VALS];
+} thmap_vchunk_t;
+
+/*
+ * Mutation feed.  The records are queued into the bounded lock-free
+ * rings (the MPMC queue by D. Vyukov, where each slot has a turn
+ * counter).  The threads are spread across the rings, so normally
+ * there is a single producer per ring.  The keys are copied into the
+ * slot, unless they are longer than the inline buffer.  If the ring
+ * is full, then the record is dropped and accounted as lost.
+ */
+
+#define	THMAP_FEED_KEYLEN	64
+
+typedef struct {
+	atomic_uint_least64_t	turn;
+	thmap_rec_t		rec;
+	unsigned char		kbuf[THMAP_FEED_KEYLEN];
+} thmap_fslot_t;
+
+typedef struct {
+	atomic_uint_least64_t	head;	// enqueue position
+	char			_pad[CACHE_LINE_SIZE - sizeof(uint64_t)];
+	atomic_uint_least64_t	tail;	// dequeue position
+	uint64_t		mask;
+	thmap_fslot_t		slots[];
+} thmap_ring_t;
+
+typedef struct {
+	atomic_uint_least64_t	seq;
+	atomic_uint_least64_t	lost;
+	atomic_uint		cursor;
+	unsigned		nrings;
+	thmap_ring_t *		rings[];
+} thmap_feed_t;
+
+/*
+ * Reserve pool.  The leaves and the intermediate nodes pre-allocated by
+ * thmap_reserve() are kept in the free lists (linked through the first
+ * word of the objects) of the magazines.  The threads are spread across
+ * the magazines and the inserts only ever try the magazine flag: on the
+ * contention or if the magazine is empty, the other magazines are tried
+ * and then the allocator.  Hence, the inserts never wait for the pool.
+ */
+
+#define	POOL_NMAGS		16
+
+#define	POOL_LEAF		0
+#define	POOL_INODE		1
+#define	POOL_NTYPES		2
+
+typedef union {
+	struct {
+		atomic_bool	busy;
+		atomic_uint	count[POOL_NTYPES];	// peeked unlocked
+		uintptr_t	head[POOL_NTYPES];
+	};
+	char			_pad[CACHE_LINE_SIZE];
+} thmap_mag_t;
+
+typedef struct {
+	atomic_uint		want[POOL_NTYPES];	// per magazine
+	thmap_mag_t		mags[POOL_NMAGS];
+} thmap_pool_t;
+
+/*
+ * Hazard pointers (THMAP_HAZARD).  The lookups claim a record, publish
+ * each object before accessing it and validate that it is still reached
+ * from the slot it was loaded from.  The G/C keeps the blocks holding
+ * any published object and stages them again, therefore a stalled lookup
+ * pins at most HAZARD_NPTRS blocks rather than all of the staged memory.
+ * The objects published are the generation (its root is staged in the
+ * same block), the nodes along the path, alternating, and the leaf (its
+ * key copy is staged in the same block) or the pending record.
+ *
+ * The records are in blocks of HAZARD_NRECS, on the append-only list:
+ * once all records are in use, the lookup appends a new block, hence
+ * every lookup is protected.  The blocks are freed on map destruction.
+ */
+
+#define	HAZARD_NRECS		64
+
+#define	HP_GEN			0
+#define	HP_NODE			1	// and HP_NODE + 1
+#define	HP_LEAF			3
+#define	HAZARD_NPTRS		4
+
+typedef union {
+	struct {
+		atomic_bool		busy;
+		atomic_uintptr_t	hp[HAZARD_NPTRS];
+	};
+	char				_pad[CACHE_LINE_SIZE];
+} thmap_hazard_t;
+
+typedef struct thmap_hzblock thmap_hzblock_t;
+
+struct thmap_hzblock {
+	thmap_hazard_t		recs[HAZARD_NRECS];
+	thmap_hzblock_t *_Atomic next;
+};
+
+/*
+ * Grace periods (THMAP_GRACE).  The lookups run in the read-side critical
+ * sections: each thread has a record with a counter, which is odd while
+ * the thread is in the section.  The counter is updated with the plain
+ * stores: instead of the fence on the reader side, the reclaimer issues
+ * membarrier(2), which executes a memory barrier on all running threads
+ * of the process, and then waits for the sections in progress to end.
+ * If membarrier(2) is not available, the readers issue the fence.
+ *
+ * The records are shared by the maps and never freed: a thread which
+ * exits leaves its record outside of the section and marks it free, to
+ * be re-used by the next thread.  If the record cannot be allocated, the
+ * thread enters the shared section instead: its counter is the number of
+ * the threads in it and the reclaimer waits for it to drain.
+ */
+
+typedef union thmap_reader {
+	struct {
+		atomic_uint_fast64_t	ctr;
+		union thmap_reader *	next;
+		atomic_bool		used;
+	};
+	char				_pad[CACHE_LINE_SIZE];
+} thmap_reader_t;
+
+#define	GRACE_UNKNOWN		0
+#define	GRACE_MEMBARRIER	1
+#define	GRACE_FENCE		2
+
 #define	THMAP_ROOT_LEN	(sizeof(thmap_ptr_t) * ROOT_SIZE)
 
+/*
+ * Hash generations.  The map is migrated to a new hash seed (reseeded)
+ * by moving the root-level slots, one at a time, into the root of the
+ * next generation.  The slot being moved is tagged with ROOT_MOVING and,
+ * once moved, it is set to ROOT_MOVED, which redirects the operations to
+ * the next generation.  The subtree is locked for the move and its nodes
+ * are marked as deleted afterwards (the leaves themselves are re-used).
+ * When all slots are moved, the next generation becomes the current one.
+ */
+
+#define	ROOT_MOVING		(0x2)
+#define	ROOT_MOVED		((thmap_ptr_t)ROOT_MOVING)
+
+#define	THMAP_DEPTH_MAX		12	// levels, before reseed is wanted
+
+typedef struct thmap_gen {
+	atomic_thmap_ptr_t *		root;
+	uint64_t			seed[2];
+	struct thmap_gen *_Atomic	next;
+} thmap_gen_t;
+
+struct thmap_handle {
+	thmap_t *_Atomic	map;
+};
+
 struct thmap {
 	uintptr_t		baseptr;
-	atomic_thmap_ptr_t *	root;
+	thmap_gen_t *_Atomic	gen;
 	unsigned		flags;
 	const thmap_ops_t *	ops;
 	thmap_gc_t *_Atomic	gc_list;
+	atomic_uint_fast64_t	gc_epoch;	// see thmap_cache_get()
+	atomic_uint_fast64_t	sample_wmax;	// see sample_leaf()
+
+	thmap_prefix_t *	prefix;
+	atomic_uint		nprefix;
+
+	thmap_feed_t *_Atomic	feed;
+	thmap_pool_t *_Atomic	pool;
+	thmap_hzblock_t *	hazards;	// THMAP_HAZARD records
+
+	thmap_dtor_func_t	dtor_func;	// see thmap_setdtor()
+	void *			dtor_arg;
+	atomic_bool		counters;	// thmap_incr() was used
+
+	atomic_bool		reseed;		// excessive depth seen
+	unsigned		reseed_slot;	// next root slot to move
 };
 
+static void	stage_gc(thmap_t *, uintptr_t, size_t, thmap_dtor_t);
 static void	stage_mem_gc(thmap_t *, uintptr_t, size_t);
+static void	gc_chain_add(thmap_gc_chain_t *, uintptr_t, size_t,
+		    thmap_dtor_t);
+static void	gc_chain_reserve(thmap_gc_chain_t *, unsigned);
+static void	stage_gc_chain(thmap_t *, thmap_gc_chain_t *);
+static uint64_t	feed_seq(thmap_t *);
 
 /*
  * A few low-level helper routines.
@@ -194,6 +515,66 @@ static const thmap_ops_t thmap_default_ops = {
 	.free = free_wrapper
 };
 
+/*
+ * The number of objects passed to the bulk operations at once.
+ */
+#define	MEM_BULK	64
+
+static inline uintptr_t
+mem_alloc(const thmap_t *thmap, size_t len)
+{
+	const thmap_ops_t *ops = thmap->ops;
+
+	return ops->alloc_ctx ?
+	    ops->alloc_ctx(ops->ctx, len) : ops->alloc(len);
+}
+
+static inline void
+mem_free(const thmap_t *thmap, uintptr_t addr, size_t len)
+{
+	const thmap_ops_t *ops = thmap->ops;
+
+	if (ops->free_ctx) {
+		ops->free_ctx(ops->ctx, addr, len);
+	} else {
+		ops->free(addr, len);
+	}
+}
+
+/*
+ * mem_alloc_bulk: allocate up to n objects of the given length.
+ *
+ * => Returns the number of objects allocated.
+ */
+static size_t
+mem_alloc_bulk(const thmap_t *thmap, size_t len, uintptr_t *addrs, size_t n)
+{
+	const thmap_ops_t *ops = thmap->ops;
+	size_t i;
+
+	if (ops->alloc_bulk) {
+		return ops->alloc_bulk(ops->ctx, len, addrs, n);
+	}
+	for (i = 0; i < n; i++) {
+		if ((addrs[i] = mem_alloc(thmap, len)) == THMAP_NULL) {
+			break;
+		}
+	}
+	return i;
+}
+
+static int
+random_seed(uint64_t seed[2])
+{
+#if defined(__linux__)
+	const size_t len = sizeof(uint64_t) * 2;
+	return getrandom(seed, len, 0) == (ssize_t)len ? 0 : -1;
+#else
+	arc4random_buf(seed, sizeof(uint64_t) * 2);
+	return 0;
+#endif
+}
+
 /*
  * NODE LOCKING.
  */
@@ -217,7 +598,7 @@ again:
 		SPINLOCK_BACKOFF(bcount);
 		goto again;
 	}
-	/* Acquire from prior release in unlock_node.() */
+	/* Acquire from prior release in unlock_node(). */
 	if (!atomic_compare_exchange_weak_explicit(&node->state,
 	    &s, s | NODE_LOCKED, memory_order_acquire, memory_order_relaxed)) {
 		bcount = SPINLOCK_BACKOFF_MIN;
@@ -225,6 +606,19 @@ again:
 	}
 }
 
+static bool
+trylock_node(thmap_inode_t *node)
+{
+	uint32_t s = atomic_load_relaxed(&node->state);
+
+	if (s & NODE_LOCKED) {
+		return false;
+	}
+	/* Acquire from prior release in unlock_node(). */
+	return atomic_compare_exchange_weak_explicit(&node->state,
+	    &s, s | NODE_LOCKED, memory_order_acquire, memory_order_relaxed);
+}
+
 static void
 unlock_node(thmap_inode_t *node)
 {
@@ -239,15 +633,59 @@ unlock_node(thmap_inode_t *node)
  * HASH VALUE AND KEY OPERATIONS.
  */
 
+/*
+ * hash_block: compute the i-th 32-bit block of the hash value.
+ *
+ * => The seed is per-generation (zero, unless THMAP_RANDSEED or
+ *    THMAP_SIPHASH is set or the map was reseeded).
+ * => With THMAP_SIPHASH, each 64-bit output provides two blocks.
+ */
+static inline uint32_t
+hash_block(const thmap_t *thmap, const thmap_gen_t *gen,
+    const void * restrict key, size_t len, unsigned i)
+{
+	if (__predict_false(thmap->flags & THMAP_SIPHASH)) {
+		return (uint32_t)(siphash24(key, len,
+		    gen->seed[0] + (i >> 1), gen->seed[1]) >> ((i & 1) * 32));
+	}
+	return murmurhash3(key, len, (uint32_t)gen->seed[0] + i);
+}
+
 static inline void
-hashval_init(thmap_query_t *query, const void * restrict key, size_t len)
+hashval_init_gen(const thmap_t *thmap, const thmap_gen_t *gen,
+    thmap_query_t *query, const void * restrict key, size_t len)
 {
-	const uint32_t hashval = murmurhash3(key, len, 0);
+	const uint32_t hashval = hash_block(thmap, gen, key, len, 0);
 
 	query->rslot = ((hashval >> ROOT_MSBITS) ^ len) & ROOT_MASK;
 	query->level = 0;
 	query->hashval = hashval;
 	query->hashidx = 0;
+	query->gen = gen;
+}
+
+static inline void
+hashval_init(const thmap_t *thmap, thmap_query_t *query,
+    const void * restrict key, size_t len)
+{
+	/* Acquire from prior release in thmap_reseed_step(). */
+	hashval_init_gen(thmap, atomic_load_acquire(&thmap->gen),
+	    query, key, len);
+}
+
+/*
+ * hashval_next_gen: the root slot was moved -- continue the query in
+ * the next generation.
+ */
+static void
+hashval_next_gen(const thmap_t *thmap, thmap_query_t *query,
+    const void * restrict key, size_t len)
+{
+	/* Acquire from prior release in thmap_reseed_start(). */
+	const thmap_gen_t *next = atomic_load_acquire(&query->gen->next);
+
+	ASSERT(next != NULL);
+	hashval_init_gen(thmap, next, query, key, len);
 }
 
 /*
@@ -255,7 +693,8 @@ hashval_init(thmap_query_t *query, const void * restrict key, size_t len)
  * and return the offset for the current level.
  */
 static unsigned
-hashval_getslot(thmap_query_t *query, const void * restrict key, size_t len)
+hashval_getslot(const thmap_t *thmap, thmap_query_t *query,
+    const void * restrict key, size_t len)
 {
 	const unsigned offset = query->level * LEVEL_BITS;
 	const unsigned shift = offset & HASHVAL_MOD;
@@ -263,32 +702,70 @@ hashval_getslot(thmap_query_t *query, const void * restrict key, size_t len)
 
 	if (query->hashidx != i) {
 		/* Generate a hash value for a required range. */
-		query->hashval = murmurhash3(key, len, i);
+		query->hashval = hash_block(thmap, query->gen, key, len, i);
 		query->hashidx = i;
 	}
 	return (query->hashval >> shift) & LEVEL_MASK;
 }
 
+static inline const thmap_prefix_t *
+pkey_prefix(const thmap_t *thmap, const thmap_pkey_t *pkey)
+{
+	/* The prefix was published before the key (see key_copy()). */
+	return pkey->prefix ? &thmap->prefix[pkey->prefix - 1] : NULL;
+}
+
+/*
+ * leaf_key_get: return a pointer to the contiguous key of the leaf.
+ *
+ * => The prefix-compressed keys are reconstructed into the given buffer
+ *    (THMAP_KEYBUF_LEN bytes); the longer keys are never front-coded,
+ *    see key_copy(), hence there is no allocation e.g. under the lock.
+ */
+static const void *
+leaf_key_get(const thmap_t *thmap, const thmap_leaf_t *leaf, void *buf)
+{
+	const thmap_pkey_t *pkey = THMAP_GETPTR(thmap, leaf->key);
+	const thmap_prefix_t *pfx;
+	uint8_t *key = buf;
+
+	if (__predict_true((thmap->flags & THMAP_KEYPREFIX) == 0)) {
+		return pkey;
+	}
+	if ((pfx = pkey_prefix(thmap, pkey)) == NULL) {
+		return pkey->suffix;
+	}
+	ASSERT(leaf->len <= THMAP_KEYBUF_LEN);
+	memcpy(key, THMAP_GETPTR(thmap, pfx->key), pfx->len);
+	memcpy(key + pfx->len, pkey->suffix, leaf->len - pfx->len);
+	return key;
+}
+
+/*
+ * hashval_getleafslot: compute the slot of the given leaf at the level.
+ */
 static unsigned
-hashval_getleafslot(const thmap_t *thmap,
+hashval_getleafslot(const thmap_t *thmap, const thmap_gen_t *gen,
     const thmap_leaf_t *leaf, unsigned level)
 {
-	const void *key = THMAP_GETPTR(thmap, leaf->key);
 	const unsigned offset = level * LEVEL_BITS;
 	const unsigned shift = offset & HASHVAL_MOD;
 	const unsigned i = offset >> HASHVAL_SHIFT;
+	uint8_t buf[THMAP_KEYBUF_LEN];
+	const void *key = leaf_key_get(thmap, leaf, buf);
+	const uint32_t hashval = hash_block(thmap, gen, key, leaf->len, i);
 
-	return (murmurhash3(key, leaf->len, i) >> shift) & LEVEL_MASK;
+	return (hashval >> shift) & LEVEL_MASK;
 }
 
 static inline unsigned
 hashval_getl0slot(const thmap_t *thmap, const thmap_query_t *query,
-    const thmap_leaf_t *leaf)
+    const void * restrict key, size_t len)
 {
 	if (__predict_true(query->hashidx == 0)) {
 		return query->hashval & LEVEL_MASK;
 	}
-	return hashval_getleafslot(thmap, leaf, 0);
+	return hash_block(thmap, query->gen, key, len, 0) & LEVEL_MASK;
 }
 
 static bool
@@ -296,7 +773,181 @@ key_cmp_p(const thmap_t *thmap, const thmap_leaf_t *leaf,
     const void * restrict key, size_t len)
 {
 	const void *leafkey = THMAP_GETPTR(thmap, leaf->key);
-	return len == leaf->len && memcmp(key, leafkey, len) == 0;
+	const thmap_pkey_t *pkey;
+	const thmap_prefix_t *pfx;
+	size_t plen = 0;
+
+	if (len != leaf->len) {
+		return false;
+	}
+	if (__predict_true((thmap->flags & THMAP_KEYPREFIX) == 0)) {
+		return memcmp(key, leafkey, len) == 0;
+	}
+
+	/*
+	 * Front-coded key: compare the (shared) prefix and the suffix.
+	 */
+	pkey = leafkey;
+	if ((pfx = pkey_prefix(thmap, pkey)) != NULL) {
+		plen = pfx->len;
+		if (memcmp(key, THMAP_GETPTR(thmap, pfx->key), plen) != 0) {
+			return false;
+		}
+	}
+	return memcmp((const uint8_t *)key + plen, pkey->suffix,
+	    len - plen) == 0;
+}
+
+/*
+ * RESERVE POOL.
+ */
+
+static _Thread_local unsigned	cur_thread_idx;
+static atomic_uint		nthreads;
+
+/*
+ * thread_index: return the index of the current thread (starting at 1),
+ * assigned on the first use.
+ */
+static unsigned
+thread_index(void)
+{
+	unsigned idx = cur_thread_idx;
+
+	if (__predict_false(idx == 0)) {
+		idx = atomic_fetch_add_explicit(&nthreads, 1,
+		    memory_order_relaxed) + 1;
+		cur_thread_idx = idx;
+	}
+	return idx;
+}
+
+static inline size_t
+pool_objlen(const thmap_t *thmap, unsigned type)
+{
+	return type == POOL_LEAF ?
+	    sizeof(thmap_leaf_t) : THMAP_INODE_LEN(thmap);
+}
+
+static void
+mag_lock(thmap_mag_t *mag)
+{
+	unsigned bcount = SPINLOCK_BACKOFF_MIN;
+
+	/* Acquire from prior release in mag_unlock(). */
+	while (atomic_exchange_explicit(&mag->busy, true,
+	    memory_order_acquire)) {
+		SPINLOCK_BACKOFF(bcount);
+	}
+}
+
+static void
+mag_unlock(thmap_mag_t *mag)
+{
+	/* Release to subsequent exchange in mag_lock() or pool_alloc(). */
+	atomic_store_release(&mag->busy, false);
+}
+
+/*
+ * pool_alloc: take the object from the reserve pool or, if there is
+ * none at hand, allocate it.
+ */
+static uintptr_t
+pool_alloc(const thmap_t *thmap, unsigned type)
+{
+	/* Consume from prior release in thmap_reserve(). */
+	thmap_pool_t *pool = atomic_load_consume(&thmap->pool);
+
+	if (pool) {
+		const unsigned idx = thread_index();
+
+		for (unsigned i = 0; i < POOL_NMAGS; i++) {
+			thmap_mag_t *mag = &pool->mags[(idx + i) % POOL_NMAGS];
+			const uintptr_t *next;
+			uintptr_t off;
+			unsigned count;
+
+			/* Never wait: skip the busy and empty magazines. */
+			if (atomic_load_relaxed(&mag->count[type]) == 0 ||
+			    atomic_exchange_explicit(&mag->busy, true,
+			    memory_order_acquire)) {
+				continue;
+			}
+			if ((off = mag->head[type]) != THMAP_NULL) {
+				next = THMAP_GETPTR(thmap, off);
+				mag->head[type] = *next;
+				count = atomic_load_relaxed(&mag->count[type]);
+				atomic_store_relaxed(&mag->count[type],
+				    count - 1);
+			}
+			mag_unlock(mag);
+			if (off) {
+				return off;
+			}
+		}
+	}
+	return mem_alloc(thmap, pool_objlen(thmap, type));
+}
+
+/*
+ * pool_recycle: put the released objects back to the magazine of the
+ * current thread, up to the target set by thmap_reserve().
+ *
+ * => Returns the number of objects taken, from the start of the array.
+ */
+static size_t
+pool_recycle(const thmap_t *thmap, unsigned type,
+    const uintptr_t *addrs, size_t n)
+{
+	thmap_pool_t *pool = atomic_load_acquire(&thmap->pool);
+	unsigned want, count;
+	thmap_mag_t *mag;
+	size_t k;
+
+	if (pool == NULL) {
+		return 0;
+	}
+	mag = &pool->mags[thread_index() % POOL_NMAGS];
+	want = atomic_load_relaxed(&pool->want[type]);
+	if (atomic_load_relaxed(&mag->count[type]) >= want) {
+		return 0;
+	}
+	mag_lock(mag);
+	count = atomic_load_relaxed(&mag->count[type]);
+	k = count < want ? MIN(n, want - count) : 0;
+	for (size_t i = 0; i < k; i++) {
+		uintptr_t *next = THMAP_GETPTR(thmap, addrs[i]);
+
+		*next = mag->head[type];
+		mag->head[type] = addrs[i];
+	}
+	atomic_store_relaxed(&mag->count[type], count + k);
+	mag_unlock(mag);
+	return k;
+}
+
+static void
+pool_destroy(thmap_t *thmap, thmap_pool_t *pool)
+{
+	for (unsigned i = 0; i < POOL_NMAGS; i++) {
+		thmap_mag_t *mag = &pool->mags[i];
+
+		for (unsigned type = 0; type < POOL_NTYPES; type++) {
+			const size_t len = pool_objlen(thmap, type);
+			uintptr_t off = mag->head[type];
+
+			while (off) {
+				const uintptr_t *next;
+				uintptr_t noff;
+
+				next = THMAP_GETPTR(thmap, off);
+				noff = *next;
+				mem_free(thmap, off, len);
+				off = noff;
+			}
+		}
+	}
+	free(pool);
 }
 
 /*
@@ -309,14 +960,14 @@ node_create(thmap_t *thmap, thmap_inode_t *parent)
 	thmap_inode_t *node;
 	uintptr_t p;
 
-	p = thmap->ops->alloc(THMAP_INODE_LEN);
+	p = pool_alloc(thmap, POOL_INODE);
 	if (!p) {
 		return NULL;
 	}
 	node = THMAP_GETPTR(thmap, p);
 	ASSERT(THMAP_ALIGNED_P(node));
 
-	memset(node, 0, THMAP_INODE_LEN);
+	memset(node, 0, THMAP_INODE_LEN(thmap));
 	if (parent) {
 		/* Not yet published, no need for ordering. */
 		atomic_store_relaxed(&node->state, NODE_LOCKED);
@@ -361,49 +1012,316 @@ node_remove(thmap_inode_t *node, unsigned slot)
 }
 
 /*
- * LEAF OPERATIONS.
+ * SUBTREE DIGESTS.
  */
 
-static thmap_leaf_t *
-leaf_create(const thmap_t *thmap, const void *key, size_t len, void *val)
+static inline atomic_uint_least64_t *
+node_digest(thmap_inode_t *node)
 {
-	thmap_leaf_t *leaf;
-	uintptr_t leaf_off, key_off;
+	return &((thmap_dinode_t *)node)->digest;
+}
 
-	leaf_off = thmap->ops->alloc(sizeof(thmap_leaf_t));
-	if (!leaf_off) {
-		return NULL;
+static inline uint64_t
+digest_mix(uint64_t x)
+{
+	/* The murmurhash3 64-bit finalizer. */
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/*
+ * key_digest: compute the digest of the key-value pair.
+ *
+ * => The value is digested as-is, i.e. its bits.
+ */
+static uint64_t
+key_digest(const thmap_t *thmap, const thmap_gen_t *gen,
+    const void * restrict key, size_t len, const void *val)
+{
+	uint64_t h;
+
+	if (thmap->flags & THMAP_SIPHASH) {
+		/* The blocks 0 and 1, see hash_block(). */
+		h = siphash24(key, len, gen->seed[0], gen->seed[1]);
+	} else {
+		h = (uint64_t)hash_block(thmap, gen, key, len, 0) << 32 |
+		    hash_block(thmap, gen, key, len, 1);
 	}
-	leaf = THMAP_GETPTR(thmap, leaf_off);
-	ASSERT(THMAP_ALIGNED_P(leaf));
+	return digest_mix(h + digest_mix((uintptr_t)val));
+}
+
+/*
+ * leaf_digest: compute the digest of the leaf.
+ */
+static uint64_t
+leaf_digest(const thmap_t *thmap, const thmap_gen_t *gen,
+    const thmap_leaf_t *leaf)
+{
+	uint8_t buf[THMAP_KEYBUF_LEN];
+	const void *key = leaf_key_get(thmap, leaf, buf);
+
+	return key_digest(thmap, gen, key, leaf->len, leaf->val);
+}
+
+/*
+ * digest_add: add the delta to the digests of the node and its ancestors.
+ *
+ * => The node must be locked.
+ */
+static void
+digest_add(const thmap_t *thmap, thmap_inode_t *node, uint64_t delta)
+{
+	ASSERT(node_locked_p(node));
+
+	for (;;) {
+		atomic_fetch_add_explicit(node_digest(node), delta,
+		    memory_order_relaxed);
+		if (node->parent == THMAP_NULL) {
+			break;
+		}
+		node = THMAP_NODE(thmap, node->parent);
+	}
+}
+
+/*
+ * digest_update: account the key-value pair inserted into (or removed
+ * from) the locked edge node, if the map maintains the digests.
+ */
+static inline void
+digest_update(const thmap_t *thmap, const thmap_query_t *query,
+    thmap_inode_t *node, const void *key, size_t len, const void *val,
+    bool insert)
+{
+	uint64_t digest;
+
+	if (__predict_true((thmap->flags & THMAP_DIGEST) == 0)) {
+		return;
+	}
+	digest = key_digest(thmap, query->gen, key, len, val);
+	digest_add(thmap, node, insert ? digest : 0 - digest);
+}
+
+/*
+ * LEAF OPERATIONS.
+ */
+
+/*
+ * prefix_lookup: find the longest dictionary prefix of the key.
+ *
+ * => Returns the prefix index + 1 or zero if there is no match.
+ */
+static unsigned
+prefix_lookup(const thmap_t *thmap, const void *key, size_t len)
+{
+	/* Acquire from prior release in thmap_add_prefix(). */
+	const unsigned n = atomic_load_acquire(&thmap->nprefix);
+	unsigned i, best = 0;
+	size_t blen = 0;
+
+	for (i = 0; i < n; i++) {
+		const thmap_prefix_t *pfx = &thmap->prefix[i];
+
+		if (pfx->len <= blen || pfx->len > len) {
+			continue;
+		}
+		if (memcmp(key, THMAP_GETPTR(thmap, pfx->key), pfx->len) == 0) {
+			blen = pfx->len;
+			best = i + 1;
+		}
+	}
+	return best;
+}
+
+/*
+ * leaf_keylen: return the length of the key storage of the leaf.
+ */
+static size_t
+leaf_keylen(const thmap_t *thmap, const thmap_leaf_t *leaf)
+{
+	const thmap_pkey_t *pkey;
+	const thmap_prefix_t *pfx;
+
+	if (__predict_true((thmap->flags & THMAP_KEYPREFIX) == 0)) {
+		return leaf->len;
+	}
+	pkey = THMAP_GETPTR(thmap, leaf->key);
+	pfx = pkey_prefix(thmap, pkey);
+	return THMAP_PKEY_LEN(leaf->len - (pfx ? pfx->len : 0));
+}
+
+/*
+ * key_copy: allocate and copy the key, front-coding it if the map
+ * is using the prefix dictionary.
+ */
+static uintptr_t
+key_copy(const thmap_t *thmap, const void *key, size_t len)
+{
+	thmap_pkey_t *pkey;
+	uintptr_t key_off;
+	unsigned pidx;
+	size_t plen;
+
+	if ((thmap->flags & THMAP_KEYPREFIX) == 0) {
+		key_off = mem_alloc(thmap, len);
+		if (key_off) {
+			memcpy(THMAP_GETPTR(thmap, key_off), key, len);
+		}
+		return key_off;
+	}
+	/* The long keys are not front-coded, see leaf_key_get(). */
+	pidx = len <= THMAP_KEYBUF_LEN ? prefix_lookup(thmap, key, len) : 0;
+	plen = pidx ? thmap->prefix[pidx - 1].len : 0;
+
+	key_off = mem_alloc(thmap, THMAP_PKEY_LEN(len - plen));
+	if (key_off) {
+		pkey = THMAP_GETPTR(thmap, key_off);
+		pkey->prefix = pidx;
+		memcpy(pkey->suffix, (const uint8_t *)key + plen, len - plen);
+	}
+	return key_off;
+}
+
+static thmap_leaf_t *
+leaf_create(const thmap_t *thmap, const void *key, size_t len, void *val)
+{
+	thmap_leaf_t *leaf;
+	uintptr_t leaf_off, key_off;
+
+	if (__predict_false(len > THMAP_KEY_MAXLEN)) {
+		return NULL;
+	}
+	leaf_off = pool_alloc(thmap, POOL_LEAF);
+	if (!leaf_off) {
+		return NULL;
+	}
+	leaf = THMAP_GETPTR(thmap, leaf_off);
+	ASSERT(THMAP_ALIGNED_P(leaf));
 
 	if ((thmap->flags & THMAP_NOCOPY) == 0) {
 		/*
 		 * Copy the key.
 		 */
-		key_off = thmap->ops->alloc(len);
+		key_off = key_copy(thmap, key, len);
 		if (!key_off) {
-			thmap->ops->free(leaf_off, sizeof(thmap_leaf_t));
+			mem_free(thmap, leaf_off, sizeof(thmap_leaf_t));
 			return NULL;
 		}
-		memcpy(THMAP_GETPTR(thmap, key_off), key, len);
 		leaf->key = key_off;
 	} else {
 		/* Otherwise, we use a reference. */
 		leaf->key = (uintptr_t)key;
 	}
-	leaf->len = len;
+	leaf->len = (uint32_t)len;
 	leaf->val = val;
+	atomic_store_relaxed(&leaf->state, 0);
 	return leaf;
 }
 
 static void
 leaf_free(const thmap_t *thmap, thmap_leaf_t *leaf)
 {
+	if (thmap->flags & THMAP_INTRUSIVE) {
+		/* The entry of the caller. */
+		return;
+	}
 	if ((thmap->flags & THMAP_NOCOPY) == 0) {
-		thmap->ops->free(leaf->key, leaf->len);
+		mem_free(thmap, leaf->key, leaf_keylen(thmap, leaf));
+	}
+	mem_free(thmap, THMAP_GETOFF(thmap, leaf), sizeof(thmap_leaf_t));
+}
+
+/*
+ * leaf_incr: add to the counter in place, unless the leaf is removed.
+ * The increments in progress are counted in the leaf state, so that the
+ * removal could wait for them, see leaf_mark_deleted().
+ *
+ * => Returns false if the leaf was removed; the caller must re-try.
+ * => Sets the feed sequence number, taken while the increment is in
+ *    progress, i.e. before the one of the removal.
+ */
+static inline bool
+leaf_incr(thmap_t *thmap, thmap_leaf_t *leaf, uintptr_t delta,
+    uintptr_t *countp, uint64_t *seqp)
+{
+	/* Acquire from prior release in leaf_mark_deleted(). */
+	if (atomic_fetch_add_explicit(&leaf->state, LEAF_NINCR,
+	    memory_order_acquire) & LEAF_DELETED) {
+		atomic_fetch_sub_explicit(&leaf->state, LEAF_NINCR,
+		    memory_order_relaxed);
+		return false;
+	}
+	*countp = atomic_fetch_add_explicit(&leaf->count, delta,
+	    memory_order_relaxed) + delta;
+	*seqp = feed_seq(thmap);
+
+	/* Release to subsequent acquire in leaf_mark_deleted(). */
+	atomic_fetch_sub_explicit(&leaf->state, LEAF_NINCR,
+	    memory_order_release);
+	return true;
+}
+
+/*
+ * leaf_mark_deleted: mark the leaf, which is being removed, as deleted
+ * and wait for the increments in progress, so that the value read
+ * afterwards is final.
+ *
+ * => Must be called with the edge node lock held.
+ */
+static void
+leaf_mark_deleted(thmap_leaf_t *leaf)
+{
+	unsigned bcount = SPINLOCK_BACKOFF_MIN;
+
+	/* Release to subsequent acquire in leaf_incr(). */
+	atomic_fetch_or_explicit(&leaf->state, LEAF_DELETED,
+	    memory_order_release);
+
+	/* Acquire from prior release in leaf_incr(). */
+	while (atomic_load_acquire(&leaf->state) != LEAF_DELETED) {
+		SPINLOCK_BACKOFF(bcount);
+	}
+}
+
+/*
+ * pending_leaf: resolve the pending record of a transaction to the leaf
+ * which is visible: the new one, if committed, or the current one.
+ *
+ * => Returns NULL if neither is (the insert or the delete).
+ */
+static thmap_leaf_t *
+pending_leaf(const thmap_t *thmap, thmap_ptr_t ptr)
+{
+	const thmap_pending_t *pend = THMAP_NODE(thmap, ptr);
+	const thmap_txrec_t *txrec = THMAP_GETPTR(thmap, pend->txrec);
+	thmap_ptr_t leaf;
+
+	/* Acquire from prior release in txn_commit(). */
+	if (atomic_load_acquire(&txrec->status) == TXN_COMMITTED) {
+		leaf = pend->leaf;
+	} else {
+		leaf = pend->prev;
+	}
+	return leaf ? THMAP_GETPTR(thmap, leaf) : NULL;
+}
+
+/*
+ * slot_leaf: return the leaf of the (non-empty) leaf slot value.
+ *
+ * => Returns NULL if there is no visible leaf, see pending_leaf().
+ */
+static inline thmap_leaf_t *
+slot_leaf(const thmap_t *thmap, thmap_ptr_t ptr)
+{
+	ASSERT(ptr != THMAP_NULL && !THMAP_INODE_P(ptr));
+
+	if (__predict_false(THMAP_PENDING_P(ptr))) {
+		return pending_leaf(thmap, ptr);
 	}
-	thmap->ops->free(THMAP_GETOFF(thmap, leaf), sizeof(thmap_leaf_t));
+	return THMAP_NODE(thmap, ptr);
 }
 
 static thmap_leaf_t *
@@ -416,7 +1334,166 @@ get_leaf(const thmap_t *thmap, thmap_inode_t *parent, unsigned slot)
 	if (THMAP_INODE_P(node)) {
 		return NULL;
 	}
-	return THMAP_NODE(thmap, node);
+	return slot_leaf(thmap, node);
+}
+
+/*
+ * MUTATION FEED.
+ */
+
+/*
+ * feed_seq: reserve the next sequence number, if the feed is enabled.
+ *
+ * => Must be called at the linearisation point of the operation, i.e.
+ *    while holding the lock or before the CAS which publishes it.
+ * => The sequence numbers order the operations which are ordered by
+ *    the synchronisation following or preceding them, hence acq_rel.
+ */
+static inline uint64_t
+feed_seq(thmap_t *thmap)
+{
+	/* Consume from prior release in thmap_feed_init(). */
+	thmap_feed_t *feed = atomic_load_consume(&thmap->feed);
+
+	if (__predict_true(feed == NULL)) {
+		return 0;
+	}
+	return atomic_fetch_add_explicit(&feed->seq, 1,
+	    memory_order_acq_rel) + 1;
+}
+
+static thmap_ring_t *
+feed_ring(const thmap_feed_t *feed)
+{
+	return feed->rings[thread_index() % feed->nrings];
+}
+
+/*
+ * feed_enqueue: append the record to the ring of the current thread.
+ */
+static void
+feed_enqueue(thmap_feed_t *feed, unsigned op, uint64_t seq,
+    const void *key, size_t len, void *val)
+{
+	thmap_ring_t *ring = feed_ring(feed);
+	unsigned char *kbuf = NULL;
+	thmap_fslot_t *fs;
+	uint64_t pos;
+
+	if (len > THMAP_FEED_KEYLEN && (kbuf = malloc(len)) == NULL) {
+		goto lost;
+	}
+
+	/*
+	 * Reserve the slot: it is free if its turn matches the position.
+	 */
+	pos = atomic_load_relaxed(&ring->head);
+	for (;;) {
+		int64_t diff;
+
+		fs = &ring->slots[pos & ring->mask];
+		/* Acquire from prior release in feed_dequeue(). */
+		diff = (int64_t)(atomic_load_acquire(&fs->turn) - pos);
+		if (diff == 0 && atomic_compare_exchange_weak_explicit(
+		    &ring->head, &pos, pos + 1, memory_order_relaxed,
+		    memory_order_relaxed)) {
+			break;
+		}
+		if (diff < 0) {
+			/* The ring is full. */
+			free(kbuf);
+			goto lost;
+		}
+		pos = atomic_load_relaxed(&ring->head);
+	}
+
+	/*
+	 * Fill in the record and pass the slot to the consumers.
+	 */
+	if (kbuf == NULL) {
+		kbuf = fs->kbuf;
+	}
+	memcpy(kbuf, key, len);
+	fs->rec.seq = seq;
+	fs->rec.op = op;
+	fs->rec.key = kbuf;
+	fs->rec.len = len;
+	fs->rec.val = val;
+
+	/* Release to subsequent acquire in feed_dequeue(). */
+	atomic_store_release(&fs->turn, pos + 1);
+	return;
+lost:
+	atomic_fetch_add_explicit(&feed->lost, 1, memory_order_relaxed);
+}
+
+static inline void
+feed_emit(thmap_t *thmap, unsigned op, uint64_t seq,
+    const void *key, size_t len, void *val)
+{
+	/* Consume from prior release in thmap_feed_init(). */
+	thmap_feed_t *feed = atomic_load_consume(&thmap->feed);
+
+	if (__predict_false(feed != NULL)) {
+		feed_enqueue(feed, op, seq, key, len, val);
+	}
+}
+
+/*
+ * feed_dequeue: take the oldest record off the ring, pass it to the
+ * given function (if any) and release the slot.
+ *
+ * => Returns true if a record was consumed and false if the ring is empty.
+ */
+static bool
+feed_dequeue(thmap_ring_t *ring, thmap_feed_func_t func, void *arg)
+{
+	thmap_fslot_t *fs;
+	uint64_t pos;
+
+	pos = atomic_load_relaxed(&ring->tail);
+	for (;;) {
+		int64_t diff;
+
+		fs = &ring->slots[pos & ring->mask];
+		/* Acquire from prior release in feed_enqueue(). */
+		diff = (int64_t)(atomic_load_acquire(&fs->turn) - (pos + 1));
+		if (diff == 0 && atomic_compare_exchange_weak_explicit(
+		    &ring->tail, &pos, pos + 1, memory_order_relaxed,
+		    memory_order_relaxed)) {
+			break;
+		}
+		if (diff < 0) {
+			/* The ring is empty. */
+			return false;
+		}
+		pos = atomic_load_relaxed(&ring->tail);
+	}
+	if (func) {
+		func(&fs->rec, arg);
+	}
+	if (fs->rec.key != fs->kbuf) {
+		free(__UNCONST(fs->rec.key));
+	}
+
+	/* Release to subsequent acquire in feed_enqueue(). */
+	atomic_store_release(&fs->turn, pos + ring->mask + 1);
+	return true;
+}
+
+static void
+feed_destroy(thmap_feed_t *feed)
+{
+	for (unsigned i = 0; i < feed->nrings; i++) {
+		thmap_ring_t *ring = feed->rings[i];
+
+		if (ring) {
+			while (feed_dequeue(ring, NULL, NULL))
+				continue;
+			free(ring);
+		}
+	}
+	free(feed);
 }
 
 /*
@@ -426,12 +1503,17 @@ get_leaf(const thmap_t *thmap, thmap_inode_t *parent, unsigned slot)
 /*
  * root_try_put: Try to set a root pointer at query->rslot.
  *
+ * => Returns 1 on success, 0 if the slot is not empty and -1 on memory
+ *    allocation failure.
  * => Implies release operation on success.
  * => Implies no ordering on failure.
+ * => Sets the feed sequence number of the insert.
  */
-static inline bool
-root_try_put(thmap_t *thmap, const thmap_query_t *query, thmap_leaf_t *leaf)
+static inline int
+root_try_put(thmap_t *thmap, thmap_query_t *query,
+    const void * restrict key, size_t len, thmap_leaf_t *leaf)
 {
+	atomic_thmap_ptr_t *root = query->gen->root;
 	thmap_ptr_t expected;
 	const unsigned i = query->rslot;
 	thmap_inode_t *node;
@@ -441,10 +1523,10 @@ root_try_put(thmap_t *thmap, const thmap_query_t *query, thmap_leaf_t *leaf)
 	/*
 	 * Must pre-check first.  No ordering required because we will
 	 * check again before taking any actions, and start over if
-	 * this changes from null.
+	 * this changes from null.  Note: the moved slots are not null.
 	 */
-	if (atomic_load_relaxed(&thmap->root[i])) {
-		return false;
+	if (atomic_load_relaxed(&root[i])) {
+		return 0;
 	}
 
 	/*
@@ -452,22 +1534,36 @@ root_try_put(thmap_t *thmap, const thmap_query_t *query, thmap_leaf_t *leaf)
 	 * it will be created unlocked and the CAS operation will
 	 * release it to readers.
 	 */
-	node = node_create(thmap, NULL);
-	slot = hashval_getl0slot(thmap, query, leaf);
+	if ((node = node_create(thmap, NULL)) == NULL) {
+		return -1;
+	}
+	slot = hashval_getl0slot(thmap, query, key, len);
 	node_insert(node, slot, THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT);
 	nptr = THMAP_GETOFF(thmap, node);
+	if (thmap->flags & THMAP_DIGEST) {
+		/* Not yet published, no need for ordering. */
+		atomic_store_relaxed(node_digest(node),
+		    key_digest(thmap, query->gen, key, len, leaf->val));
+	}
+
+	/*
+	 * The sequence number is reserved before the CAS, therefore it
+	 * precedes any operation which observes the leaf.  A failed CAS
+	 * merely leaves a gap in the sequence.
+	 */
+	query->seq = feed_seq(thmap);
 again:
-	if (atomic_load_relaxed(&thmap->root[i])) {
-		thmap->ops->free(nptr, THMAP_INODE_LEN);
-		return false;
+	if (atomic_load_relaxed(&root[i])) {
+		mem_free(thmap, nptr, THMAP_INODE_LEN(thmap));
+		return 0;
 	}
 	/* Release to subsequent consume in find_edge_node(). */
 	expected = THMAP_NULL;
-	if (!atomic_compare_exchange_weak_explicit(&thmap->root[i], &expected,
+	if (!atomic_compare_exchange_weak_explicit(&root[i], &expected,
 	    nptr, memory_order_release, memory_order_relaxed)) {
 		goto again;
 	}
-	return true;
+	return 1;
 }
 
 /*
@@ -475,6 +1571,7 @@ again:
  *
  * => Returns an aligned (clean) pointer to the parent node.
  * => Returns the slot number and sets current level.
+ * => Follows the moved root slots into the next generation.
  */
 static thmap_inode_t *
 find_edge_node(const thmap_t *thmap, thmap_query_t *query,
@@ -486,15 +1583,19 @@ find_edge_node(const thmap_t *thmap, thmap_query_t *query,
 	unsigned off;
 
 	ASSERT(query->level == 0);
-
-	/* Consume from prior release in root_try_put(). */
-	root_slot = atomic_load_consume(&thmap->root[query->rslot]);
-	parent = THMAP_NODE(thmap, root_slot);
-	if (!parent) {
+retry:
+	/* Consume from prior release in root_try_put() or root_move(). */
+	root_slot = atomic_load_consume(&query->gen->root[query->rslot]);
+	if (__predict_false(root_slot == ROOT_MOVED)) {
+		hashval_next_gen(thmap, query, key, len);
+		goto retry;
+	}
+	if (root_slot == THMAP_NULL) {
 		return NULL;
 	}
+	parent = THMAP_NODE(thmap, root_slot);
 descend:
-	off = hashval_getslot(query, key, len);
+	off = hashval_getslot(thmap, query, key, len);
 	/* Consume from prior release in thmap_put(). */
 	node = atomic_load_consume(&parent->slots[off]);
 
@@ -510,6 +1611,17 @@ descend:
 	 * hence relaxed ordering.
 	 */
 	if (atomic_load_relaxed(&parent->state) & NODE_DELETED) {
+		/*
+		 * The node was either collapsed or its subtree was moved
+		 * to the next generation.  Acquire from prior release in
+		 * subtree_retire() to see the latter.
+		 */
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_relaxed(&query->gen->root[query->rslot]) ==
+		    ROOT_MOVED) {
+			query->level = 0;
+			goto retry;
+		}
 		return NULL;
 	}
 	*slot = off;
@@ -546,9 +1658,15 @@ retry:
 		/*
 		 * The node has been deleted.  The tree might have a new
 		 * shape now, therefore we must re-start from the root.
+		 * If the subtree was moved, then re-try in the next
+		 * generation (the slot is set before the node is deleted).
 		 */
 		unlock_node(node);
 		query->level = 0;
+		if (atomic_load_relaxed(&query->gen->root[query->rslot]) ==
+		    ROOT_MOVED) {
+			goto retry;
+		}
 		return NULL;
 	}
 	target = atomic_load_relaxed(&node->slots[*slot]);
@@ -565,306 +1683,4018 @@ retry:
 }
 
 /*
- * thmap_get: lookup a value given the key.
+ * find_leaf: lookup the leaf given the key.
  */
-void *
-thmap_get(thmap_t *thmap, const void *key, size_t len)
+static thmap_leaf_t *
+find_leaf(const thmap_t *thmap, thmap_query_t *query,
+    const void * restrict key, size_t len)
 {
-	thmap_query_t query;
 	thmap_inode_t *parent;
 	thmap_leaf_t *leaf;
+	thmap_ptr_t target;
 	unsigned slot;
-
-	hashval_init(&query, key, len);
-	parent = find_edge_node(thmap, &query, key, len, &slot);
+retry:
+	parent = find_edge_node(thmap, query, key, len, &slot);
 	if (!parent) {
 		return NULL;
 	}
 	leaf = get_leaf(thmap, parent, slot);
 	if (!leaf) {
+		/*
+		 * A concurrent expansion might have pushed the leaf
+		 * down into a new intermediate node since the descent
+		 * loaded the slot.  Re-start from the root.
+		 */
+		target = atomic_load_relaxed(&parent->slots[slot]);
+		if (target && THMAP_INODE_P(target)) {
+			query->level = 0;
+			goto retry;
+		}
 		return NULL;
 	}
 	if (!key_cmp_p(thmap, leaf, key, len)) {
 		return NULL;
 	}
-	return leaf->val;
+	return leaf;
 }
 
 /*
- * thmap_put: insert a value given the key.
+ * hazard_acquire: claim a hazard pointer record, starting with the one
+ * of the current thread in each block.
  *
- * => If the key is already present, return the associated value.
- * => Otherwise, on successful insert, return the given value.
+ * => If all records are in use, appends a new block with the record
+ *    claimed; on memory allocation failure, waits for a free record.
  */
-void *
-thmap_put(thmap_t *thmap, const void *key, size_t len, void *val)
+static thmap_hazard_t *
+hazard_acquire(const thmap_t *thmap)
 {
-	thmap_query_t query;
-	thmap_leaf_t *leaf, *other;
-	thmap_inode_t *parent, *child;
-	unsigned slot, other_slot;
-	thmap_ptr_t target;
+	const unsigned idx = thread_index();
+	thmap_hzblock_t *blk, *last, *nblk;
+again:
+	blk = thmap->hazards;
+	do {
+		for (unsigned i = 0; i < HAZARD_NRECS; i++) {
+			const unsigned r = (idx + i) % HAZARD_NRECS;
+			thmap_hazard_t *hz = &blk->recs[r];
 
-	/*
-	 * First, pre-allocate and initialize the leaf node.
-	 */
-	leaf = leaf_create(thmap, key, len, val);
-	if (__predict_false(!leaf)) {
-		return NULL;
+			/* Acquire from prior release in hazard_release(). */
+			if (!atomic_load_relaxed(&hz->busy) &&
+			    !atomic_exchange_explicit(&hz->busy, true,
+			    memory_order_acquire)) {
+				return hz;
+			}
+		}
+		last = blk;
+
+		/* Acquire from prior append below. */
+		blk = atomic_load_acquire(&last->next);
+	} while (blk);
+
+	if ((nblk = calloc(1, sizeof(thmap_hzblock_t))) == NULL) {
+		goto again;
 	}
-	hashval_init(&query, key, len);
-retry:
+	atomic_init(&nblk->recs[0].busy, true);
+	atomic_init(&nblk->next, NULL);
+
 	/*
-	 * Try to insert into the root first, if its slot is empty.
+	 * Sequentially consistent, thus the append precedes the hazard
+	 * pointers published in the block, if gc_hazards() is to see them.
 	 */
-	if (root_try_put(thmap, &query, leaf)) {
-		/* Success: the leaf was inserted; no locking involved. */
-		return val;
+	if (!atomic_compare_exchange_strong(&last->next, &blk, nblk)) {
+		/* Raced with another append: look at its block. */
+		free(nblk);
+		goto again;
 	}
+	return &nblk->recs[0];
+}
 
+static void
+hazard_release(thmap_hazard_t *hz)
+{
 	/*
-	 * Release node via store in node_insert (*) to subsequent
-	 * consume in get_leaf() or find_edge_node().
+	 * Release to subsequent acquire in gc_hazards(): the accesses
+	 * to the objects happen before they are freed.
 	 */
-	atomic_thread_fence(memory_order_release);
+	for (unsigned i = 0; i < HAZARD_NPTRS; i++) {
+		atomic_store_release(&hz->hp[i], 0);
+	}
+	atomic_store_release(&hz->busy, false);
+}
 
+/*
+ * hazard_set: publish the object; the caller validates it afterwards,
+ * using the sequentially consistent loads.
+ */
+static inline void
+hazard_set(thmap_hazard_t *hz, unsigned i, uintptr_t obj)
+{
 	/*
-	 * Find the edge node and the target slot.
+	 * Order the store before the validating loads; the exchange is
+	 * cheaper than the store followed by the fence.  Pairs with the
+	 * fence in gc_hazards().
 	 */
-	parent = find_edge_node_locked(thmap, &query, key, len, &slot);
-	if (!parent) {
-		goto retry;
+	(void)atomic_exchange_explicit(&hz->hp[i], obj, memory_order_seq_cst);
+}
+
+static _Thread_local thmap_reader_t *	cur_reader;
+static thmap_reader_t *_Atomic		readers;
+static thmap_reader_t			shared_reader;
+static atomic_uint			grace_mode;
+static pthread_key_t			reader_key;
+
+/*
+ * grace_unregister: mark the record of the exiting thread free.
+ */
+static void
+grace_unregister(void *arg)
+{
+	thmap_reader_t *r = arg;
+
+	ASSERT((atomic_load_relaxed(&r->ctr) & 1) == 0);
+	/* Release to subsequent CAS in grace_register(). */
+	atomic_store_release(&r->used, false);
+}
+
+static void
+grace_once(void)
+{
+	/*
+	 * On failure, pthread_setspecific() fails too, therefore the
+	 * readers enter the shared section.
+	 */
+	(void)pthread_key_create(&reader_key, grace_unregister);
+}
+
+/*
+ * grace_init: register the process for the expedited membarrier(2),
+ * once; otherwise, fall back to the reader-side fences.
+ */
+static void
+grace_init(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	unsigned mode = GRACE_FENCE;
+
+	pthread_once(&once, grace_once);
+	if (atomic_load_acquire(&grace_mode) != GRACE_UNKNOWN) {
+		return;
+	}
+#if defined(__linux__) && defined(__NR_membarrier)
+	if (syscall(__NR_membarrier,
+	    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0) {
+		mode = GRACE_MEMBARRIER;
+	}
+#endif
+	/* Release to subsequent acquire in grace_init() or grace_wait(). */
+	atomic_store_release(&grace_mode, mode);
+}
+
+/*
+ * grace_register: claim a free record for the current thread or allocate
+ * one and add it to the list of the readers.
+ *
+ * => Returns NULL on failure.
+ */
+static thmap_reader_t *
+grace_register(void)
+{
+	thmap_reader_t *r, *head;
+
+	/* Acquire from prior release in grace_register(). */
+	for (r = atomic_load_acquire(&readers); r; r = r->next) {
+		bool expected = false;
+
+		/* Acquire from prior release in grace_unregister(). */
+		if (!atomic_load_relaxed(&r->used) &&
+		    atomic_compare_exchange_strong_explicit(&r->used,
+		    &expected, true, memory_order_acquire,
+		    memory_order_relaxed)) {
+			break;
+		}
+	}
+	if (r == NULL) {
+		if ((r = calloc(1, sizeof(thmap_reader_t))) == NULL) {
+			return NULL;
+		}
+		atomic_store_relaxed(&r->used, true);
+
+		/* Release to subsequent acquire in grace_wait(). */
+		do {
+			head = atomic_load_relaxed(&readers);
+			r->next = head;
+		} while (!atomic_compare_exchange_weak_explicit(&readers,
+		    &head, r, memory_order_release, memory_order_relaxed));
+	}
+	if (pthread_setspecific(reader_key, r) != 0) {
+		/* Cannot be freed on the thread exit: give it back. */
+		atomic_store_release(&r->used, false);
+		return NULL;
+	}
+	cur_reader = r;
+	return r;
+}
+
+/*
+ * grace_enter: enter the read-side critical section.
+ *
+ * => Returns the record of the thread or the shared record, if it could
+ *    not be allocated.
+ */
+static inline thmap_reader_t *
+grace_enter(void)
+{
+	thmap_reader_t *r = cur_reader;
+
+	if (__predict_false(r == NULL) && (r = grace_register()) == NULL) {
+		/*
+		 * Enter the shared section.  The RMW orders the increment
+		 * before the loads of the lookup; pairs with grace_wait().
+		 */
+		r = &shared_reader;
+		atomic_fetch_add_explicit(&r->ctr, 1, memory_order_seq_cst);
+		return r;
+	}
+	ASSERT((atomic_load_relaxed(&r->ctr) & 1) == 0);
+	atomic_store_relaxed(&r->ctr, atomic_load_relaxed(&r->ctr) + 1);
+
+	/*
+	 * Order the store before the loads of the lookup.  With the
+	 * membarrier(2), the compiler barrier suffices: the reclaimer
+	 * either sees the section or the lookup sees the unlinked tree.
+	 * Pairs with grace_barrier().
+	 */
+	if (__predict_true(atomic_load_relaxed(&grace_mode) ==
+	    GRACE_MEMBARRIER)) {
+		atomic_signal_fence(memory_order_seq_cst);
+	} else {
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+	return r;
+}
+
+static inline void
+grace_exit(thmap_reader_t *r)
+{
+	/* Release to subsequent acquire in grace_wait(). */
+	if (__predict_false(r == &shared_reader)) {
+		atomic_fetch_sub_explicit(&r->ctr, 1, memory_order_release);
+		return;
+	}
+	atomic_store_release(&r->ctr, atomic_load_relaxed(&r->ctr) + 1);
+}
+
+static void
+grace_barrier(void)
+{
+#if defined(__linux__) && defined(__NR_membarrier)
+	/* Acquire from prior release in grace_init(). */
+	if (atomic_load_acquire(&grace_mode) == GRACE_MEMBARRIER &&
+	    syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED,
+	    0, 0) == 0) {
+		return;
+	}
+#endif
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+/*
+ * grace_wait: wait for the grace period, i.e. for the read-side critical
+ * sections which could have seen the objects unlinked before the call.
+ */
+static void
+grace_wait(void)
+{
+	grace_barrier();
+
+	/* Acquire from prior release in grace_register(). */
+	for (thmap_reader_t *r = atomic_load_acquire(&readers); r;
+	    r = r->next) {
+		/* Acquire from prior release in grace_exit(). */
+		const uint64_t c = atomic_load_acquire(&r->ctr);
+		unsigned bcount = SPINLOCK_BACKOFF_MIN;
+
+		if ((c & 1) == 0) {
+			continue;
+		}
+		while (atomic_load_acquire(&r->ctr) == c) {
+			SPINLOCK_BACKOFF(bcount);
+		}
+	}
+
+	/*
+	 * Wait for the shared section to drain.  The threads entering it
+	 * afterwards cannot see the unlinked objects, but they delay the
+	 * drain; the allocation failures are expected to be transient.
+	 */
+	for (unsigned bcount = SPINLOCK_BACKOFF_MIN;
+	    atomic_load_acquire(&shared_reader.ctr) != 0;) {
+		SPINLOCK_BACKOFF(bcount);
+	}
+}
+
+/*
+ * hazard_stale_p: check whether the object loaded from the slot might
+ * have been staged for G/C, i.e. it was unlinked from the slot or its
+ * subtree was moved (the nodes are retired without being unlinked).
+ */
+static inline bool
+hazard_stale_p(atomic_thmap_ptr_t *slot, thmap_ptr_t ptr,
+    atomic_thmap_ptr_t *rootp, thmap_ptr_t root_slot)
+{
+	return atomic_load_explicit(slot, memory_order_seq_cst) != ptr ||
+	    atomic_load_explicit(rootp, memory_order_seq_cst) != root_slot;
+}
+
+/*
+ * find_leaf_hazard: lookup the leaf given the key, like find_leaf(),
+ * but publishing each object in the hazard pointer record before
+ * accessing it (THMAP_HAZARD).
+ *
+ * => If the published object is stale, re-start from the root.
+ * => The record is released by the caller.
+ */
+static thmap_leaf_t *
+find_leaf_hazard(const thmap_t *thmap, thmap_hazard_t *hz,
+    const void * restrict key, size_t len)
+{
+	const thmap_gen_t *gen, *next, *cur;
+	atomic_thmap_ptr_t *rootp;
+	thmap_ptr_t root_slot, ptr;
+	thmap_inode_t *parent;
+	thmap_query_t query;
+	thmap_leaf_t *leaf;
+	unsigned off, h;
+retry:
+	/* Acquire from prior release in thmap_reseed_step(). */
+	gen = atomic_load_acquire(&thmap->gen);
+	hazard_set(hz, HP_GEN, (uintptr_t)gen);
+	if (atomic_load_explicit(&thmap->gen, memory_order_seq_cst) != gen) {
+		goto retry;
+	}
+	hashval_init_gen(thmap, gen, &query, key, len);
+root:
+	rootp = &gen->root[query.rslot];
+	/* Consume from prior release in root_try_put() or root_move(). */
+	root_slot = atomic_load_consume(rootp);
+	if (__predict_false(root_slot == ROOT_MOVED)) {
+		/*
+		 * The next generation is staged only after it became
+		 * the current one and was migrated from, therefore the
+		 * current generation must be one of the two.  Acquire
+		 * from prior release in thmap_reseed_start().
+		 */
+		next = atomic_load_acquire(&gen->next);
+		hazard_set(hz, HP_GEN, (uintptr_t)next);
+		cur = atomic_load_explicit(&thmap->gen, memory_order_seq_cst);
+		if (cur != gen && cur != next) {
+			goto retry;
+		}
+		gen = next;
+		hashval_init_gen(thmap, gen, &query, key, len);
+		goto root;
+	}
+	if (root_slot == THMAP_NULL) {
+		return NULL;
+	}
+	hazard_set(hz, HP_NODE, THMAP_ALIGN(root_slot));
+	if (atomic_load_explicit(rootp, memory_order_seq_cst) != root_slot) {
+		goto retry;
+	}
+	parent = THMAP_NODE(thmap, root_slot);
+	h = 0;
+descend:
+	off = hashval_getslot(thmap, &query, key, len);
+	/* Consume from prior release in thmap_put(). */
+	ptr = atomic_load_consume(&parent->slots[off]);
+	if (ptr == THMAP_NULL) {
+		/* The empty slot of the moved subtree is not conclusive. */
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_relaxed(rootp) != root_slot) {
+			goto retry;
+		}
+		return NULL;
+	}
+	if (THMAP_INODE_P(ptr)) {
+		/* Keep the parent published until the child is validated. */
+		h ^= 1;
+		hazard_set(hz, HP_NODE + h, THMAP_ALIGN(ptr));
+		if (hazard_stale_p(&parent->slots[off], ptr,
+		    rootp, root_slot)) {
+			goto retry;
+		}
+		parent = THMAP_NODE(thmap, ptr);
+		query.level++;
+		goto descend;
+	}
+	if (THMAP_PENDING_P(ptr)) {
+		/* The pending record is within the transaction record. */
+		hazard_set(hz, HP_NODE + (h ^ 1), THMAP_ALIGN(ptr));
+		if (hazard_stale_p(&parent->slots[off], ptr,
+		    rootp, root_slot)) {
+			goto retry;
+		}
+	}
+	if ((leaf = slot_leaf(thmap, ptr)) == NULL) {
+		return NULL;
+	}
+
+	/*
+	 * The leaves referenced by the pending record are staged only
+	 * after the record is replaced in the slot.
+	 */
+	hazard_set(hz, HP_LEAF, THMAP_GETOFF(thmap, leaf));
+	if (hazard_stale_p(&parent->slots[off], ptr, rootp, root_slot)) {
+		goto retry;
+	}
+	if (!key_cmp_p(thmap, leaf, key, len)) {
+		return NULL;
+	}
+	return leaf;
+}
+
+/*
+ * thmap_get: lookup a value given the key.
+ *
+ * => Not applicable to THMAP_MULTI (see thmap_get_multi()).
+ */
+void *
+thmap_get(thmap_t *thmap, const void *key, size_t len)
+{
+	thmap_query_t query;
+	thmap_leaf_t *leaf;
+
+	if (__predict_false(thmap->flags & THMAP_MULTI)) {
+		return NULL;
+	}
+	if (thmap->flags & THMAP_HAZARD) {
+		thmap_hazard_t *hz = hazard_acquire(thmap);
+		void *val;
+
+		leaf = find_leaf_hazard(thmap, hz, key, len);
+		val = leaf ? leaf->val : NULL;
+		hazard_release(hz);
+		return val;
+	}
+	if (thmap->flags & THMAP_GRACE) {
+		thmap_reader_t *r = grace_enter();
+		void *val;
+
+		hashval_init(thmap, &query, key, len);
+		leaf = find_leaf(thmap, &query, key, len);
+		val = leaf ? leaf->val : NULL;
+		grace_exit(r);
+		return val;
+	}
+	hashval_init(thmap, &query, key, len);
+	leaf = find_leaf(thmap, &query, key, len);
+	return leaf ? leaf->val : NULL;
+}
+
+/*
+ * LOOKUP CACHE.
+ *
+ * The direct-mapped cache of the recently found leaves, owned by the
+ * caller (normally, one per thread), indexed by the first hash block.
+ * The entries are validated against the key and the LEAF_DELETED mark,
+ * which is set when the leaf is removed, before it is staged for G/C.
+ * The leaves may be freed once staged, therefore the cache is flushed
+ * whenever the G/C epoch changes, i.e. on each thmap_stage_gc() call.
+ */
+
+typedef struct {
+	uint32_t		hashval;
+	const thmap_leaf_t *	leaf;
+} thmap_centry_t;
+
+struct thmap_cache {
+	thmap_t *		thmap;
+	uint64_t		epoch;
+	unsigned		mask;
+	thmap_centry_t		entries[];
+};
+
+#define	THMAP_CACHE_MAX		(1U << 20)
+
+/*
+ * thmap_cache_create: create the lookup cache for the map, with the
+ * given number of entries (rounded up to a power of two).
+ *
+ * => Not applicable to THMAP_MULTI.
+ */
+thmap_cache_t *
+thmap_cache_create(thmap_t *thmap, unsigned nentries)
+{
+	thmap_cache_t *cache;
+	unsigned n = 1;
+
+	if ((thmap->flags & THMAP_MULTI) != 0 ||
+	    nentries == 0 || nentries > THMAP_CACHE_MAX) {
+		return NULL;
+	}
+	while (n < nentries) {
+		n <<= 1;
+	}
+	cache = calloc(1, offsetof(thmap_cache_t, entries[n]));
+	if (cache == NULL) {
+		return NULL;
+	}
+	cache->thmap = thmap;
+	cache->epoch = atomic_load_relaxed(&thmap->gc_epoch);
+	cache->mask = n - 1;
+	return cache;
+}
+
+void
+thmap_cache_destroy(thmap_cache_t *cache)
+{
+	free(cache);
+}
+
+/*
+ * thmap_cache_get: lookup a value given the key, using the cache.
+ *
+ * => The cache must not be used concurrently, e.g. it is per-thread.
+ */
+void *
+thmap_cache_get(thmap_cache_t *cache, const void *key, size_t len)
+{
+	thmap_t *thmap = cache->thmap;
+	const thmap_leaf_t *leaf;
+	thmap_centry_t *ce;
+	thmap_query_t query;
+	uint64_t epoch;
+
+	/* Acquire from prior release in thmap_stage_gc(). */
+	epoch = atomic_load_acquire(&thmap->gc_epoch);
+	if (__predict_false(cache->epoch != epoch)) {
+		/* The cached leaves might have been freed: flush. */
+		memset(cache->entries, 0,
+		    sizeof(thmap_centry_t) * (cache->mask + 1));
+		cache->epoch = epoch;
+	}
+
+	hashval_init(thmap, &query, key, len);
+	ce = &cache->entries[query.hashval & cache->mask];
+	leaf = ce->leaf;
+	if (leaf && ce->hashval == query.hashval &&
+	    (atomic_load_relaxed(&leaf->state) & LEAF_DELETED) == 0 &&
+	    key_cmp_p(thmap, leaf, key, len)) {
+		/* Hit. */
+		return leaf->val;
+	}
+
+	/* Miss: lookup and cache the leaf. */
+	ce->hashval = query.hashval;
+	ce->leaf = leaf = find_leaf(thmap, &query, key, len);
+	return leaf ? leaf->val : NULL;
+}
+
+/*
+ * PREFETCH.
+ *
+ * The prefetch descends one level per step: it loads the slot which
+ * was prefetched by the previous step (hence, normally, without a stall)
+ * and prefetches the slot of the next level, the leaf and, finally, the
+ * key.  The root level is small enough to be normally in the cache.
+ */
+
+typedef struct {
+	thmap_query_t			query;
+	const void *			key;
+	size_t				len;
+	const atomic_thmap_ptr_t *	slotp;	// the slot prefetched
+	const thmap_leaf_t *		leaf;	// the leaf prefetched
+} thmap_pf_t;
+
+static_assert(sizeof(thmap_pf_t) <= sizeof(thmap_prefetch_t),
+    "thmap_prefetch_t is too small");
+
+/*
+ * thmap_prefetch_start: start the incremental prefetch of the key.
+ *
+ * => The key must stay valid until the prefetch completes.
+ * => Prefetches the root slot.
+ */
+void
+thmap_prefetch_start(thmap_t *thmap, thmap_prefetch_t *pfs,
+    const void *key, size_t len)
+{
+	thmap_pf_t *pf = (thmap_pf_t *)(void *)pfs;
+
+	hashval_init(thmap, &pf->query, key, len);
+	pf->key = key;
+	pf->len = len;
+	pf->slotp = &pf->query.gen->root[pf->query.rslot];
+	pf->leaf = NULL;
+	prefetch(pf->slotp);
+}
+
+/*
+ * thmap_prefetch_step: advance the prefetch by one level.
+ *
+ * => The steps are subject to the same G/C rules as the lookup, i.e. the
+ *    prefetch must complete before the caller passes the G/C barrier.
+ * => Returns 1 if there is more to prefetch and 0 if done.
+ */
+int
+thmap_prefetch_step(thmap_t *thmap, thmap_prefetch_t *pfs)
+{
+	thmap_pf_t *pf = (thmap_pf_t *)(void *)pfs;
+	thmap_query_t *query = &pf->query;
+	thmap_inode_t *node;
+	thmap_ptr_t ptr;
+	unsigned slot;
+
+	if (pf->leaf) {
+		/* Last: the key of the leaf. */
+		prefetch(THMAP_GETPTR(thmap, pf->leaf->key));
+		pf->leaf = NULL;
+		pf->slotp = NULL;
+		return 0;
+	}
+	if (pf->slotp == NULL) {
+		return 0;
+	}
+
+	/* Consume from prior release in root_try_put() or put_leaf(). */
+	ptr = atomic_load_consume(pf->slotp);
+	if (pf->slotp == &query->gen->root[query->rslot]) {
+		if (__predict_false(ptr == ROOT_MOVED)) {
+			hashval_next_gen(thmap, query, pf->key, pf->len);
+			pf->slotp = &query->gen->root[query->rslot];
+			prefetch(pf->slotp);
+			return 1;
+		}
+	} else if (ptr && THMAP_INODE_P(ptr)) {
+		query->level++;
+	}
+	if (ptr == THMAP_NULL) {
+		/* Empty slot: nothing more to prefetch. */
+		pf->slotp = NULL;
+		return 0;
+	}
+	if (!THMAP_INODE_P(ptr)) {
+		if ((pf->leaf = slot_leaf(thmap, ptr)) == NULL) {
+			pf->slotp = NULL;
+			return 0;
+		}
+		prefetch(pf->leaf);
+		return 1;
+	}
+	node = THMAP_NODE(thmap, ptr);
+	slot = hashval_getslot(thmap, query, pf->key, pf->len);
+	pf->slotp = &node->slots[slot];
+	prefetch(pf->slotp);
+	return 1;
+}
+
+/*
+ * thmap_prefetch: hash the key and prefetch its root slot.
+ *
+ * => Does not load anything which was not in the cache: the deeper
+ *    levels are left to thmap_prefetch_step().
+ */
+void
+thmap_prefetch(thmap_t *thmap, const void *key, size_t len)
+{
+	thmap_prefetch_t pfs;
+
+	thmap_prefetch_start(thmap, &pfs, key, len);
+}
+
+/*
+ * SAMPLING.
+ *
+ * The random leaf is found by a random walk: a random root slot and
+ * then, at each level, a random non-empty slot of the node.  The walk
+ * is biased towards the leaves in the sparse subtrees: the probability
+ * of reaching the leaf is 1 / (ROOT_SIZE * W), where W is the product of
+ * the non-empty slot counts of the nodes on the path.  Hence, the leaf
+ * is accepted with the probability W / Wmax (rejection sampling), where
+ * Wmax is the largest weight seen so far.  The result is approximately
+ * uniform: the leaves heavier than any seen before are under-sampled
+ * until found.  Wmax decays on repeated rejections, e.g. once the map
+ * has shrunk.
+ */
+
+#define	THMAP_SAMPLE_WMAX	(UINT64_C(1) << 60)
+#define	THMAP_SAMPLE_RETRIES	256
+
+static _Thread_local uint64_t	sample_rng;
+
+static uint64_t
+sample_random(void)
+{
+	uint64_t x = sample_rng;
+
+	if (__predict_false(x == 0)) {
+		uint64_t seed[2];
+
+		if (random_seed(seed) == -1) {
+			seed[0] = (uintptr_t)&sample_rng;
+		}
+		x = digest_mix(seed[0]) | 1;
+	}
+	/* Xorshift64. */
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	sample_rng = x;
+	return x;
+}
+
+/*
+ * sample_walk: random walk from the root slot down to a leaf.
+ *
+ * => Returns NULL if the walk has reached an empty slot.
+ * => Sets the weight of the path.
+ */
+static thmap_leaf_t *
+sample_walk(const thmap_t *thmap, const thmap_gen_t *gen, unsigned rslot,
+    uint64_t *weight)
+{
+	thmap_ptr_t ptr;
+	uint64_t w = 1;
+
+	/* Consume from prior release in root_try_put() or root_move(). */
+	ptr = atomic_load_consume(&gen->root[rslot]);
+	while (__predict_false(ptr == ROOT_MOVED)) {
+		/*
+		 * Being reseeded: approximate, take the next generation.
+		 * Acquire from prior release in thmap_reseed_start().
+		 */
+		gen = atomic_load_acquire(&gen->next);
+		ptr = atomic_load_consume(&gen->root[rslot]);
+	}
+	ptr = THMAP_ALIGN(ptr);
+
+	while (ptr != THMAP_NULL && THMAP_INODE_P(ptr)) {
+		thmap_inode_t *node = THMAP_NODE(thmap, ptr);
+		thmap_ptr_t slots[LEVEL_SIZE];
+		unsigned n = 0;
+
+		for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+			/* Consume from prior release in put_leaf(). */
+			const thmap_ptr_t child =
+			    atomic_load_consume(&node->slots[i]);
+
+			if (child != THMAP_NULL) {
+				slots[n++] = child;
+			}
+		}
+		if (n == 0) {
+			return NULL;
+		}
+		ptr = slots[sample_random() % n];
+		w = MIN(w * n, THMAP_SAMPLE_WMAX);
+	}
+	if (ptr == THMAP_NULL) {
+		return NULL;
+	}
+	*weight = w;
+	return slot_leaf(thmap, ptr);
+}
+
+/*
+ * subtree_empty_p: check whether the subtree has no leaves, e.g. the
+ * empty nodes left by THMAP_LAZYDEL or a transaction.
+ */
+static bool
+subtree_empty_p(const thmap_t *thmap, thmap_ptr_t ptr)
+{
+	thmap_inode_t *node;
+
+	if (ptr == THMAP_NULL) {
+		return true;
+	}
+	if (!THMAP_INODE_P(ptr)) {
+		return false;
+	}
+	node = THMAP_NODE(thmap, ptr);
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		/* Consume from prior release in put_leaf(). */
+		const thmap_ptr_t child = atomic_load_consume(&node->slots[i]);
+
+		if (!subtree_empty_p(thmap, child)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+root_empty_p(const thmap_t *thmap, const thmap_gen_t *gen)
+{
+	for (unsigned i = 0; i < ROOT_SIZE; i++) {
+		/* Consume from prior release in root_try_put(). */
+		const thmap_ptr_t ptr = atomic_load_consume(&gen->root[i]);
+
+		if (ptr == ROOT_MOVED ||
+		    !subtree_empty_p(thmap, THMAP_ALIGN(ptr))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * sample_leaf: pick an approximately uniform random leaf.
+ *
+ * => Returns NULL if the map is empty.
+ */
+static thmap_leaf_t *
+sample_leaf(thmap_t *thmap)
+{
+	/* Acquire from prior release in thmap_reseed_step(). */
+	const thmap_gen_t *gen = atomic_load_acquire(&thmap->gen);
+	unsigned nempty = 0, nrejected = 0;
+
+	if (gen->root == NULL) {
+		return NULL;
+	}
+	for (;;) {
+		const unsigned rslot = sample_random() & ROOT_MASK;
+		uint64_t w, wmax;
+		thmap_leaf_t *leaf;
+
+		if ((leaf = sample_walk(thmap, gen, rslot, &w)) == NULL) {
+			/* Check whether the map is empty, once in a while. */
+			if (++nempty % (2 * ROOT_SIZE) == 0 &&
+			    root_empty_p(thmap, gen)) {
+				return NULL;
+			}
+			continue;
+		}
+
+		wmax = atomic_load_relaxed(&thmap->sample_wmax);
+		if (w >= wmax) {
+			/* The new maximum (races are benign). */
+			atomic_store_relaxed(&thmap->sample_wmax, w);
+			return leaf;
+		}
+		if (sample_random() % wmax < w) {
+			return leaf;
+		}
+		if (++nrejected % THMAP_SAMPLE_RETRIES == 0) {
+			/* The maximum might be stale: decay it. */
+			atomic_store_relaxed(&thmap->sample_wmax,
+			    MAX(wmax / 2, w));
+		}
+	}
+}
+
+/*
+ * thmap_sample: call the function for n approximately uniform random
+ * entries of the map (with replacement), without locking.
+ *
+ * => The function may be called for the deleted entries, as lookups
+ *    may return them; the usual G/C rules apply.
+ * => Returns the number of the entries sampled, i.e. zero if the map
+ *    is empty, or n.
+ */
+size_t
+thmap_sample(thmap_t *thmap, size_t n, thmap_sample_func_t func, void *arg)
+{
+	size_t i;
+
+	if (thmap->flags & THMAP_MULTI) {
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		uint8_t buf[THMAP_KEYBUF_LEN];
+		thmap_leaf_t *leaf;
+		const void *key;
+
+		if ((leaf = sample_leaf(thmap)) == NULL) {
+			break;
+		}
+		key = leaf_key_get(thmap, leaf, buf);
+		func(key, leaf->len, leaf->val, arg);
+	}
+	return i;
+}
+
+/*
+ * put_leaf: insert the pre-allocated leaf given the key.
+ *
+ * => Returns the given leaf on successful insert and sets the feed
+ *    sequence number in the query.
+ * => If the key is already present, returns the existing leaf.
+ * => Returns NULL on memory allocation failure.
+ * => In the latter two cases, the caller is responsible for the leaf.
+ */
+static thmap_leaf_t *
+put_leaf(thmap_t *thmap, thmap_query_t *query,
+    const void *key, size_t len, thmap_leaf_t *leaf)
+{
+	thmap_leaf_t *other, *ret = leaf;
+	thmap_inode_t *parent, *child;
+	unsigned slot, other_slot;
+	thmap_ptr_t target;
+	int error;
+retry:
+	/*
+	 * Try to insert into the root first, if its slot is empty.
+	 */
+	if ((error = root_try_put(thmap, query, key, len, leaf)) != 0) {
+		/* Inserted (no locking involved) or failed. */
+		return error > 0 ? leaf : NULL;
+	}
+
+	/*
+	 * Release node via store in node_insert (*) to subsequent
+	 * consume in get_leaf() or find_edge_node().
+	 */
+	atomic_thread_fence(memory_order_release);
+
+	/*
+	 * Find the edge node and the target slot.
+	 */
+	parent = find_edge_node_locked(thmap, query, key, len, &slot);
+	if (!parent) {
+		goto retry;
+	}
+	target = atomic_load_relaxed(&parent->slots[slot]); // tagged offset
+	if (THMAP_INODE_P(target)) {
+		/*
+		 * Empty slot: simply insert the new leaf.  The release
+		 * fence is already issued for us.
+		 */
+		target = THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT;
+		query->seq = feed_seq(thmap);
+		node_insert(parent, slot, target); /* (*) */
+		digest_update(thmap, query, parent, key, len, leaf->val, true);
+		goto out;
+	}
+
+	/*
+	 * Collision or duplicate.
+	 */
+	other = THMAP_NODE(thmap, target);
+	if (key_cmp_p(thmap, other, key, len)) {
+		/* Duplicate: return the present leaf. */
+		ret = other;
+		goto out;
+	}
+descend:
+	/*
+	 * Collision -- expand the tree.  Create an intermediate node
+	 * which will be locked (NODE_LOCKED) for us.  At this point,
+	 * we advance to the next level.
+	 */
+	other_slot = hashval_getleafslot(thmap, query->gen, other,
+	    query->level + 1);
+	child = node_create(thmap, parent);
+	if (__predict_false(!child)) {
+		ret = NULL;
+		goto out;
+	}
+	if (thmap->flags & THMAP_DIGEST) {
+		/* The other leaf is already accounted in the ancestors. */
+		atomic_store_relaxed(node_digest(child),
+		    leaf_digest(thmap, query->gen, other));
+	}
+	query->level++;
+
+	if (__predict_false(query->level == THMAP_DEPTH_MAX)) {
+		/* Excessive depth: let thmap_reseed_step() act. */
+		atomic_store_relaxed(&thmap->reseed, true);
+	}
+
+	/*
+	 * Insert the other (colliding) leaf first.  The new child is
+	 * not yet published, so memory order is relaxed.
+	 */
+	target = THMAP_GETOFF(thmap, other) | THMAP_LEAF_BIT;
+	node_insert(child, other_slot, target);
+
+	/*
+	 * Insert the intermediate node into the parent node.
+	 * It becomes the new parent for the our new leaf.
+	 *
+	 * Ensure that stores to the child (and leaf) reach global
+	 * visibility before it gets inserted to the parent, as
+	 * consumed by get_leaf() or find_edge_node().
+	 */
+	atomic_store_release(&parent->slots[slot], THMAP_GETOFF(thmap, child));
+
+	unlock_node(parent);
+	ASSERT(node_locked_p(child));
+	parent = child;
+
+	/*
+	 * Get the new slot and check for another collision
+	 * at the next level.
+	 */
+	slot = hashval_getslot(thmap, query, key, len);
+	if (slot == other_slot) {
+		/* Another collision -- descend and expand again. */
+		goto descend;
+	}
+
+	/*
+	 * Insert our new leaf once we expanded enough.  The release
+	 * fence is already issued for us.
+	 */
+	target = THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT;
+	query->seq = feed_seq(thmap);
+	node_insert(parent, slot, target); /* (*) */
+	digest_update(thmap, query, parent, key, len, leaf->val, true);
+out:
+	unlock_node(parent);
+	return ret;
+}
+
+/*
+ * incr_locked: increment the counter under the edge node lock, updating
+ * the digests (THMAP_DIGEST).
+ *
+ * => Returns false if the key is not found.
+ */
+static bool
+incr_locked(thmap_t *thmap, thmap_query_t *query, const void *key,
+    size_t len, uintptr_t delta, uintptr_t *countp)
+{
+	thmap_inode_t *parent;
+	thmap_leaf_t *leaf;
+	uintptr_t count;
+	unsigned slot;
+
+	parent = find_edge_node_locked(thmap, query, key, len, &slot);
+	if (!parent) {
+		return false;
+	}
+	leaf = get_leaf(thmap, parent, slot);
+	if (!leaf || !key_cmp_p(thmap, leaf, key, len)) {
+		unlock_node(parent);
+		query->level = 0;
+		return false;
+	}
+	count = atomic_load_relaxed(&leaf->count);
+	atomic_store_relaxed(&leaf->count, count + delta);
+	query->seq = feed_seq(thmap);
+	digest_add(thmap, parent,
+	    key_digest(thmap, query->gen, key, len, (void *)(count + delta)) -
+	    key_digest(thmap, query->gen, key, len, (void *)count));
+	unlock_node(parent);
+
+	*countp = count + delta;
+	return true;
+}
+
+/*
+ * thmap_put: insert a value given the key.
+ *
+ * => If the key is already present, return the associated value.
+ * => Otherwise, on successful insert, return the given value.
+ */
+void *
+thmap_put(thmap_t *thmap, const void *key, size_t len, void *val)
+{
+	thmap_query_t query;
+	thmap_leaf_t *leaf, *other;
+
+	if (__predict_false(thmap->flags & THMAP_MULTI)) {
+		return thmap_put_multi(thmap, key, len, val) == 0 ? val : NULL;
+	}
+	if (__predict_false(thmap->flags & THMAP_INTRUSIVE)) {
+		/* See thmap_put_entry(). */
+		return NULL;
+	}
+
+	/*
+	 * First, pre-allocate and initialize the leaf node.
+	 */
+	leaf = leaf_create(thmap, key, len, val);
+	if (__predict_false(!leaf)) {
+		return NULL;
+	}
+	hashval_init(thmap, &query, key, len);
+	other = put_leaf(thmap, &query, key, len, leaf);
+	if (__predict_true(other == leaf)) {
+		feed_emit(thmap, THMAP_OP_PUT, query.seq, key, len, val);
+		return val;
+	}
+
+	/*
+	 * Duplicate or failure.  Free the pre-allocated leaf and
+	 * return the present value, if any.
+	 */
+	leaf_free(thmap, leaf);
+	return other ? other->val : NULL;
+}
+
+/*
+ * thmap_incr: add the delta to the counter associated with the key or,
+ * if the key is not present, insert it with the counter set to delta.
+ *
+ * => The counter is stored in place of the value, see thmap_get().
+ * => Returns the updated counter value or zero on failure (a counter
+ *    which becomes zero cannot be told apart).
+ */
+uintptr_t
+thmap_incr(thmap_t *thmap, const void *key, size_t len, uintptr_t delta)
+{
+	thmap_query_t query;
+	thmap_leaf_t *leaf, *other;
+	uintptr_t count;
+	uint64_t seq;
+
+	if (__predict_false(thmap->flags & (THMAP_MULTI | THMAP_INTRUSIVE))) {
+		return 0;
+	}
+	if (__predict_false(thmap->dtor_func)) {
+		/* The counters would be passed to the destructor. */
+		return 0;
+	}
+	if (!atomic_load_relaxed(&thmap->counters)) {
+		atomic_store_relaxed(&thmap->counters, true);
+	}
+retry:
+	hashval_init(thmap, &query, key, len);
+	if (__predict_false(thmap->flags & THMAP_DIGEST)) {
+		/* The digests are updated under the edge node lock. */
+		if (incr_locked(thmap, &query, key, len, delta, &count)) {
+			seq = query.seq;
+			goto out;
+		}
+		goto insert;
+	}
+
+	/*
+	 * Fast path: lock-free lookup and the atomic add in place.
+	 */
+	if ((leaf = find_leaf(thmap, &query, key, len)) != NULL) {
+		goto incr;
+	}
+insert:
+
+	/*
+	 * Not found: insert a new counter.  Continue with the same
+	 * query; we raced with another insert if it is a duplicate.
+	 */
+	leaf = leaf_create(thmap, key, len, (void *)delta);
+	if (__predict_false(!leaf)) {
+		return 0;
+	}
+	query.level = 0;
+	other = put_leaf(thmap, &query, key, len, leaf);
+	if (__predict_true(other == leaf)) {
+		feed_emit(thmap, THMAP_OP_INCR, query.seq, key, len,
+		    (void *)delta);
+		return delta;
+	}
+	leaf_free(thmap, leaf);
+	if (__predict_false(!other)) {
+		return 0;
+	}
+	if (thmap->flags & THMAP_DIGEST) {
+		/* Raced with another insert: re-try under the lock. */
+		goto retry;
+	}
+	leaf = other;
+incr:
+	if (!leaf_incr(thmap, leaf, delta, &count, &seq)) {
+		/* Raced with the removal: re-try from the top. */
+		goto retry;
+	}
+out:
+	feed_emit(thmap, THMAP_OP_INCR, seq, key, len, (void *)delta);
+	return count;
+}
+
+/*
+ * MULTI-VALUE OPERATIONS.
+ */
+
+static thmap_vchunk_t *
+vchunk_create(const thmap_t *thmap, void *val)
+{
+	thmap_vchunk_t *chunk;
+	uintptr_t p;
+
+	p = mem_alloc(thmap, sizeof(thmap_vchunk_t));
+	if (!p) {
+		return NULL;
+	}
+	chunk = THMAP_GETPTR(thmap, p);
+	ASSERT(THMAP_ALIGNED_P(chunk));
+
+	memset(chunk, 0, sizeof(thmap_vchunk_t));
+	atomic_store_relaxed(&chunk->vals[0], val);
+	atomic_store_relaxed(&chunk->nused, 1);
+	return chunk;
+}
+
+static void
+vchunk_free(const thmap_t *thmap, thmap_vchunk_t *chunk)
+{
+	mem_free(thmap, THMAP_GETOFF(thmap, chunk), sizeof(thmap_vchunk_t));
+}
+
+/*
+ * vchunk_reuse: store the value into one of the removed slots of the
+ * chunk.  The slot is claimed by decrementing the count of the removed
+ * slots first, therefore there is one for each claim.
+ *
+ * => Returns 0 on success and -1 if there are no removed slots.
+ * => Returns 1 if the chunk was sealed i.e. the key is being deleted.
+ */
+static int
+vchunk_reuse(thmap_vchunk_t *chunk, void *val)
+{
+	unsigned n = atomic_load_relaxed(&chunk->nfree);
+
+	do {
+		if (n == 0) {
+			return -1;
+		}
+		/* Acquire from prior release in vlist_remove(). */
+	} while (!atomic_compare_exchange_weak_explicit(&chunk->nfree,
+	    &n, n - 1, memory_order_acquire, memory_order_relaxed));
+
+	for (unsigned i = 0;; i = (i + 1) % THMAP_VCHUNK_VALS) {
+		void *expected = THMAP_VAL_REMOVED;
+
+		if (atomic_load_relaxed(&chunk->vals[i]) != expected) {
+			continue;
+		}
+		/* Release to subsequent acquire in vlist_get(). */
+		if (atomic_compare_exchange_weak_explicit(&chunk->vals[i],
+		    &expected, val, memory_order_release,
+		    memory_order_relaxed)) {
+			break;
+		}
+	}
+
+	/*
+	 * The update of the use count orders the store before the seal
+	 * in vlist_stage_gc(), or else the value went with the key.
+	 */
+	if (atomic_fetch_add_explicit(&chunk->nused, 0,
+	    memory_order_acq_rel) & THMAP_VCHUNK_NSEALED) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * vlist_append: append the value to the value chunk list of the leaf,
+ * re-using a removed slot if there is one.
+ *
+ * => Returns 0 on success and -1 on memory allocation failure.
+ * => Returns 1 if the list was sealed i.e. the key is being deleted.
+ */
+static int
+vlist_append(const thmap_t *thmap, thmap_leaf_t *leaf, void *val)
+{
+	thmap_vchunk_t *chunk, *nchunk = NULL;
+	thmap_ptr_t next;
+	int ret = 0;
+	unsigned i;
+
+	chunk = THMAP_GETPTR(thmap, leaf->vlist);
+	for (;;) {
+		if ((ret = vchunk_reuse(chunk, val)) != -1) {
+			break;
+		}
+		ret = 0;
+
+		/*
+		 * Reserve a slot in the current chunk.  The counter may
+		 * overshoot; the reservations beyond the chunk size fail.
+		 * The sealed counter fails them all: the key was deleted.
+		 */
+		i = atomic_load_relaxed(&chunk->nused);
+		if (i < THMAP_VCHUNK_VALS) {
+			i = atomic_fetch_add_explicit(&chunk->nused, 1,
+			    memory_order_relaxed);
+			if (i < THMAP_VCHUNK_VALS) {
+				/* Release to subsequent acquire in vlist_get(). */
+				atomic_store_release(&chunk->vals[i], val);
+				break;
+			}
+		}
+
+		/*
+		 * The chunk is full: move to the next one or append
+		 * a new chunk (with the value in it) to the list.
+		 */
+		next = atomic_load_acquire(&chunk->next);
+		if (next == THMAP_VCHUNK_SEALED || (i & THMAP_VCHUNK_NSEALED)) {
+			ret = 1;
+			break;
+		}
+		if (next) {
+			chunk = THMAP_GETPTR(thmap, next);
+			continue;
+		}
+		if (!nchunk && (nchunk = vchunk_create(thmap, val)) == NULL) {
+			return -1;
+		}
+		/* Release to subsequent acquire in vlist_get(). */
+		if (atomic_compare_exchange_weak_explicit(&chunk->next, &next,
+		    THMAP_GETOFF(thmap, nchunk), memory_order_release,
+		    memory_order_relaxed)) {
+			return 0;
+		}
+	}
+	if (nchunk) {
+		vchunk_free(thmap, nchunk);
+	}
+	return ret;
+}
+
+/*
+ * vlist_get: copy up to nvals values and return the total count.
+ */
+static size_t
+vlist_get(const thmap_t *thmap, const thmap_leaf_t *leaf,
+    void **vals, size_t nvals)
+{
+	thmap_ptr_t next = leaf->vlist;
+	size_t n = 0;
+
+	do {
+		const thmap_vchunk_t *chunk = THMAP_GETPTR(thmap, next);
+		const unsigned nused = MIN(atomic_load_relaxed(&chunk->nused) &
+		    ~THMAP_VCHUNK_NSEALED, THMAP_VCHUNK_VALS);
+
+		for (unsigned i = 0; i < nused; i++) {
+			/* Acquire from prior release in vlist_append(). */
+			void *val = atomic_load_acquire(&chunk->vals[i]);
+
+			if (val == NULL || val == THMAP_VAL_REMOVED) {
+				/* Not yet filled or removed. */
+				continue;
+			}
+			if (n < nvals) {
+				vals[n] = val;
+			}
+			n++;
+		}
+		/* Acquire from prior release in vlist_append(). */
+		next = atomic_load_acquire(&chunk->next);
+	} while (next != THMAP_NULL && next != THMAP_VCHUNK_SEALED);
+
+	return n;
+}
+
+/*
+ * vlist_remove: remove the first occurrence of the value.
+ *
+ * => The removal is ordered after the append of the value, see the
+ *    feed_seq() in thmap_del_value().
+ */
+static int
+vlist_remove(const thmap_t *thmap, thmap_leaf_t *leaf, void *val)
+{
+	thmap_ptr_t next = leaf->vlist;
+
+	do {
+		thmap_vchunk_t *chunk = THMAP_GETPTR(thmap, next);
+		const unsigned nused = MIN(atomic_load_relaxed(&chunk->nused) &
+		    ~THMAP_VCHUNK_NSEALED, THMAP_VCHUNK_VALS);
+
+		for (unsigned i = 0; i < nused; i++) {
+			void *expected = val;
+
+			if (atomic_load_relaxed(&chunk->vals[i]) != val) {
+				continue;
+			}
+			/* Acquire from prior release in vlist_append(). */
+			if (atomic_compare_exchange_weak_explicit(
+			    &chunk->vals[i], &expected, THMAP_VAL_REMOVED,
+			    memory_order_acquire, memory_order_relaxed)) {
+				/*
+				 * Count the slot for the re-use.  Release
+				 * to subsequent acquire in vchunk_reuse().
+				 */
+				atomic_fetch_add_explicit(&chunk->nfree, 1,
+				    memory_order_release);
+				return 0;
+			}
+			/* Raced with another removal: keep looking. */
+		}
+		next = atomic_load_acquire(&chunk->next);
+	} while (next != THMAP_NULL && next != THMAP_VCHUNK_SEALED);
+
+	return -1;
+}
+
+/*
+ * vlist_stage_gc: seal the value chunk list of the deleted leaf, so
+ * no more chunks could be appended nor slots reserved, and add the
+ * chunks to the G/C chain.
+ *
+ * => The values of the reservations made before the seal are deleted
+ *    along with the key, i.e. such a put is ordered before the delete.
+ */
+static void
+vlist_stage_gc(thmap_t *thmap, thmap_leaf_t *leaf, thmap_gc_chain_t *chain)
+{
+	thmap_ptr_t cur = leaf->vlist, next;
+
+	while (cur != THMAP_NULL) {
+		thmap_vchunk_t *chunk = THMAP_GETPTR(thmap, cur);
+
+		/* Acquire from prior release in vchunk_reuse(). */
+		atomic_fetch_or_explicit(&chunk->nused, THMAP_VCHUNK_NSEALED,
+		    memory_order_acquire);
+		next = atomic_load_acquire(&chunk->next);
+		if (next == THMAP_NULL &&
+		    !atomic_compare_exchange_weak_explicit(&chunk->next,
+		    &next, THMAP_VCHUNK_SEALED, memory_order_acquire,
+		    memory_order_relaxed)) {
+			/* A new chunk might have been appended: re-check. */
+			continue;
+		}
+		gc_chain_add(chain, cur, sizeof(thmap_vchunk_t), NULL);
+		cur = next;
+	}
+}
+
+/*
+ * thmap_put_multi: add a value to the set of values of the key.
+ *
+ * => The NULL value is reserved and cannot be inserted.
+ * => Returns 0 on success and -1 on failure.
+ */
+int
+thmap_put_multi(thmap_t *thmap, const void *key, size_t len, void *val)
+{
+	thmap_vchunk_t *chunk;
+	thmap_leaf_t *leaf, *other;
+	thmap_query_t query;
+	uint64_t seq;
+	int ret;
+
+	if ((thmap->flags & THMAP_MULTI) == 0 ||
+	    val == NULL || val == THMAP_VAL_REMOVED) {
+		return -1;
+	}
+retry:
+	/*
+	 * Lock-free lookup; if the key is present, just append.
+	 */
+	hashval_init(thmap, &query, key, len);
+	if ((leaf = find_leaf(thmap, &query, key, len)) != NULL) {
+		goto append;
+	}
+
+	/*
+	 * Not found: insert a new leaf with the first value chunk.
+	 */
+	if ((chunk = vchunk_create(thmap, val)) == NULL) {
+		return -1;
+	}
+	leaf = leaf_create(thmap, key, len, NULL);
+	if (__predict_false(!leaf)) {
+		vchunk_free(thmap, chunk);
+		return -1;
+	}
+	leaf->vlist = THMAP_GETOFF(thmap, chunk);
+
+	query.level = 0;
+	other = put_leaf(thmap, &query, key, len, leaf);
+	if (__predict_true(other == leaf)) {
+		feed_emit(thmap, THMAP_OP_PUT, query.seq, key, len, val);
+		return 0;
+	}
+	vchunk_free(thmap, chunk);
+	leaf_free(thmap, leaf);
+	if (__predict_false(!other)) {
+		return -1;
+	}
+	leaf = other;
+append:
+	/*
+	 * The sequence number is reserved before the append.  If the key
+	 * removal took its number first, then the leaf is already marked
+	 * deleted: take the value back and re-try, so that the append is
+	 * not recorded after the removal.
+	 */
+	seq = feed_seq(thmap);
+	if ((ret = vlist_append(thmap, leaf, val)) > 0) {
+		/* Raced with thmap_del(): re-try from the top. */
+		goto retry;
+	}
+	if (ret == 0 && seq &&
+	    (atomic_load_relaxed(&leaf->state) & LEAF_DELETED) != 0) {
+		vlist_remove(thmap, leaf, val);
+		goto retry;
+	}
+	if (ret == 0) {
+		feed_emit(thmap, THMAP_OP_PUT, seq, key, len, val);
+	}
+	return ret;
+}
+
+/*
+ * thmap_get_multi: lookup the values given the key.
+ *
+ * => Copies up to nvals values and returns the total number of values.
+ */
+size_t
+thmap_get_multi(thmap_t *thmap, const void *key, size_t len,
+    void **vals, size_t nvals)
+{
+	thmap_query_t query;
+	thmap_leaf_t *leaf;
+
+	thmap_reader_t *r = NULL;
+	size_t n;
+
+	if ((thmap->flags & THMAP_MULTI) == 0) {
+		return 0;
+	}
+	if (thmap->flags & THMAP_GRACE) {
+		r = grace_enter();
+	}
+	hashval_init(thmap, &query, key, len);
+	leaf = find_leaf(thmap, &query, key, len);
+	n = leaf ? vlist_get(thmap, leaf, vals, nvals) : 0;
+	if (r) {
+		grace_exit(r);
+	}
+	return n;
+}
+
+/*
+ * thmap_del_value: remove the value from the set of values of the key.
+ *
+ * => The key stays present (even if without values) until thmap_del().
+ * => Returns 0 if removed and -1 if the value was not found.
+ */
+int
+thmap_del_value(thmap_t *thmap, const void *key, size_t len, void *val)
+{
+	thmap_query_t query;
+	thmap_leaf_t *leaf;
+
+	if ((thmap->flags & THMAP_MULTI) == 0 ||
+	    val == NULL || val == THMAP_VAL_REMOVED) {
+		return -1;
+	}
+	hashval_init(thmap, &query, key, len);
+	leaf = find_leaf(thmap, &query, key, len);
+	if (!leaf || vlist_remove(thmap, leaf, val) == -1) {
+		return -1;
+	}
+	/* After the removal, hence after the append of the value. */
+	feed_emit(thmap, THMAP_OP_DEL, feed_seq(thmap), key, len, val);
+	return 0;
+}
+
+/*
+ * node_collapse: collapse the levels, starting from the locked edge node
+ * of the query, if the last item was removed from it; unlock the node.
+ *
+ * => The key is used to find the slots while ascending.
+ * => The removed nodes are staged for G/C.
+ */
+static void
+node_collapse(thmap_t *thmap, thmap_query_t *query,
+    const void *key, size_t len, thmap_inode_t *parent)
+{
+	unsigned slot;
+
+	if (thmap->flags & THMAP_LAZYDEL) {
+		/* Leave the empty nodes for thmap_compact(). */
+		unlock_node(parent);
+		return;
+	}
+
+	/*
+	 * Collapse the levels if removing the last item.
+	 */
+	while (query->level &&
+	    NODE_COUNT(atomic_load_relaxed(&parent->state)) == 0) {
+		thmap_inode_t *node = parent;
+
+		ASSERT(atomic_load_relaxed(&node->state) == NODE_LOCKED);
+
+		/*
+		 * Ascend one level up.
+		 * => Mark our current parent as deleted.
+		 * => Lock the parent one level up.
+		 */
+		query->level--;
+		slot = hashval_getslot(thmap, query, key, len);
+		parent = THMAP_NODE(thmap, node->parent);
+		ASSERT(parent != NULL);
+
+		lock_node(parent);
+		ASSERT((atomic_load_relaxed(&parent->state) & NODE_DELETED)
+		    == 0);
+
+		/*
+		 * Lock is exclusive, so nobody else can be writing at
+		 * the same time, and no need for atomic R/M/W, but
+		 * readers may read without the lock and so need atomic
+		 * load/store.  No ordering here needed because the
+		 * entry itself stays valid until GC.
+		 */
+		atomic_store_relaxed(&node->state,
+		    atomic_load_relaxed(&node->state) | NODE_DELETED);
+		unlock_node(node); // memory_order_release
+
+		ASSERT(THMAP_NODE(thmap,
+		    atomic_load_relaxed(&parent->slots[slot])) == node);
+		node_remove(parent, slot);
+
+		/* Stage the removed node for G/C. */
+		stage_mem_gc(thmap, THMAP_GETOFF(thmap, node),
+		    THMAP_INODE_LEN(thmap));
+	}
+
+	/*
+	 * If the top node is empty, then we need to remove it from the
+	 * root level.  Mark the node as deleted and clear the slot.
+	 *
+	 * Note: acquiring the lock on the top node effectively prevents
+	 * the root slot from changing.
+	 */
+	if (NODE_COUNT(atomic_load_relaxed(&parent->state)) == 0) {
+		atomic_thmap_ptr_t *root = query->gen->root;
+		const unsigned rslot = query->rslot;
+		const thmap_ptr_t nptr =
+		    THMAP_ALIGN(atomic_load_relaxed(&root[rslot]));
+
+		ASSERT(query->level == 0);
+		ASSERT(parent->parent == THMAP_NULL);
+		ASSERT(THMAP_GETOFF(thmap, parent) == nptr);
+
+		/*
+		 * Mark as deleted and remove from the root-level slot.
+		 * Note: this also drops the ROOT_MOVING tag, if any; the
+		 * reseeding will see the node deleted and re-check.
+		 */
+		atomic_store_relaxed(&parent->state,
+		    atomic_load_relaxed(&parent->state) | NODE_DELETED);
+		atomic_store_relaxed(&root[rslot], THMAP_NULL);
+
+		stage_mem_gc(thmap, nptr, THMAP_INODE_LEN(thmap));
+	}
+	unlock_node(parent);
+}
+
+/*
+ * del_leaf: remove the leaf given the key and collapse the levels
+ * (unless THMAP_LAZYDEL is set).
+ *
+ * => If expected is not NULL, the leaf is removed only if its value is
+ *    the expected one; the value is compared under the edge node lock.
+ * => Returns the removed leaf, which is not yet staged for G/C, and
+ *    sets the feed sequence number in the query.
+ * => Returns NULL if not found (or if the value did not match).
+ */
+static thmap_leaf_t *
+del_leaf(thmap_t *thmap, thmap_query_t *query, const void *key,
+    size_t len, void *const *expected, const thmap_leaf_t *match)
+{
+	thmap_leaf_t *leaf;
+	thmap_inode_t *parent;
+	unsigned slot;
+
+	parent = find_edge_node_locked(thmap, query, key, len, &slot);
+	if (!parent) {
+		/* Root slot empty: not found. */
+		return NULL;
+	}
+	leaf = get_leaf(thmap, parent, slot);
+	if (!leaf || !key_cmp_p(thmap, leaf, key, len)) {
+		/* Not found. */
+		unlock_node(parent);
+		return NULL;
+	}
+	if ((expected && leaf->val != *expected) ||
+	    (match && leaf != match)) {
+		/* The key maps to another value or entry. */
+		unlock_node(parent);
+		return NULL;
+	}
+
+	/*
+	 * Remove the leaf.  Mark it deleted, while holding the lock, so
+	 * it would not be returned by the lookup caches nor incremented
+	 * (see leaf_incr()).
+	 */
+	ASSERT(THMAP_NODE(thmap, atomic_load_relaxed(&parent->slots[slot]))
+	    == leaf);
+	node_remove(parent, slot);
+	leaf_mark_deleted(leaf);
+	digest_update(thmap, query, parent, key, len, leaf->val, false);
+	query->seq = feed_seq(thmap);
+
+	node_collapse(thmap, query, key, len, parent);
+	return leaf;
+}
+
+/*
+ * val_destroy: the G/C destructor of the removed value.
+ */
+static void
+val_destroy(thmap_t *thmap, uintptr_t addr, size_t len)
+{
+	(void)len;
+	thmap->dtor_func((void *)addr, thmap->dtor_arg);
+}
+
+/*
+ * leaf_retire: emit the deletion of the removed leaf into the feed and
+ * add its memory to the G/C chain, along with the value, if it is to be
+ * destroyed (see thmap_setdtor()).
+ *
+ * => Returns the value of the leaf or THMAP_MULTI_DELETED for THMAP_MULTI,
+ *    as the values are in the value chunks.
+ */
+static void *
+leaf_retire(thmap_t *thmap, const thmap_query_t *query, const void *key,
+    size_t len, thmap_leaf_t *leaf, bool dtor, thmap_gc_chain_t *chain)
+{
+	void *val = leaf->val;
+
+	if (thmap->flags & THMAP_MULTI) {
+		/* The values are not enumerated in the feed record. */
+		feed_emit(thmap, THMAP_OP_DEL, query->seq, key, len, NULL);
+		vlist_stage_gc(thmap, leaf, chain);
+		val = THMAP_MULTI_DELETED;
+	} else {
+		feed_emit(thmap, THMAP_OP_DEL, query->seq, key, len, val);
+	}
+	/* The key copy is protected by the hazard pointer to the leaf. */
+	gc_chain_reserve(chain, 2);
+	if ((thmap->flags & THMAP_NOCOPY) == 0) {
+		gc_chain_add(chain, leaf->key, leaf_keylen(thmap, leaf), NULL);
+	}
+	if ((thmap->flags & THMAP_INTRUSIVE) == 0) {
+		gc_chain_add(chain, THMAP_GETOFF(thmap, leaf),
+		    sizeof(thmap_leaf_t), NULL);
+	}
+	if (dtor && thmap->dtor_func && val) {
+		gc_chain_add(chain, (uintptr_t)val, 0, val_destroy);
+	}
+	return val;
+}
+
+/*
+ * thmap_del: remove the entry given the key.
+ *
+ * => Returns the value or NULL if the key was not found; on THMAP_MULTI,
+ *    THMAP_MULTI_DELETED if the key (with all its values) was removed.
+ */
+void *
+thmap_del(thmap_t *thmap, const void *key, size_t len)
+{
+	thmap_gc_chain_t chain = { NULL, NULL };
+	thmap_query_t query;
+	thmap_leaf_t *leaf;
+	void *val;
+
+	hashval_init(thmap, &query, key, len);
+	if ((leaf = del_leaf(thmap, &query, key, len, NULL, NULL)) == NULL) {
+		return NULL;
+	}
+	val = leaf_retire(thmap, &query, key, len, leaf, true, &chain);
+	stage_gc_chain(thmap, &chain);
+	return val;
+}
+
+/*
+ * thmap_del_if: remove the entry given the key, only if it is associated
+ * with the expected value.
+ *
+ * => Not applicable to THMAP_MULTI (see thmap_del_value()).
+ * => Returns 0 if removed and -1 if the key was not found or it is
+ *    associated with another value.
+ */
+int
+thmap_del_if(thmap_t *thmap, const void *key, size_t len, void *expected)
+{
+	thmap_gc_chain_t chain = { NULL, NULL };
+	thmap_query_t query;
+	thmap_leaf_t *leaf;
+
+	if (thmap->flags & THMAP_MULTI) {
+		return -1;
+	}
+	hashval_init(thmap, &query, key, len);
+	if ((leaf = del_leaf(thmap, &query, key, len, &expected,
+	    NULL)) == NULL) {
+		return -1;
+	}
+	leaf_retire(thmap, &query, key, len, leaf, true, &chain);
+	stage_gc_chain(thmap, &chain);
+	return 0;
+}
+
+/*
+ * thmap_put_entry: insert the entry embedded in the object of the caller,
+ * with the given key and value (THMAP_INTRUSIVE).  The entry is linked as
+ * the leaf, therefore nothing is allocated, except the intermediate nodes.
+ *
+ * => The entry and the key must stay valid until thmap_del_entry() or
+ *    the other removal of the key, followed by the G/C barrier.
+ * => Returns the value if inserted; otherwise, the present value or NULL
+ *    on failure, in which case the entry is not linked.
+ */
+void *
+thmap_put_entry(thmap_t *thmap, thmap_entry_t *entry,
+    const void *key, size_t len, void *val)
+{
+	thmap_leaf_t *leaf = (thmap_leaf_t *)entry, *other;
+	thmap_query_t query;
+
+	if ((thmap->flags & THMAP_INTRUSIVE) == 0 ||
+	    __predict_false(len > THMAP_KEY_MAXLEN)) {
+		return NULL;
+	}
+	ASSERT(THMAP_ALIGNED_P(leaf));
+	leaf->key = (uintptr_t)key;
+	leaf->len = (uint32_t)len;
+	leaf->val = val;
+	atomic_store_relaxed(&leaf->state, 0);
+
+	hashval_init(thmap, &query, key, len);
+	other = put_leaf(thmap, &query, key, len, leaf);
+	if (__predict_true(other == leaf)) {
+		feed_emit(thmap, THMAP_OP_PUT, query.seq, key, len, val);
+		return val;
+	}
+	return other ? other->val : NULL;
+}
+
+/*
+ * thmap_del_entry: remove the entry inserted by thmap_put_entry(), if it
+ * is still the one associated with its key.
+ *
+ * => The entry must have been passed to thmap_put_entry().
+ * => Returns 0 if removed and -1 if the entry is not in the map.
+ */
+int
+thmap_del_entry(thmap_t *thmap, thmap_entry_t *entry)
+{
+	thmap_gc_chain_t chain = { NULL, NULL };
+	thmap_leaf_t *leaf = (thmap_leaf_t *)entry;
+	thmap_query_t query;
+	const void *key;
+	size_t len;
+
+	if ((thmap->flags & THMAP_INTRUSIVE) == 0) {
+		return -1;
+	}
+	key = THMAP_GETPTR(thmap, leaf->key);
+	len = leaf->len;
+	hashval_init(thmap, &query, key, len);
+	if (del_leaf(thmap, &query, key, len, NULL, leaf) == NULL) {
+		return -1;
+	}
+	leaf_retire(thmap, &query, key, len, leaf, true, &chain);
+	stage_gc_chain(thmap, &chain);
+	return 0;
+}
+
+/*
+ * Batch of keys to delete.  The keys are visited in the order of their
+ * position in the trie: the root slot, followed by the slots of the
+ * levels (nibbles of the first hash block, the lowest first).
+ */
+typedef struct {
+	thmap_query_t	query;
+	thmap_leaf_t *	leaf;		// the removed leaf, if any
+} thmap_bkey_t;
+
+typedef struct {
+	uint64_t	order;
+	size_t		idx;
+} thmap_bord_t;
+
+#define	BATCH_RADIX_BITS	8
+#define	BATCH_ORDER_BITS	(ROOT_BITS + HASHVAL_BITS)
+#define	BATCH_DIGIT(o, s)	\
+    ((unsigned)((o) >> (s)) & ((1U << BATCH_RADIX_BITS) - 1))
+
+static uint64_t
+batch_order(const thmap_query_t *query)
+{
+	uint32_t h = query->hashval, rev = 0;
+
+	for (unsigned i = 0; i < HASHVAL_BITS / LEVEL_BITS; i++) {
+		rev = (rev << LEVEL_BITS) | (h & LEVEL_MASK);
+		h >>= LEVEL_BITS;
+	}
+	return ((uint64_t)query->rslot << HASHVAL_BITS) | rev;
+}
+
+/*
+ * batch_sort: LSD radix sort of the batch order; returns either of the
+ * given arrays, whichever holds the result.
+ */
+static thmap_bord_t *
+batch_sort(thmap_bord_t *ord, thmap_bord_t *tmp, size_t n)
+{
+	const unsigned nbuckets = 1U << BATCH_RADIX_BITS;
+
+	for (unsigned shift = 0; shift < BATCH_ORDER_BITS;
+	    shift += BATCH_RADIX_BITS) {
+		size_t count[1U << BATCH_RADIX_BITS], sum = 0;
+		thmap_bord_t *t;
+
+		memset(count, 0, sizeof(count));
+		for (size_t i = 0; i < n; i++) {
+			count[BATCH_DIGIT(ord[i].order, shift)]++;
+		}
+		for (unsigned b = 0; b < nbuckets; b++) {
+			const size_t c = count[b];
+			count[b] = sum;
+			sum += c;
+		}
+		for (size_t i = 0; i < n; i++) {
+			tmp[count[BATCH_DIGIT(ord[i].order, shift)]++] = ord[i];
+		}
+		t = ord, ord = tmp, tmp = t;
+	}
+	return ord;
+}
+
+/*
+ * batch_same_node: check whether the key of the batch entry is also at
+ * the locked edge node of the given (leader) query, at a leaf or empty
+ * slot, and return the slot.
+ */
+static bool
+batch_same_node(const thmap_t *thmap, thmap_query_t *lquery,
+    const void *lkey, size_t llen, thmap_query_t *query,
+    const void *key, size_t len, thmap_inode_t *parent, unsigned *slot)
+{
+	const unsigned level = lquery->level;
+	thmap_ptr_t target;
+	bool same = true;
+
+	if (query->gen != lquery->gen || query->rslot != lquery->rslot) {
+		return false;
+	}
+	for (unsigned l = 0; l < level && same; l++) {
+		lquery->level = query->level = l;
+		same = hashval_getslot(thmap, lquery, lkey, llen) ==
+		    hashval_getslot(thmap, query, key, len);
+	}
+	lquery->level = query->level = level;
+	if (same) {
+		*slot = hashval_getslot(thmap, query, key, len);
+		target = atomic_load_relaxed(&parent->slots[*slot]);
+		same = !target || !THMAP_INODE_P(target);
+	}
+
+	/* Otherwise, the entry will be looked up from the root. */
+	query->level = 0;
+	return same;
+}
+
+/*
+ * del_batch_group: remove the key of the i-th entry, in the batch order,
+ * and the keys of the following entries which are at the same edge node,
+ * under a single lock acquisition; collapse the levels once.
+ *
+ * => Returns the index of the next entry to process.
+ */
+static size_t
+del_batch_group(thmap_t *thmap, thmap_bkey_t *bkeys, const thmap_bord_t *ord,
+    size_t i, size_t n, const void *const *keys, const size_t *lens)
+{
+	const size_t lidx = ord[i].idx;
+	thmap_query_t *lquery = &bkeys[lidx].query;
+	thmap_inode_t *parent;
+	unsigned slot;
+	size_t j = i;
+
+	parent = find_edge_node_locked(thmap, lquery,
+	    keys[lidx], lens[lidx], &slot);
+	if (!parent) {
+		/* Root slot empty: not found. */
+		bkeys[lidx].leaf = NULL;
+		return i + 1;
+	}
+	for (;;) {
+		thmap_bkey_t *bkey = &bkeys[ord[j].idx];
+		thmap_leaf_t *leaf = get_leaf(thmap, parent, slot);
+
+		if (leaf && key_cmp_p(thmap, leaf,
+		    keys[ord[j].idx], lens[ord[j].idx])) {
+			node_remove(parent, slot);
+			leaf_mark_deleted(leaf);
+			digest_update(thmap, &bkey->query, parent,
+			    keys[ord[j].idx], lens[ord[j].idx], leaf->val,
+			    false);
+			bkey->query.seq = feed_seq(thmap);
+		} else {
+			leaf = NULL;
+		}
+		bkey->leaf = leaf;
+
+		if (++j == n || !batch_same_node(thmap, lquery,
+		    keys[lidx], lens[lidx], &bkeys[ord[j].idx].query,
+		    keys[ord[j].idx], lens[ord[j].idx], parent, &slot)) {
+			break;
+		}
+	}
+	node_collapse(thmap, lquery, keys[lidx], lens[lidx], parent);
+	return j;
+}
+
+/*
+ * thmap_del_batch: remove the given keys.
+ *
+ * => The keys are grouped by the edge node, so that the keys of the same
+ *    node are removed under a single lock acquisition.
+ * => If vals is not NULL, the values (or NULL, if the key was not found)
+ *    are returned in it, in the order of the keys.
+ * => The memory is staged for G/C as a single chain.
+ * => Returns the number of the keys removed.
+ */
+size_t
+thmap_del_batch(thmap_t *thmap, const void *const *keys, const size_t *lens,
+    void **vals, size_t n)
+{
+	thmap_gc_chain_t chain = { NULL, NULL };
+	thmap_bord_t *ord, *tmp;
+	thmap_bkey_t *bkeys;
+	size_t ndeleted = 0;
+
+	bkeys = malloc(n * (sizeof(thmap_bkey_t) + 2 * sizeof(thmap_bord_t)));
+	if (bkeys == NULL) {
+		/* Fallback: one by one. */
+		for (size_t i = 0; i < n; i++) {
+			void *val = thmap_del(thmap, keys[i], lens[i]);
+			ndeleted += val != NULL;
+			if (vals) {
+				vals[i] = val;
+			}
+		}
+		return ndeleted;
+	}
+	ord = (thmap_bord_t *)(void *)&bkeys[n];
+	tmp = &ord[n];
+
+	for (size_t i = 0; i < n; i++) {
+		hashval_init(thmap, &bkeys[i].query, keys[i], lens[i]);
+		ord[i].order = batch_order(&bkeys[i].query);
+		ord[i].idx = i;
+	}
+	ord = batch_sort(ord, tmp, n);
+
+	for (size_t i = 0; i < n;) {
+		i = del_batch_group(thmap, bkeys, ord, i, n, keys, lens);
+	}
+
+	/*
+	 * Retire the removed leaves in the order of the keys, which is
+	 * normally the order of their allocation.
+	 */
+	for (size_t i = 0; i < n; i++) {
+		thmap_leaf_t *leaf = bkeys[i].leaf;
+		void *val = NULL;
+
+		if (leaf) {
+			val = leaf_retire(thmap, &bkeys[i].query,
+			    keys[i], lens[i], leaf, true, &chain);
+			ndeleted++;
+		}
+		if (vals) {
+			vals[i] = val;
+		}
+	}
+	stage_gc_chain(thmap, &chain);
+	free(bkeys);
+	return ndeleted;
+}
+
+/*
+ * TRANSACTIONS.
+ *
+ * The transaction changes up to THMAP_TXN_MAX keys atomically.  On
+ * commit, the edge nodes of the keys are locked in a global order: the
+ * older generation first, then the deeper level first (the writers lock
+ * bottom-up) and then by the address.  Once the keys are validated, the
+ * pending records are installed (expanding the levels as necessary) and
+ * a single store of the status word publishes all changes.  Finally, the
+ * pending records are replaced by the new leaves and the nodes unlocked.
+ * The lookups remain lock-free, see pending_leaf().
+ */
+
+#define	TXOP_PUT		1
+#define	TXOP_REPLACE		2
+#define	TXOP_DEL		3
+
+#define	THMAP_TXN_NLOCKS	(4 * THMAP_TXN_MAX)	// edge + expanded
+
+typedef struct {
+	unsigned		op;
+	const void *		key;
+	size_t			len;
+	void *			val;
+	int			from;		// take the value of ops[from]
+	thmap_query_t		query;
+	thmap_inode_t *		node;		// the edge node
+	unsigned		level;		// level of the edge node
+	thmap_leaf_t *		leaf;		// the new leaf, if any
+	thmap_leaf_t *		prev;		// the current leaf, if any
+	uint64_t		seq;		// sequence number of the put
+	bool			collapse;	// the node was left empty
+} thmap_txop_t;
+
+struct thmap_txn {
+	thmap_t *		thmap;
+	unsigned		nops;
+	unsigned		nlocked;
+	thmap_txop_t		ops[THMAP_TXN_MAX];
+	thmap_inode_t *		locked[THMAP_TXN_NLOCKS];
+};
+
+/*
+ * thmap_txn_begin: start a transaction on the map.
+ *
+ * => Not applicable to THMAP_MULTI.
+ */
+thmap_txn_t *
+thmap_txn_begin(thmap_t *thmap)
+{
+	thmap_txn_t *txn;
+
+	if (thmap->flags & (THMAP_MULTI | THMAP_INTRUSIVE)) {
+		return NULL;
+	}
+	txn = calloc(1, sizeof(thmap_txn_t));
+	if (txn == NULL) {
+		return NULL;
+	}
+	txn->thmap = thmap;
+	return txn;
+}
+
+static int
+txn_add(thmap_txn_t *txn, unsigned op, const void *key, size_t len,
+    void *val)
+{
+	thmap_txop_t *txop;
+
+	if (txn->nops == THMAP_TXN_MAX || len > THMAP_KEY_MAXLEN) {
+		return -1;
+	}
+	for (unsigned i = 0; i < txn->nops; i++) {
+		txop = &txn->ops[i];
+		if (txop->len == len && memcmp(txop->key, key, len) == 0) {
+			/* Each key may be changed once. */
+			return -1;
+		}
+	}
+	txop = &txn->ops[txn->nops++];
+	txop->op = op;
+	txop->key = key;
+	txop->len = len;
+	txop->val = val;
+	txop->from = -1;
+	return 0;
+}
+
+/*
+ * thmap_txn_put: insert the key, which must not be present.
+ */
+int
+thmap_txn_put(thmap_txn_t *txn, const void *key, size_t len, void *val)
+{
+	return txn_add(txn, TXOP_PUT, key, len, val);
+}
+
+/*
+ * thmap_txn_replace: replace the value of the key, which must be present.
+ */
+int
+thmap_txn_replace(thmap_txn_t *txn, const void *key, size_t len, void *val)
+{
+	return txn_add(txn, TXOP_REPLACE, key, len, val);
+}
+
+/*
+ * thmap_txn_del: remove the key, which must be present.
+ */
+int
+thmap_txn_del(thmap_txn_t *txn, const void *key, size_t len)
+{
+	return txn_add(txn, TXOP_DEL, key, len, NULL);
+}
+
+void
+thmap_txn_abort(thmap_txn_t *txn)
+{
+	free(txn);
+}
+
+/*
+ * gen_before_p: check whether the generation a is older than b.
+ */
+static bool
+gen_before_p(const thmap_gen_t *a, const thmap_gen_t *b)
+{
+	/* Acquire from prior release in thmap_reseed_start(). */
+	while ((a = atomic_load_acquire(&a->next)) != NULL) {
+		if (a == b) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * txn_lock_before_p: the lock order of the edge nodes.
+ */
+static bool
+txn_lock_before_p(const thmap_txop_t *a, const thmap_txop_t *b)
+{
+	if (a->query.gen != b->query.gen) {
+		return gen_before_p(a->query.gen, b->query.gen);
+	}
+	if (a->level != b->level) {
+		return a->level > b->level;
+	}
+	return (uintptr_t)a->node < (uintptr_t)b->node;
+}
+
+/*
+ * txn_root_create: set an empty top node at the empty root slot.
+ */
+static int
+txn_root_create(thmap_t *thmap, const thmap_query_t *query)
+{
+	atomic_thmap_ptr_t *root = &query->gen->root[query->rslot];
+	thmap_ptr_t expected = THMAP_NULL;
+	thmap_inode_t *node;
+
+	if (atomic_load_relaxed(root) != THMAP_NULL) {
+		return 0;
+	}
+	if ((node = node_create(thmap, NULL)) == NULL) {
+		return -1;
+	}
+	/* Release to subsequent consume in find_edge_node(). */
+	if (!atomic_compare_exchange_strong_explicit(root, &expected,
+	    THMAP_GETOFF(thmap, node), memory_order_release,
+	    memory_order_relaxed)) {
+		mem_free(thmap, THMAP_GETOFF(thmap, node),
+		    THMAP_INODE_LEN(thmap));
+	}
+	return 0;
+}
+
+/*
+ * txn_find: find the edge node of the key (without locking it).
+ *
+ * => Returns -1 if the key to replace or delete is not present or on
+ *    memory allocation failure.
+ */
+static int
+txn_find(thmap_t *thmap, thmap_txop_t *op)
+{
+	unsigned slot;
+
+	for (;;) {
+		hashval_init(thmap, &op->query, op->key, op->len);
+		op->node = find_edge_node(thmap, &op->query,
+		    op->key, op->len, &slot);
+		if (op->node) {
+			op->level = op->query.level;
+			return 0;
+		}
+		if (atomic_load_relaxed(&op->query.gen->root[op->query.rslot])
+		    != THMAP_NULL) {
+			/* Raced with the collapse: re-try. */
+			continue;
+		}
+		if (op->op != TXOP_PUT ||
+		    txn_root_create(thmap, &op->query) == -1) {
+			return -1;
+		}
+	}
+}
+
+/*
+ * txn_check: check that the locked node is still the edge node of the
+ * key and set the current leaf, if the key is present.
+ */
+static bool
+txn_check(const thmap_t *thmap, thmap_txop_t *op)
+{
+	thmap_ptr_t target;
+	unsigned slot;
+
+	if (atomic_load_relaxed(&op->node->state) & NODE_DELETED) {
+		return false;
+	}
+	op->query.level = op->level;
+	slot = hashval_getslot(thmap, &op->query, op->key, op->len);
+	target = atomic_load_relaxed(&op->node->slots[slot]);
+	if (target && THMAP_INODE_P(target)) {
+		/* Expanded meanwhile. */
+		return false;
+	}
+	op->prev = NULL;
+	if (target) {
+		thmap_leaf_t *leaf = THMAP_NODE(thmap, target);
+
+		ASSERT(!THMAP_PENDING_P(target));
+		if (key_cmp_p(thmap, leaf, op->key, op->len)) {
+			op->prev = leaf;
+		}
+	}
+	return true;
+}
+
+static void
+txn_unlock(thmap_txn_t *txn)
+{
+	for (unsigned i = 0; i < txn->nlocked; i++) {
+		unlock_node(txn->locked[i]);
+	}
+	txn->nlocked = 0;
+}
+
+/*
+ * txn_lock: find and lock the edge nodes of the keys, in the lock order,
+ * and check the keys.
+ *
+ * => Returns 0 if all keys are as expected, i.e. the keys to insert are
+ *    not present and the others are.
+ * => Returns -1 otherwise (or on failure); the nodes may be left locked.
+ */
+static int
+txn_lock(thmap_txn_t *txn)
+{
+	thmap_t *thmap = txn->thmap;
+	thmap_txop_t *ord[THMAP_TXN_MAX];
+	unsigned i, j;
+retry:
+	/*
+	 * Find the edge nodes.  The keys to insert are looked up last,
+	 * since they may set the top nodes.
+	 */
+	for (i = 0; i < txn->nops; i++) {
+		if (txn->ops[i].op != TXOP_PUT &&
+		    txn_find(thmap, &txn->ops[i]) == -1) {
+			return -1;
+		}
+	}
+	for (i = 0; i < txn->nops; i++) {
+		if (txn->ops[i].op == TXOP_PUT &&
+		    txn_find(thmap, &txn->ops[i]) == -1) {
+			return -1;
+		}
+	}
+
+	/*
+	 * Sort (insertion sort, there are only a few) and lock.
+	 */
+	for (i = 0; i < txn->nops; i++) {
+		thmap_txop_t *op = &txn->ops[i];
+
+		for (j = i; j > 0 && txn_lock_before_p(op, ord[j - 1]); j--) {
+			ord[j] = ord[j - 1];
+		}
+		ord[j] = op;
+	}
+	for (i = 0; i < txn->nops; i++) {
+		thmap_inode_t *node = ord[i]->node;
+
+		if (txn->nlocked && txn->locked[txn->nlocked - 1] == node) {
+			continue;
+		}
+		lock_node(node);
+		txn->locked[txn->nlocked++] = node;
+	}
+
+	/*
+	 * Re-check the edge nodes, now locked.  If the tree has changed,
+	 * then re-start from the root.
+	 */
+	for (i = 0; i < txn->nops; i++) {
+		thmap_txop_t *op = &txn->ops[i];
+
+		if (!txn_check(thmap, op)) {
+			txn_unlock(txn);
+			goto retry;
+		}
+	}
+	for (i = 0; i < txn->nops; i++) {
+		thmap_txop_t *op = &txn->ops[i];
+
+		if ((op->op == TXOP_PUT) != (op->prev == NULL)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * txn_edge: return the edge node of the key, descending from the locked
+ * edge node through the levels expanded by the transaction.
+ */
+static thmap_inode_t *
+txn_edge(const thmap_t *thmap, thmap_txop_t *op, unsigned *slot)
+{
+	thmap_query_t *query = &op->query;
+	thmap_inode_t *parent = op->node;
+	thmap_ptr_t target;
+
+	query->level = op->level;
+	for (;;) {
+		*slot = hashval_getslot(thmap, query, op->key, op->len);
+		target = atomic_load_relaxed(&parent->slots[*slot]);
+		if (!target || !THMAP_INODE_P(target)) {
+			return parent;
+		}
+		parent = THMAP_NODE(thmap, target);
+		ASSERT(node_locked_p(parent));
+		query->level++;
+	}
+}
+
+/*
+ * txn_install: install the pending record of the key.
+ *
+ * => The caller must issue the release fence for node_insert().
+ * => Returns -1 on memory allocation failure.
+ */
+static int
+txn_install(thmap_txn_t *txn, thmap_txop_t *op, thmap_ptr_t pptr)
+{
+	thmap_t *thmap = txn->thmap;
+	thmap_query_t *query = &op->query;
+	thmap_inode_t *parent, *child;
+	unsigned slot, other_slot;
+	thmap_ptr_t target;
+
+	parent = txn_edge(thmap, op, &slot);
+	target = atomic_load_relaxed(&parent->slots[slot]);
+	if (op->prev) {
+		/*
+		 * Replace or delete: redirect the slot of the current leaf.
+		 * Mark the leaf as deleted for the lookup caches.
+		 */
+		ASSERT(THMAP_NODE(thmap, target) == op->prev);
+		leaf_mark_deleted(op->prev);
+		/* Release to subsequent consume in get_leaf(). */
+		atomic_store_release(&parent->slots[slot], pptr);
+		return 0;
+	}
+	while (target != THMAP_NULL) {
+		const thmap_pending_t *pend = THMAP_PENDING_P(target) ?
+		    THMAP_NODE(thmap, target) : NULL;
+		const thmap_leaf_t *other, *cur;
+
+		/*
+		 * Collision: expand the tree, as put_leaf() does, but keep
+		 * the nodes locked.  The other slot may hold the pending
+		 * record of this transaction: only its current leaf, if
+		 * any, is accounted in the digests.
+		 */
+		if (pend) {
+			other = THMAP_GETPTR(thmap,
+			    pend->leaf ? pend->leaf : pend->prev);
+			cur = pend->prev ?
+			    THMAP_GETPTR(thmap, pend->prev) : NULL;
+		} else {
+			other = cur = THMAP_NODE(thmap, target);
+		}
+		other_slot = hashval_getleafslot(thmap, query->gen, other,
+		    query->level + 1);
+		if (txn->nlocked == THMAP_TXN_NLOCKS) {
+			return -1;
+		}
+		if ((child = node_create(thmap, parent)) == NULL) {
+			return -1;
+		}
+		if ((thmap->flags & THMAP_DIGEST) != 0 && cur) {
+			atomic_store_relaxed(node_digest(child),
+			    leaf_digest(thmap, query->gen, cur));
+		}
+		query->level++;
+
+		if (__predict_false(query->level == THMAP_DEPTH_MAX)) {
+			atomic_store_relaxed(&thmap->reseed, true);
+		}
+		node_insert(child, other_slot, target);
+		/* Release to subsequent consume in find_edge_node(). */
+		atomic_store_release(&parent->slots[slot],
+		    THMAP_GETOFF(thmap, child));
+		txn->locked[txn->nlocked++] = child;
+		parent = child;
+
+		slot = hashval_getslot(thmap, query, op->key, op->len);
+		if (slot != other_slot) {
+			target = THMAP_NULL;
+		}
+	}
+	node_insert(parent, slot, pptr);
+	return 0;
+}
+
+/*
+ * txn_resolve: replace the pending record of the key with the new leaf,
+ * if committed, or with the current one; account the change.
+ *
+ * => The caller must issue the release fence for node_remove() and the
+ *    relaxed stores.
+ */
+static void
+txn_resolve(thmap_txn_t *txn, thmap_txop_t *op, bool commit)
+{
+	thmap_t *thmap = txn->thmap;
+	thmap_inode_t *parent;
+	unsigned slot;
+
+	parent = txn_edge(thmap, op, &slot);
+	ASSERT(THMAP_PENDING_P(atomic_load_relaxed(&parent->slots[slot])));
+
+	if (!commit) {
+		if (op->prev) {
+			atomic_fetch_and_explicit(&op->prev->state,
+			    ~LEAF_DELETED, memory_order_relaxed);
+			atomic_store_relaxed(&parent->slots[slot],
+			    THMAP_GETOFF(thmap, op->prev) | THMAP_LEAF_BIT);
+		} else {
+			node_remove(parent, slot);
+		}
+		return;
+	}
+	if (op->prev) {
+		digest_update(thmap, &op->query, parent,
+		    op->key, op->len, op->prev->val, false);
+		op->query.seq = feed_seq(thmap);
+	}
+	if (op->leaf) {
+		atomic_store_relaxed(&parent->slots[slot],
+		    THMAP_GETOFF(thmap, op->leaf) | THMAP_LEAF_BIT);
+		digest_update(thmap, &op->query, parent,
+		    op->key, op->len, op->val, true);
+		op->seq = feed_seq(thmap);
+	} else {
+		node_remove(parent, slot);
+	}
+}
+
+/*
+ * txn_val_kept: check whether the value of the replaced or deleted leaf
+ * is still present after the commit, e.g. taken over by a move, hence it
+ * must not be destroyed.
+ */
+static bool
+txn_val_kept(const thmap_txn_t *txn, const void *val)
+{
+	for (unsigned i = 0; i < txn->nops; i++) {
+		const thmap_txop_t *op = &txn->ops[i];
+
+		if (op->leaf && op->val == val) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * txn_commit: lock the keys, install the pending records and publish
+ * them, then resolve the records and unlock.
+ *
+ * => Returns 0 on success and -1 on failure.
+ */
+static int
+txn_commit(thmap_txn_t *txn)
+{
+	thmap_t *thmap = txn->thmap;
+	thmap_gc_chain_t chain = { NULL, NULL };
+	thmap_txrec_t *txrec;
+	unsigned i, ninstalled = 0;
+	uintptr_t txoff;
+	int error = -1;
+
+	/*
+	 * Pre-allocate the transaction record and the new leaves.
+	 */
+	txoff = mem_alloc(thmap, THMAP_TXREC_LEN(txn->nops));
+	if (!txoff) {
+		return -1;
+	}
+	txrec = THMAP_GETPTR(thmap, txoff);
+	atomic_store_relaxed(&txrec->status, TXN_PENDING);
+	for (i = 0; i < txn->nops; i++) {
+		thmap_txop_t *op = &txn->ops[i];
+
+		op->leaf = op->prev = NULL;
+		op->collapse = false;
+		if (op->op != TXOP_DEL && (op->leaf = leaf_create(thmap,
+		    op->key, op->len, op->val)) == NULL) {
+			goto out;
+		}
+	}
+
+	if (txn_lock(txn) == 0) {
+		/*
+		 * Install the pending records.  Release them, along with
+		 * the new leaves, via store in node_insert() to subsequent
+		 * consume in get_leaf().
+		 */
+		for (i = 0; i < txn->nops; i++) {
+			thmap_txop_t *op = &txn->ops[i];
+			thmap_pending_t *pend = &txrec->pending[i];
+
+			pend->leaf = op->leaf ?
+			    THMAP_GETOFF(thmap, op->leaf) : THMAP_NULL;
+			pend->prev = op->prev ?
+			    THMAP_GETOFF(thmap, op->prev) : THMAP_NULL;
+			pend->txrec = txoff;
+		}
+		atomic_thread_fence(memory_order_release);
+		for (i = 0; i < txn->nops; i++) {
+			const thmap_ptr_t pptr = THMAP_GETOFF(thmap,
+			    &txrec->pending[i]) | THMAP_PENDING_BIT |
+			    THMAP_LEAF_BIT;
+
+			if (txn_install(txn, &txn->ops[i], pptr) == -1) {
+				break;
+			}
+			ninstalled++;
+		}
+		error = ninstalled == txn->nops ? 0 : -1;
+
+		/*
+		 * Take the values over, see thmap_move(): the replaced leaves
+		 * are marked deleted, hence their values (counters) are final.
+		 * The new leaves are not visible until the commit point.
+		 */
+		for (i = 0; error == 0 && i < txn->nops; i++) {
+			thmap_txop_t *op = &txn->ops[i];
+
+			if (op->from != -1) {
+				ASSERT(txn->ops[op->from].prev != NULL);
+				op->val = txn->ops[op->from].prev->val;
+				op->leaf->val = op->val;
+			}
+		}
+
+		/*
+		 * The commit point: release to subsequent acquire in
+		 * pending_leaf().  The lookups which see the resolved
+		 * slots must also see the status, hence the fence.
+		 */
+		atomic_store_release(&txrec->status,
+		    error ? TXN_ABORTED : TXN_COMMITTED);
+		atomic_thread_fence(memory_order_release);
+		for (i = 0; i < ninstalled; i++) {
+			txn_resolve(txn, &txn->ops[i], error == 0);
+		}
+	}
+
+	/*
+	 * Note the nodes left empty (by the deletes, the aborted inserts
+	 * or the top nodes set for them) and unlock.
+	 */
+	for (i = 0; txn->nlocked && i < txn->nops; i++) {
+		thmap_txop_t *op = &txn->ops[i];
+		thmap_inode_t *parent;
+		unsigned slot;
+
+		parent = txn_edge(thmap, op, &slot);
+		op->collapse = (thmap->flags & THMAP_LAZYDEL) == 0 &&
+		    NODE_COUNT(atomic_load_relaxed(&parent->state)) == 0;
+	}
+	txn_unlock(txn);
+out:
+	for (i = 0; i < txn->nops; i++) {
+		thmap_txop_t *op = &txn->ops[i];
+
+		if (error) {
+			if (op->leaf) {
+				/* Never visible: free immediately. */
+				leaf_free(thmap, op->leaf);
+			}
+		} else {
+			if (op->prev) {
+				leaf_retire(thmap, &op->query, op->key,
+				    op->len, op->prev,
+				    !txn_val_kept(txn, op->prev->val), &chain);
+			}
+			if (op->leaf) {
+				feed_emit(thmap, THMAP_OP_PUT, op->seq,
+				    op->key, op->len, op->val);
+			}
+		}
+		if (op->collapse) {
+			thmap_inode_t *parent;
+			unsigned slot;
+
+			/* Collapse the levels, as del_leaf() does. */
+			hashval_init(thmap, &op->query, op->key, op->len);
+			parent = find_edge_node_locked(thmap, &op->query,
+			    op->key, op->len, &slot);
+			if (parent) {
+				node_collapse(thmap, &op->query,
+				    op->key, op->len, parent);
+			}
+		}
+	}
+
+	/* The lookups may still reference the pending records. */
+	gc_chain_add(&chain, txoff, THMAP_TXREC_LEN(txn->nops), NULL);
+	stage_gc_chain(thmap, &chain);
+	return error;
+}
+
+/*
+ * thmap_txn_commit: apply the changes of the transaction atomically
+ * and end it.
+ *
+ * => The lookups see either all or none of the changes.
+ * => Returns 0 on success and -1 if any key to insert is present or
+ *    any key to replace or delete is not (or on memory allocation
+ *    failure), in which case none of the changes are applied.
+ */
+int
+thmap_txn_commit(thmap_txn_t *txn)
+{
+	int error = txn_commit(txn);
+
+	free(txn);
+	return error;
+}
+
+/*
+ * thmap_move: re-key the entry, i.e. insert the new key with the value
+ * of the old one and remove the old key, atomically.
+ *
+ * => The lookups find the value under either key, never under none.
+ * => Returns 0 on success and -1 if the old key is not present or the
+ *    new one is (or on memory allocation failure).
+ */
+int
+thmap_move(thmap_t *thmap, const void *okey, size_t olen,
+    const void *nkey, size_t nlen)
+{
+	thmap_txn_t txn;
+
+	if (thmap->flags & (THMAP_MULTI | THMAP_INTRUSIVE)) {
+		return -1;
 	}
-	target = atomic_load_relaxed(&parent->slots[slot]); // tagged offset
-	if (THMAP_INODE_P(target)) {
+	txn.thmap = thmap;
+	txn.nops = txn.nlocked = 0;
+	if (txn_add(&txn, TXOP_DEL, okey, olen, NULL) == -1 ||
+	    txn_add(&txn, TXOP_PUT, nkey, nlen, NULL) == -1) {
+		/* The same key. */
+		return -1;
+	}
+	txn.ops[1].from = 0;
+	return txn_commit(&txn);
+}
+
+/*
+ * compact_subtree: collapse the empty intermediate nodes below the
+ * given node, bottom-up.
+ *
+ * => The nodes are locked child first, then parent, as in del_leaf().
+ * => Returns the number of the nodes collapsed.
+ */
+static size_t
+compact_subtree(thmap_t *thmap, thmap_inode_t *parent)
+{
+	size_t ncollapsed = 0;
+
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		/* Consume from prior release in put_leaf(). */
+		const thmap_ptr_t ptr = atomic_load_consume(&parent->slots[i]);
+		thmap_inode_t *node;
+		uint32_t s;
+
+		if (!ptr || !THMAP_INODE_P(ptr)) {
+			continue;
+		}
+		node = THMAP_NODE(thmap, ptr);
+		ncollapsed += compact_subtree(thmap, node);
+
+		/* Pre-check without the lock; re-check with it. */
+		if (NODE_COUNT(atomic_load_relaxed(&node->state)) != 0) {
+			continue;
+		}
+		lock_node(node);
+		s = atomic_load_relaxed(&node->state);
+		if ((s & NODE_DELETED) != 0 || NODE_COUNT(s) != 0) {
+			unlock_node(node);
+			continue;
+		}
+
 		/*
-		 * Empty slot: simply insert the new leaf.  The release
-		 * fence is already issued for us.
+		 * The node is locked and not deleted, therefore it is
+		 * still in the parent, which cannot be deleted either.
 		 */
-		target = THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT;
-		node_insert(parent, slot, target); /* (*) */
-		goto out;
+		lock_node(parent);
+		ASSERT((atomic_load_relaxed(&parent->state) & NODE_DELETED)
+		    == 0);
+		ASSERT(atomic_load_relaxed(&parent->slots[i]) == ptr);
+
+		atomic_store_relaxed(&node->state, s | NODE_DELETED);
+		unlock_node(node);
+		node_remove(parent, i);
+		unlock_node(parent);
+
+		stage_mem_gc(thmap, THMAP_GETOFF(thmap, node),
+		    THMAP_INODE_LEN(thmap));
+		ncollapsed++;
+	}
+	return ncollapsed;
+}
+
+/*
+ * compact_root: collapse the empty nodes of the root slot i.
+ */
+static size_t
+compact_root(thmap_t *thmap, const thmap_gen_t *gen, unsigned i)
+{
+	atomic_thmap_ptr_t *root = gen->root;
+	thmap_ptr_t nptr;
+	thmap_inode_t *node;
+	size_t ncollapsed;
+	uint32_t s;
+
+	/* Consume from prior release in root_try_put(). */
+	nptr = THMAP_ALIGN(atomic_load_consume(&root[i]));
+	if (nptr == THMAP_NULL) {
+		/* Empty or moved to the next generation. */
+		return 0;
+	}
+	node = THMAP_NODE(thmap, nptr);
+	ncollapsed = compact_subtree(thmap, node);
+
+	if (NODE_COUNT(atomic_load_relaxed(&node->state)) != 0) {
+		return ncollapsed;
+	}
+	lock_node(node);
+	s = atomic_load_relaxed(&node->state);
+	if ((s & NODE_DELETED) != 0 || NODE_COUNT(s) != 0) {
+		unlock_node(node);
+		return ncollapsed;
+	}
+
+	/*
+	 * Remove the top node from the root level, as in del_leaf();
+	 * this also drops the ROOT_MOVING tag, if any.
+	 */
+	ASSERT(THMAP_ALIGN(atomic_load_relaxed(&root[i])) == nptr);
+	atomic_store_relaxed(&node->state, s | NODE_DELETED);
+	atomic_store_relaxed(&root[i], THMAP_NULL);
+	unlock_node(node);
+
+	stage_mem_gc(thmap, nptr, THMAP_INODE_LEN(thmap));
+	return ncollapsed + 1;
+}
+
+/*
+ * thmap_compact: collapse the empty intermediate nodes, left in place
+ * by thmap_del() if THMAP_LAZYDEL is set.
+ *
+ * => May run concurrently with the other operations.
+ * => The collapsed nodes are staged for G/C.
+ * => Returns the number of the nodes collapsed.
+ */
+size_t
+thmap_compact(thmap_t *thmap)
+{
+	/* Acquire from prior release in thmap_reseed_step(). */
+	const thmap_gen_t *gen = atomic_load_acquire(&thmap->gen);
+	size_t ncollapsed = 0;
+
+	while (gen) {
+		for (unsigned i = 0; i < ROOT_SIZE; i++) {
+			ncollapsed += compact_root(thmap, gen, i);
+		}
+		/* Acquire from prior release in thmap_reseed_start(). */
+		gen = atomic_load_acquire(&gen->next);
+	}
+	return ncollapsed;
+}
+
+/*
+ * SET OPERATIONS.
+ *
+ * The maps with the same hash function and seed have aligned tries: a
+ * key can only be in the same root slot and under the same path of the
+ * intermediate nodes in either map.  Therefore, the tries are walked in
+ * lockstep, skipping the subtrees which are empty on one side.  Where
+ * one side has a leaf (the paths diverge), the keys are probed in the
+ * other map.  The maps which are not aligned are joined by walking one
+ * map and probing the other.
+ *
+ * The comparison is a join which skips the keys with the same values.
+ * If both maps maintain the digests (THMAP_DIGEST), then it also skips
+ * the subtrees with the same digests, i.e. the work is proportional to
+ * the number of the differences rather than the number of the keys.
+ */
+
+typedef struct {
+	thmap_t *		a;
+	thmap_t *		b;
+	thmap_join_func_t	func;
+	void *			arg;
+	bool			diff;	// skip the same values
+	bool			digest;	// skip the same digests
+} thmap_join_t;
+
+/*
+ * join_emit: call the function for the key of the leaf in the left (a)
+ * or the right (b) map and the matching leaf in the other map, if any.
+ */
+static void
+join_emit(const thmap_join_t *join, bool left, const thmap_leaf_t *leaf,
+    const thmap_leaf_t *oleaf, unsigned mask)
+{
+	thmap_t *thmap = left ? join->a : join->b;
+	uint8_t buf[THMAP_KEYBUF_LEN];
+	const void *key;
+
+	if (oleaf && ((mask & THMAP_JOIN_BOTH) == 0 ||
+	    (join->diff && leaf->val == oleaf->val))) {
+		return;
+	}
+	if (!oleaf && (mask & (THMAP_JOIN_LEFT | THMAP_JOIN_RIGHT)) == 0) {
+		return;
+	}
+	key = leaf_key_get(thmap, leaf, buf);
+	join->func(key, leaf->len,
+	    left ? leaf->val : (oleaf ? oleaf->val : NULL),
+	    left ? (oleaf ? oleaf->val : NULL) : leaf->val, join->arg);
+}
+
+/*
+ * join_find: find the key of the leaf in the subtree of the other map,
+ * where the intermediate node is at the given level.
+ *
+ * => If node is NULL, then lookup in the whole map (not aligned).
+ * => Returns the found leaf or NULL.
+ */
+static const thmap_leaf_t *
+join_find(const thmap_join_t *join, bool left, const thmap_leaf_t *leaf,
+    thmap_inode_t *parent, unsigned level)
+{
+	thmap_t *thmap = left ? join->a : join->b;
+	thmap_t *other = left ? join->b : join->a;
+	uint8_t buf[THMAP_KEYBUF_LEN];
+	const thmap_leaf_t *oleaf;
+	thmap_query_t query;
+	const void *key;
+	thmap_ptr_t node;
+
+	key = leaf_key_get(thmap, leaf, buf);
+	hashval_init(other, &query, key, leaf->len);
+	if (parent == NULL) {
+		return find_leaf(other, &query, key, leaf->len);
+	}
+	query.level = level;
+	oleaf = NULL;
+	for (;;) {
+		const unsigned off = hashval_getslot(other, &query,
+		    key, leaf->len);
+
+		/* Consume from prior release in put_leaf(). */
+		node = atomic_load_consume(&parent->slots[off]);
+		if (!node || !THMAP_INODE_P(node)) {
+			break;
+		}
+		parent = THMAP_NODE(other, node);
+		query.level++;
+	}
+	if (node && (oleaf = slot_leaf(other, node)) != NULL &&
+	    !key_cmp_p(other, oleaf, key, leaf->len)) {
+		oleaf = NULL;
+	}
+	return oleaf;
+}
+
+/*
+ * join_cmp: compare the keys of the leaves of the two maps.
+ */
+static bool
+join_cmp(const thmap_join_t *join, const thmap_leaf_t *aleaf,
+    const thmap_leaf_t *bleaf)
+{
+	uint8_t buf[THMAP_KEYBUF_LEN];
+
+	if (aleaf->len != bleaf->len) {
+		return false;
+	}
+	return key_cmp_p(join->a, aleaf,
+	    leaf_key_get(join->b, bleaf, buf), bleaf->len);
+}
+
+/*
+ * join_walk: emit the keys of the subtree in one of the maps, except
+ * the given leaf (already emitted).  If the node is NULL, then probe
+ * the keys in the other map; otherwise, they are not there.
+ */
+static void
+join_walk(const thmap_join_t *join, bool left, thmap_ptr_t ptr,
+    unsigned mask, bool probe, const thmap_leaf_t *skip)
+{
+	thmap_t *thmap = left ? join->a : join->b;
+	const thmap_leaf_t *leaf, *oleaf = NULL;
+	thmap_inode_t *node;
+
+	if (ptr == THMAP_NULL || mask == 0) {
+		return;
+	}
+	if (!THMAP_INODE_P(ptr)) {
+		leaf = slot_leaf(thmap, ptr);
+		if (leaf == NULL || leaf == skip) {
+			return;
+		}
+		if (probe) {
+			oleaf = join_find(join, left, leaf, NULL, 0);
+		}
+		join_emit(join, left, leaf, oleaf, mask);
+		return;
+	}
+	node = THMAP_NODE(thmap, ptr);
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		/* Consume from prior release in put_leaf(). */
+		const thmap_ptr_t child = atomic_load_consume(&node->slots[i]);
+
+		join_walk(join, left, child, mask, probe, skip);
+	}
+}
+
+/*
+ * join_pair: walk the aligned subtrees of the two maps in lockstep.
+ *
+ * => The intermediate nodes, if any, are at the given level.
+ */
+static void
+join_pair(const thmap_join_t *join, thmap_ptr_t aptr, thmap_ptr_t bptr,
+    unsigned level, unsigned mask)
+{
+	const unsigned amask = mask & (THMAP_JOIN_BOTH | THMAP_JOIN_LEFT);
+	const unsigned bmask = mask & THMAP_JOIN_RIGHT;
+	const thmap_leaf_t *aleaf = NULL, *bleaf = NULL;
+	thmap_inode_t *anode, *bnode;
+
+	/*
+	 * Resolve the leaves once; a pending insert of a transaction is
+	 * an empty slot.
+	 */
+	if (aptr != THMAP_NULL && !THMAP_INODE_P(aptr) &&
+	    (aleaf = slot_leaf(join->a, aptr)) == NULL) {
+		aptr = THMAP_NULL;
+	}
+	if (bptr != THMAP_NULL && !THMAP_INODE_P(bptr) &&
+	    (bleaf = slot_leaf(join->b, bptr)) == NULL) {
+		bptr = THMAP_NULL;
+	}
+
+	/* One side is empty: there is nothing to probe. */
+	if (bptr == THMAP_NULL) {
+		join_walk(join, true, aptr, mask & THMAP_JOIN_LEFT,
+		    false, NULL);
+		return;
+	}
+	if (aptr == THMAP_NULL) {
+		join_walk(join, false, bptr, bmask, false, NULL);
+		return;
+	}
+
+	if (THMAP_INODE_P(aptr) && THMAP_INODE_P(bptr)) {
+		/* Both are intermediate nodes: descend. */
+		anode = THMAP_NODE(join->a, aptr);
+		bnode = THMAP_NODE(join->b, bptr);
+		if (join->digest && atomic_load_relaxed(node_digest(anode)) ==
+		    atomic_load_relaxed(node_digest(bnode))) {
+			/* The same keys and values (with a high probability). */
+			return;
+		}
+		for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+			/* Consume from prior release in put_leaf(). */
+			const thmap_ptr_t achild =
+			    atomic_load_consume(&anode->slots[i]);
+			const thmap_ptr_t bchild =
+			    atomic_load_consume(&bnode->slots[i]);
+
+			join_pair(join, achild, bchild, level + 1, mask);
+		}
+		return;
+	}
+
+	/*
+	 * At least one side is a leaf.  Its key can only be in the
+	 * subtree of the other side and none of the other keys of that
+	 * subtree can be on this side.
+	 */
+	if (!THMAP_INODE_P(aptr)) {
+		if (!THMAP_INODE_P(bptr)) {
+			if (!join_cmp(join, aleaf, bleaf)) {
+				bleaf = NULL;
+			}
+		} else {
+			bleaf = join_find(join, true, aleaf,
+			    THMAP_NODE(join->b, bptr), level);
+		}
+		join_emit(join, true, aleaf, bleaf, amask);
+		join_walk(join, false, bptr, bmask, false, bleaf);
+		return;
+	}
+
+	aleaf = join_find(join, false, bleaf, THMAP_NODE(join->a, aptr),
+	    level);
+	join_walk(join, true, aptr, amask & ~THMAP_JOIN_BOTH, false, aleaf);
+	join_emit(join, false, bleaf, aleaf,
+	    mask & (THMAP_JOIN_BOTH | THMAP_JOIN_RIGHT));
+}
+
+/*
+ * join_root: load the root slot i of the map.
+ *
+ * => Returns ROOT_MOVED if the map is being reseeded.
+ */
+static thmap_ptr_t
+join_root(const thmap_t *thmap, unsigned i)
+{
+	/* Acquire from prior release in thmap_reseed_step(). */
+	const thmap_gen_t *gen = atomic_load_acquire(&thmap->gen);
+	thmap_ptr_t ptr;
+
+	if (gen->root == NULL) {
+		return THMAP_NULL;
+	}
+	/* Acquire from prior release in thmap_reseed_start(). */
+	if (atomic_load_acquire(&gen->next) != NULL) {
+		return ROOT_MOVED;
+	}
+	/* Consume from prior release in root_try_put(). */
+	ptr = atomic_load_consume(&gen->root[i]);
+	return ptr == ROOT_MOVED ? ptr : THMAP_ALIGN(ptr);
+}
+
+/*
+ * join_run: join the two maps over the range of the root slots.
+ */
+static int
+join_run(thmap_join_t *join, unsigned mask, unsigned slot, unsigned nslots)
+{
+	thmap_t *a = join->a, *b = join->b;
+	uint64_t aseed[2], bseed[2];
+	bool aligned;
+
+	if (((a->flags | b->flags) & THMAP_MULTI) != 0 ||
+	    slot > THMAP_JOIN_NSLOTS || nslots > THMAP_JOIN_NSLOTS - slot) {
+		return -1;
+	}
+	thmap_getseed(a, aseed);
+	thmap_getseed(b, bseed);
+	aligned = ((a->flags ^ b->flags) & THMAP_SIPHASH) == 0 &&
+	    aseed[0] == bseed[0] && aseed[1] == bseed[1];
+	join->digest = join->diff && aligned &&
+	    (a->flags & b->flags & THMAP_DIGEST) != 0;
+
+	for (unsigned i = slot; i < slot + nslots; i++) {
+		const thmap_ptr_t aptr = join_root(a, i);
+		const thmap_ptr_t bptr = join_root(b, i);
+
+		if (aptr == ROOT_MOVED || bptr == ROOT_MOVED) {
+			return -1;
+		}
+		if (aligned) {
+			join_pair(join, aptr, bptr, 0, mask);
+			continue;
+		}
+
+		/*
+		 * Not aligned: walk each map and probe the other.
+		 */
+		join_walk(join, true, aptr, mask & (THMAP_JOIN_BOTH |
+		    THMAP_JOIN_LEFT), true, NULL);
+		join_walk(join, false, bptr, mask & THMAP_JOIN_RIGHT,
+		    true, NULL);
+	}
+	return 0;
+}
+
+/*
+ * thmap_join: join the two maps over the range of the root slots,
+ * calling the function for the keys selected by the mask:
+ *
+ * - THMAP_JOIN_BOTH: the keys present in both maps;
+ * - THMAP_JOIN_LEFT: the keys present only in the map a;
+ * - THMAP_JOIN_RIGHT: the keys present only in the map b.
+ *
+ * => The slot ranges partition the keys of both maps, therefore the
+ *    disjoint ranges may be joined in parallel.
+ * => The walk is subject to the same G/C rules as the lookup.  It is not
+ *    a snapshot: the concurrent updates might or might not be seen.
+ * => Returns -1 if either map is being reseeded; the keys might be
+ *    partially emitted.
+ */
+int
+thmap_join(thmap_t *a, thmap_t *b, unsigned mask, unsigned slot,
+    unsigned nslots, thmap_join_func_t func, void *arg)
+{
+	thmap_join_t join = { .a = a, .b = b, .func = func, .arg = arg };
+	return join_run(&join, mask, slot, nslots);
+}
+
+/*
+ * thmap_intersect: call the function for the keys present in both maps,
+ * with the values of both maps, i.e. the hash join.
+ */
+int
+thmap_intersect(thmap_t *a, thmap_t *b, thmap_join_func_t func, void *arg)
+{
+	return thmap_join(a, b, THMAP_JOIN_BOTH, 0, THMAP_JOIN_NSLOTS,
+	    func, arg);
+}
+
+/*
+ * thmap_diff: call the function for the keys present in the map a,
+ * but not in the map b.
+ */
+int
+thmap_diff(thmap_t *a, thmap_t *b, thmap_join_func_t func, void *arg)
+{
+	return thmap_join(a, b, THMAP_JOIN_LEFT, 0, THMAP_JOIN_NSLOTS,
+	    func, arg);
+}
+
+/*
+ * thmap_union: call the function for the keys present in either map;
+ * the value is NULL for the map which does not have the key.
+ */
+int
+thmap_union(thmap_t *a, thmap_t *b, thmap_join_func_t func, void *arg)
+{
+	return thmap_join(a, b, THMAP_JOIN_BOTH | THMAP_JOIN_LEFT |
+	    THMAP_JOIN_RIGHT, 0, THMAP_JOIN_NSLOTS, func, arg);
+}
+
+/*
+ * thmap_digest: get the digest of the whole map (THMAP_DIGEST).
+ *
+ * => The digest is zero for the empty map or if the digests are not
+ *    maintained.
+ * => Returns -1 if the map is being reseeded: the digests of the two
+ *    generations use different seeds, therefore cannot be summed.
+ */
+int
+thmap_digest(thmap_t *thmap, uint64_t *digestp)
+{
+	/* Acquire from prior release in thmap_reseed_step(). */
+	const thmap_gen_t *gen = atomic_load_acquire(&thmap->gen);
+	uint64_t digest = 0;
+
+	if ((thmap->flags & THMAP_DIGEST) == 0 || gen->root == NULL) {
+		*digestp = 0;
+		return 0;
+	}
+	for (unsigned i = 0; i < ROOT_SIZE; i++) {
+		thmap_ptr_t ptr;
+
+		/* Acquire from prior release in thmap_reseed_start(). */
+		if (atomic_load_acquire(&gen->next) != NULL) {
+			return -1;
+		}
+		/* Consume from prior release in root_try_put(). */
+		ptr = atomic_load_consume(&gen->root[i]);
+		if (ptr == ROOT_MOVED) {
+			return -1;
+		}
+		if ((ptr = THMAP_ALIGN(ptr)) != THMAP_NULL) {
+			thmap_inode_t *node = THMAP_NODE(thmap, ptr);
+			digest += atomic_load_relaxed(node_digest(node));
+		}
+	}
+	*digestp = digest;
+	return 0;
+}
+
+/*
+ * thmap_compare: call the function for the keys which differ between
+ * the maps: present only in one of them or with the different values.
+ *
+ * => With THMAP_DIGEST (on both maps with the same seed), only the
+ *    subtrees with the different digests are visited.
+ */
+int
+thmap_compare(thmap_t *a, thmap_t *b, thmap_join_func_t func, void *arg)
+{
+	thmap_join_t join = {
+		.a = a, .b = b, .func = func, .arg = arg, .diff = true
+	};
+	return join_run(&join, THMAP_JOIN_BOTH | THMAP_JOIN_LEFT |
+	    THMAP_JOIN_RIGHT, 0, THMAP_JOIN_NSLOTS);
+}
+
+/*
+ * RESEEDING.
+ */
+
+static void
+subtree_unlock(thmap_t *thmap, thmap_inode_t *node)
+{
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		const thmap_ptr_t ptr = atomic_load_relaxed(&node->slots[i]);
+
+		if (ptr && THMAP_INODE_P(ptr)) {
+			subtree_unlock(thmap, THMAP_NODE(thmap, ptr));
+		}
+	}
+	unlock_node(node);
+}
+
+/*
+ * subtree_trylock: try to lock all nodes of the subtree, top-down.
+ *
+ * => The writers lock bottom-up, therefore we must not wait: on failure,
+ *    release the locks taken so far and return false.
+ * => The locked nodes cannot change, so the same walk releases them.
+ */
+static bool
+subtree_trylock(thmap_t *thmap, thmap_inode_t *node)
+{
+	if (!trylock_node(node)) {
+		return false;
+	}
+	if (atomic_load_relaxed(&node->state) & NODE_DELETED) {
+		unlock_node(node);
+		return false;
+	}
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		const thmap_ptr_t ptr = atomic_load_relaxed(&node->slots[i]);
+
+		if (!ptr || !THMAP_INODE_P(ptr)) {
+			continue;
+		}
+		if (!subtree_trylock(thmap, THMAP_NODE(thmap, ptr))) {
+			while (i--) {
+				const thmap_ptr_t cptr =
+				    atomic_load_relaxed(&node->slots[i]);
+
+				if (cptr && THMAP_INODE_P(cptr)) {
+					subtree_unlock(thmap,
+					    THMAP_NODE(thmap, cptr));
+				}
+			}
+			unlock_node(node);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * subtree_move: insert the leaves of the locked subtree into the given
+ * (next) generation or, if undo is true, remove the first *nleaves of
+ * them from it.
+ *
+ * => Returns -1 on failure, setting *nleaves to the number of leaves
+ *    which were inserted.
+ */
+static int
+subtree_move(thmap_t *thmap, const thmap_gen_t *gen, thmap_inode_t *node,
+    bool undo, unsigned *nleaves)
+{
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		const thmap_ptr_t ptr = atomic_load_relaxed(&node->slots[i]);
+		uint8_t buf[THMAP_KEYBUF_LEN];
+		thmap_query_t query;
+		thmap_leaf_t *leaf;
+		const void *key;
+
+		if (!ptr) {
+			continue;
+		}
+		if (THMAP_INODE_P(ptr)) {
+			if (subtree_move(thmap, gen,
+			    THMAP_NODE(thmap, ptr), undo, nleaves) == -1) {
+				return -1;
+			}
+			continue;
+		}
+		if (undo && *nleaves == 0) {
+			return 0;
+		}
+		ASSERT(!THMAP_PENDING_P(ptr));
+		leaf = THMAP_NODE(thmap, ptr);
+		key = leaf_key_get(thmap, leaf, buf);
+		hashval_init_gen(thmap, gen, &query, key, leaf->len);
+		if (undo) {
+			leaf = del_leaf(thmap, &query, key, leaf->len,
+			    NULL, NULL);
+			ASSERT(leaf == THMAP_NODE(thmap, ptr));
+			/* Still present in this generation. */
+			atomic_fetch_and_explicit(&leaf->state,
+			    ~LEAF_DELETED, memory_order_relaxed);
+			(*nleaves)--;
+		} else {
+			leaf = put_leaf(thmap, &query, key, leaf->len, leaf);
+			if (leaf == NULL) {
+				return -1;
+			}
+			ASSERT(leaf == THMAP_NODE(thmap, ptr));
+			(*nleaves)++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * subtree_retire: mark the nodes of the moved subtree as deleted,
+ * unlock and stage them for G/C.
+ */
+static void
+subtree_retire(thmap_t *thmap, thmap_inode_t *node)
+{
+	uint32_t s;
+
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		const thmap_ptr_t ptr = atomic_load_relaxed(&node->slots[i]);
+
+		if (ptr && THMAP_INODE_P(ptr)) {
+			subtree_retire(thmap, THMAP_NODE(thmap, ptr));
+		}
 	}
 
 	/*
-	 * Collision or duplicate.
+	 * Set NODE_DELETED and unlock with a single store: release to
+	 * subsequent acquire in find_edge_node() or lock_node().
 	 */
-	other = THMAP_NODE(thmap, target);
-	if (key_cmp_p(thmap, other, key, len)) {
-		/*
-		 * Duplicate.  Free the pre-allocated leaf and
-		 * return the present value.
-		 */
-		leaf_free(thmap, leaf);
-		val = other->val;
-		goto out;
+	s = atomic_load_relaxed(&node->state);
+	atomic_store_release(&node->state, (s | NODE_DELETED) & ~NODE_LOCKED);
+	stage_mem_gc(thmap, THMAP_GETOFF(thmap, node),
+	    THMAP_INODE_LEN(thmap));
+}
+
+/*
+ * root_move: move the root slot i of the current generation into
+ * the next generation.
+ *
+ * => Returns 0 on success and -1 on memory allocation failure, in
+ *    which case the slot is left in the current generation.
+ */
+static int
+root_move(thmap_t *thmap, thmap_gen_t *gen, unsigned i)
+{
+	atomic_thmap_ptr_t *root = gen->root;
+	unsigned bcount = SPINLOCK_BACKOFF_MIN;
+	unsigned nleaves = 0;
+	thmap_inode_t *node;
+	thmap_ptr_t v;
+again:
+	v = atomic_load_acquire(&root[i]);
+	if (v == THMAP_NULL) {
+		/* Empty: just redirect to the next generation. */
+		if (!atomic_compare_exchange_weak_explicit(&root[i], &v,
+		    ROOT_MOVED, memory_order_release, memory_order_relaxed)) {
+			goto again;
+		}
+		return 0;
 	}
-descend:
+	ASSERT(v != ROOT_MOVED);
+
 	/*
-	 * Collision -- expand the tree.  Create an intermediate node
-	 * which will be locked (NODE_LOCKED) for us.  At this point,
-	 * we advance to the next level.
+	 * Tag the slot, so that the writers would find the subtree
+	 * locked, and attempt to lock it whole.  If it is contended
+	 * or the top node was deleted meanwhile, then re-try.
 	 */
-	child = node_create(thmap, parent);
-	if (__predict_false(!child)) {
-		leaf_free(thmap, leaf);
-		val = NULL;
-		goto out;
+	if ((v & ROOT_MOVING) == 0 &&
+	    !atomic_compare_exchange_weak_explicit(&root[i], &v,
+	    v | ROOT_MOVING, memory_order_relaxed, memory_order_relaxed)) {
+		goto again;
+	}
+	node = THMAP_NODE(thmap, v);
+	if (!subtree_trylock(thmap, node)) {
+		SPINLOCK_BACKOFF(bcount);
+		goto again;
 	}
-	query.level++;
 
 	/*
-	 * Insert the other (colliding) leaf first.  The new child is
-	 * not yet published, so memory order is relaxed.
+	 * The top node is locked and not deleted, therefore the slot
+	 * cannot change.  Insert the leaves into the next generation.
 	 */
-	other_slot = hashval_getleafslot(thmap, other, query.level);
-	target = THMAP_GETOFF(thmap, other) | THMAP_LEAF_BIT;
-	node_insert(child, other_slot, target);
+	ASSERT(atomic_load_relaxed(&root[i]) == (THMAP_ALIGN(v) | ROOT_MOVING));
+	if (subtree_move(thmap, gen->next, node, false, &nleaves) == -1) {
+		subtree_move(thmap, gen->next, node, true, &nleaves);
+		ASSERT(nleaves == 0);
+		atomic_store_relaxed(&root[i], THMAP_ALIGN(v));
+		subtree_unlock(thmap, node);
+		return -1;
+	}
 
 	/*
-	 * Insert the intermediate node into the parent node.
-	 * It becomes the new parent for the our new leaf.
-	 *
-	 * Ensure that stores to the child (and leaf) reach global
-	 * visibility before it gets inserted to the parent, as
-	 * consumed by get_leaf() or find_edge_node().
+	 * Redirect the slot to the next generation and retire the old
+	 * nodes.  Release the inserts to subsequent consume/acquire in
+	 * find_edge_node().
 	 */
-	atomic_store_release(&parent->slots[slot], THMAP_GETOFF(thmap, child));
+	atomic_store_release(&root[i], ROOT_MOVED);
+	subtree_retire(thmap, node);
+	return 0;
+}
 
-	unlock_node(parent);
-	ASSERT(node_locked_p(child));
-	parent = child;
+static void
+gen_dtor(thmap_t *thmap, uintptr_t addr, size_t len)
+{
+	free((void *)addr); (void)thmap; (void)len;
+}
 
-	/*
-	 * Get the new slot and check for another collision
-	 * at the next level.
-	 */
-	slot = hashval_getslot(&query, key, len);
-	if (slot == other_slot) {
-		/* Another collision -- descend and expand again. */
-		goto descend;
+/*
+ * thmap_reseed_start: start the migration of the map to a new random
+ * hash seed.
+ *
+ * => Returns 0 on success and -1 on failure (or if already started).
+ * => Serialised with thmap_reseed_step() by the caller.
+ */
+int
+thmap_reseed_start(thmap_t *thmap)
+{
+	thmap_gen_t *gen = atomic_load_relaxed(&thmap->gen), *next;
+	uintptr_t root;
+
+	if ((thmap->flags & THMAP_SETROOT) != 0 ||
+	    atomic_load_relaxed(&gen->next) != NULL) {
+		return -1;
+	}
+	if ((next = calloc(1, sizeof(thmap_gen_t))) == NULL) {
+		return -1;
+	}
+	if (random_seed(next->seed) == -1) {
+		free(next);
+		return -1;
+	}
+	if ((root = mem_alloc(thmap, THMAP_ROOT_LEN)) == THMAP_NULL) {
+		free(next);
+		return -1;
+	}
+	next->root = THMAP_GETPTR(thmap, root);
+	memset(next->root, 0, THMAP_ROOT_LEN);
+	thmap->reseed_slot = 0;
+
+	/* Release to subsequent acquire in hashval_next_gen(). */
+	atomic_store_release(&gen->next, next);
+	return 0;
+}
+
+/*
+ * thmap_reseed_step: move up to nslots root-level slots into the next
+ * generation; start the migration if excessive depth was seen.
+ *
+ * => Returns the number of slots left to move (zero if the migration
+ *    has completed or there is none) or -1 on failure.
+ * => Serialised with thmap_reseed_start() by the caller.
+ */
+int
+thmap_reseed_step(thmap_t *thmap, unsigned nslots)
+{
+	thmap_gen_t *gen = atomic_load_relaxed(&thmap->gen), *next;
+	thmap_gc_chain_t chain = { NULL, NULL };
+
+	if (atomic_load_relaxed(&gen->next) == NULL) {
+		if (!atomic_load_relaxed(&thmap->reseed)) {
+			return 0;
+		}
+		if (thmap_reseed_start(thmap) == -1) {
+			return -1;
+		}
+		atomic_store_relaxed(&thmap->reseed, false);
+	}
+	while (nslots-- && thmap->reseed_slot < ROOT_SIZE) {
+		if (root_move(thmap, gen, thmap->reseed_slot) == -1) {
+			return -1;
+		}
+		thmap->reseed_slot++;
+	}
+	if (thmap->reseed_slot < ROOT_SIZE) {
+		return ROOT_SIZE - thmap->reseed_slot;
 	}
 
 	/*
-	 * Insert our new leaf once we expanded enough.  The release
-	 * fence is already issued for us.
+	 * All slots were moved: switch to the next generation.  Release
+	 * to subsequent acquire in hashval_init().  The old root and the
+	 * generation are referenced by the readers until G/C; they are
+	 * staged together (see find_leaf_hazard()).
 	 */
-	target = THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT;
-	node_insert(parent, slot, target); /* (*) */
-out:
-	unlock_node(parent);
-	return val;
+	next = atomic_load_relaxed(&gen->next);
+	atomic_store_release(&thmap->gen, next);
+	gc_chain_add(&chain, THMAP_GETOFF(thmap, gen->root), THMAP_ROOT_LEN,
+	    NULL);
+	gc_chain_add(&chain, (uintptr_t)gen, sizeof(thmap_gen_t), gen_dtor);
+	stage_gc_chain(thmap, &chain);
+	return 0;
 }
 
 /*
- * thmap_del: remove the entry given the key.
+ * G/C routines.
  */
-void *
-thmap_del(thmap_t *thmap, const void *key, size_t len)
+
+/*
+ * stage_gc: stage the object for G/C; it will be released by the given
+ * destructor or, if NULL, by the ops->free routine.
+ */
+static void
+stage_gc(thmap_t *thmap, uintptr_t addr, size_t len, thmap_dtor_t dtor)
 {
-	thmap_query_t query;
-	thmap_leaf_t *leaf;
-	thmap_inode_t *parent;
-	unsigned slot;
-	void *val;
+	thmap_gc_chain_t chain = { NULL, NULL };
 
-	hashval_init(&query, key, len);
-	parent = find_edge_node_locked(thmap, &query, key, len, &slot);
-	if (!parent) {
-		/* Root slot empty: not found. */
-		return NULL;
+	gc_chain_add(&chain, addr, len, dtor);
+	stage_gc_chain(thmap, &chain);
+}
+
+static thmap_gc_t *
+gc_chain_grow(thmap_gc_chain_t *chain)
+{
+	thmap_gc_t *gc = chain->head, *ngc;
+	const unsigned maxobjs = gc ? GC_BLOCK_MAX : GC_BLOCK_MIN;
+
+	ngc = malloc(offsetof(thmap_gc_t, objs[maxobjs]));
+	ngc->nobjs = 0;
+	ngc->maxobjs = maxobjs;
+	ngc->next = gc; // not yet published
+
+	if (gc == NULL) {
+		chain->tail = ngc;
 	}
-	leaf = get_leaf(thmap, parent, slot);
-	if (!leaf || !key_cmp_p(thmap, leaf, key, len)) {
-		/* Not found. */
-		unlock_node(parent);
-		return NULL;
+	chain->head = ngc;
+	return ngc;
+}
+
+/*
+ * gc_chain_add: add the object to the local G/C chain.
+ *
+ * => The first block is small, since most chains are short.
+ */
+static void
+gc_chain_add(thmap_gc_chain_t *chain, uintptr_t addr, size_t len,
+    thmap_dtor_t dtor)
+{
+	thmap_gc_t *gc = chain->head;
+	thmap_gcobj_t *obj;
+
+	if (gc == NULL || gc->nobjs == gc->maxobjs) {
+		gc = gc_chain_grow(chain);
 	}
+	obj = &gc->objs[gc->nobjs++];
+	obj->addr = addr;
+	obj->len = len;
+	obj->dtor = dtor;
+}
 
-	/* Remove the leaf. */
-	ASSERT(THMAP_NODE(thmap, atomic_load_relaxed(&parent->slots[slot]))
-	    == leaf);
-	node_remove(parent, slot);
+/*
+ * gc_chain_reserve: make room for n objects in the current block, so
+ * that the next n objects are staged in the same block.  The hazard
+ * pointer of one object then protects all of them, see gc_release().
+ */
+static void
+gc_chain_reserve(thmap_gc_chain_t *chain, unsigned n)
+{
+	const thmap_gc_t *gc = chain->head;
+
+	ASSERT(n <= GC_BLOCK_MIN);
+	if (gc && gc->maxobjs - gc->nobjs < n) {
+		gc_chain_grow(chain);
+	}
+}
+
+/*
+ * stage_gc_chain: stage the objects of the chain for G/C, at once.
+ */
+static void
+stage_gc_chain(thmap_t *thmap, thmap_gc_chain_t *chain)
+{
+	thmap_gc_t *head;
+
+	if (chain->head == NULL) {
+		return;
+	}
+retry:
+	head = atomic_load_relaxed(&thmap->gc_list);
+	chain->tail->next = head; // not yet published
+
+	/* Release to subsequent acquire in thmap_stage_gc(). */
+	if (!atomic_compare_exchange_weak_explicit(&thmap->gc_list, &head,
+	    chain->head, memory_order_release, memory_order_relaxed)) {
+		goto retry;
+	}
+}
+
+static void
+stage_mem_gc(thmap_t *thmap, uintptr_t addr, size_t len)
+{
+	stage_gc(thmap, addr, len, NULL);
+}
+
+void *
+thmap_stage_gc(thmap_t *thmap)
+{
+	thmap_gc_t *gc;
+
+	/* Acquire from prior release in stage_mem_gc(). */
+	gc = atomic_exchange_explicit(&thmap->gc_list, NULL,
+	    memory_order_acquire);
 
 	/*
-	 * Collapse the levels if removing the last item.
+	 * New G/C epoch: flush the lookup caches.  Release to subsequent
+	 * acquire in thmap_cache_get().
 	 */
-	while (query.level &&
-	    NODE_COUNT(atomic_load_relaxed(&parent->state)) == 0) {
-		thmap_inode_t *node = parent;
+	atomic_fetch_add_explicit(&thmap->gc_epoch, 1, memory_order_release);
+	return gc;
+}
 
-		ASSERT(atomic_load_relaxed(&node->state) == NODE_LOCKED);
+/*
+ * The objects released by G/C are grouped by the size class: the leaves,
+ * the intermediate nodes (same as POOL_LEAF and POOL_INODE) and others.
+ */
 
-		/*
-		 * Ascend one level up.
-		 * => Mark our current parent as deleted.
-		 * => Lock the parent one level up.
-		 */
-		query.level--;
-		slot = hashval_getslot(&query, key, len);
-		parent = THMAP_NODE(thmap, node->parent);
-		ASSERT(parent != NULL);
+#define	GC_OTHER	2
+#define	GC_NCLASSES	3
 
-		lock_node(parent);
-		ASSERT((atomic_load_relaxed(&parent->state) & NODE_DELETED)
-		    == 0);
+typedef struct {
+	unsigned	n;
+	uintptr_t	addrs[MEM_BULK];
+	size_t		lens[MEM_BULK];
+} thmap_gcbatch_t;
 
-		/*
-		 * Lock is exclusive, so nobody else can be writing at
-		 * the same time, and no need for atomic R/M/W, but
-		 * readers may read without the lock and so need atomic
-		 * load/store.  No ordering here needed because the
-		 * entry itself stays valid until GC.
-		 */
-		atomic_store_relaxed(&node->state,
-		    atomic_load_relaxed(&node->state) | NODE_DELETED);
-		unlock_node(node); // memory_order_release
+static unsigned
+gc_class(const thmap_t *thmap, size_t len)
+{
+	if (len == sizeof(thmap_leaf_t)) {
+		return POOL_LEAF;
+	}
+	if (len == THMAP_INODE_LEN(thmap)) {
+		return POOL_INODE;
+	}
+	return GC_OTHER;
+}
 
-		ASSERT(THMAP_NODE(thmap,
-		    atomic_load_relaxed(&parent->slots[slot])) == node);
-		node_remove(parent, slot);
+/*
+ * gc_flush: release the batch of the objects of the same size class:
+ * recycle them into the reserve pool, if any, and free the rest in bulk.
+ */
+static void
+gc_flush(thmap_t *thmap, unsigned class, thmap_gcbatch_t *batch)
+{
+	const thmap_ops_t *ops = thmap->ops;
+	size_t i = 0;
 
-		/* Stage the removed node for G/C. */
-		stage_mem_gc(thmap, THMAP_GETOFF(thmap, node), THMAP_INODE_LEN);
+	if (class != GC_OTHER) {
+		i = pool_recycle(thmap, class, batch->addrs, batch->n);
+	}
+	if (ops->free_bulk && i < batch->n) {
+		ops->free_bulk(ops->ctx, &batch->addrs[i], &batch->lens[i],
+		    batch->n - i);
+	} else {
+		for (; i < batch->n; i++) {
+			mem_free(thmap, batch->addrs[i], batch->lens[i]);
+		}
 	}
+	batch->n = 0;
+}
+
+static uint64_t
+gc_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * gc_hazards: take the snapshot of the published hazard pointers, sorted.
+ *
+ * => The snapshot is stored in the given buffer of HAZARD_NRECS records,
+ *    if there is a single block, or otherwise in the allocated one.
+ * => Returns the snapshot, setting the number of pointers, or NULL on
+ *    memory allocation failure.
+ */
+static uintptr_t *
+gc_hazards(const thmap_t *thmap, uintptr_t *buf, unsigned *nhps)
+{
+	const thmap_hzblock_t *blk;
+	unsigned nblocks = 0, n = 0;
+	uintptr_t *hps = buf;
 
 	/*
-	 * If the top node is empty, then we need to remove it from the
-	 * root level.  Mark the node as deleted and clear the slot.
-	 *
-	 * Note: acquiring the lock on the top node effectively prevents
-	 * the root slot from changing.
+	 * The staged objects are no longer reachable: the lookups have
+	 * either published them before this fence or will see them stale.
+	 * Pairs with the fence in hazard_set().  Likewise, the blocks
+	 * appended after the fence hold no staged objects.
 	 */
-	if (NODE_COUNT(atomic_load_relaxed(&parent->state)) == 0) {
-		const unsigned rslot = query.rslot;
-		const thmap_ptr_t nptr =
-		    atomic_load_relaxed(&thmap->root[rslot]);
+	atomic_thread_fence(memory_order_seq_cst);
+	for (blk = thmap->hazards; blk; blk = atomic_load_acquire(&blk->next)) {
+		nblocks++;
+	}
+	if (nblocks > 1 && (hps = malloc(nblocks * HAZARD_NRECS *
+	    HAZARD_NPTRS * sizeof(uintptr_t))) == NULL) {
+		return NULL;
+	}
+	blk = thmap->hazards;
+	while (nblocks--) {
+		for (unsigned i = 0; i < HAZARD_NRECS * HAZARD_NPTRS; i++) {
+			const thmap_hazard_t *hz = &blk->recs[i / HAZARD_NPTRS];
+			const unsigned j = i % HAZARD_NPTRS;
 
-		ASSERT(query.level == 0);
-		ASSERT(parent->parent == THMAP_NULL);
-		ASSERT(THMAP_GETOFF(thmap, parent) == nptr);
+			/* Acquire from prior release in hazard_release(). */
+			const uintptr_t hp = atomic_load_acquire(&hz->hp[j]);
+			unsigned k = n++;
+
+			if (hp == 0) {
+				n--;
+				continue;
+			}
+			while (k && hps[k - 1] > hp) {
+				hps[k] = hps[k - 1];
+				k--;
+			}
+			hps[k] = hp;
+		}
+		blk = atomic_load_relaxed(&blk->next);
+	}
+	*nhps = n;
+	return hps;
+}
 
-		/* Mark as deleted and remove from the root-level slot. */
-		atomic_store_relaxed(&parent->state,
-		    atomic_load_relaxed(&parent->state) | NODE_DELETED);
-		atomic_store_relaxed(&thmap->root[rslot], THMAP_NULL);
+/*
+ * gc_protected_p: check whether any object of the block is published
+ * as a hazard pointer (which may point within the object).
+ */
+static bool
+gc_protected_p(const thmap_gc_t *gc, const uintptr_t *hps, unsigned nhps)
+{
+	for (unsigned i = 0; i < gc->nobjs; i++) {
+		const thmap_gcobj_t *obj = &gc->objs[i];
+		unsigned lo = 0, hi = nhps;
 
-		stage_mem_gc(thmap, nptr, THMAP_INODE_LEN);
-	}
-	unlock_node(parent);
+		/* The first pointer at or above the object. */
+		while (lo < hi) {
+			const unsigned mid = (lo + hi) / 2;
 
-	/*
-	 * Save the value and stage the leaf for G/C.
-	 */
-	val = leaf->val;
-	if ((thmap->flags & THMAP_NOCOPY) == 0) {
-		stage_mem_gc(thmap, leaf->key, leaf->len);
+			if (hps[mid] < obj->addr) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo < nhps && hps[lo] - obj->addr < obj->len) {
+			return true;
+		}
 	}
-	stage_mem_gc(thmap, THMAP_GETOFF(thmap, leaf), sizeof(thmap_leaf_t));
-	return val;
+	return false;
 }
 
 /*
- * G/C routines.
+ * gc_release: release the staged objects, but at most maxobjs of them
+ * and, if the deadline is set, stop once it passes.  The objects are
+ * taken from the end of the blocks, therefore what is left is a valid
+ * G/C reference.
+ *
+ * => The clock is checked every GC_CLOCK_OBJS objects, therefore each
+ *    call releases at least that many objects (or maxobjs, if fewer, or
+ *    all of them), except those kept for the hazard pointers.
+ * => The blocks with any object protected by a hazard pointer are kept
+ *    and staged again (THMAP_HAZARD); all of them, if there is no memory
+ *    for the snapshot of the hazard pointers.
+ * => Waits for the lookups in progress (THMAP_GRACE).
+ * => Returns the remaining reference or NULL if all objects released.
  */
 
-static void
-stage_mem_gc(thmap_t *thmap, uintptr_t addr, size_t len)
+#define	GC_CLOCK_OBJS	32
+
+static thmap_gc_t *
+gc_release(thmap_t *thmap, thmap_gc_t *gc, size_t maxobjs, uint64_t deadline)
 {
-	thmap_gc_t *head, *gc;
+	uintptr_t hpbuf[HAZARD_NRECS * HAZARD_NPTRS], *hps = hpbuf;
+	thmap_gc_chain_t kept = { NULL, NULL };
+	thmap_gcbatch_t batch[GC_NCLASSES];
+	unsigned nhps = 0;
+	size_t nobjs = 0;
 
-	gc = malloc(sizeof(thmap_gc_t));
-	gc->addr = addr;
-	gc->len = len;
-retry:
-	head = atomic_load_relaxed(&thmap->gc_list);
-	gc->next = head; // not yet published
+	if (gc && thmap->hazards) {
+		hps = gc_hazards(thmap, hpbuf, &nhps);
+	}
+	if (gc && (thmap->flags & THMAP_GRACE)) {
+		grace_wait();
+	}
+	for (unsigned c = 0; c < GC_NCLASSES; c++) {
+		batch[c].n = 0;
+	}
+	while (gc) {
+		thmap_gc_t *next = gc->next;
 
-	/* Release to subsequent acquire in thmap_stage_gc(). */
-	if (!atomic_compare_exchange_weak_explicit(&thmap->gc_list, &head, gc,
-	    memory_order_release, memory_order_relaxed)) {
-		goto retry;
+		if (next) {
+			/* Fetch the next block while freeing this one. */
+			prefetch(next);
+		}
+		if (__predict_false(hps == NULL) ||
+		    (nhps && gc_protected_p(gc, hps, nhps))) {
+			/* Still accessed by a lookup: stage it again. */
+			if (kept.head == NULL) {
+				kept.head = gc;
+			} else {
+				kept.tail->next = gc;
+			}
+			kept.tail = gc;
+			gc = next;
+			continue;
+		}
+		while (gc->nobjs) {
+			const thmap_gcobj_t *obj;
+			thmap_gcbatch_t *b;
+			unsigned c;
+
+			if (__predict_false(nobjs == maxobjs)) {
+				goto out;
+			}
+			if (deadline && nobjs && (nobjs % GC_CLOCK_OBJS) == 0 &&
+			    gc_clock() >= deadline) {
+				goto out;
+			}
+			obj = &gc->objs[--gc->nobjs];
+			nobjs++;
+
+			if (obj->dtor) {
+				obj->dtor(thmap, obj->addr, obj->len);
+				continue;
+			}
+			c = gc_class(thmap, obj->len);
+			b = &batch[c];
+			b->addrs[b->n] = obj->addr;
+			b->lens[b->n] = obj->len;
+			if (++b->n == MEM_BULK) {
+				gc_flush(thmap, c, b);
+			}
+		}
+		free(gc);
+		gc = next;
+	}
+out:
+	for (unsigned c = 0; c < GC_NCLASSES; c++) {
+		if (batch[c].n) {
+			gc_flush(thmap, c, &batch[c]);
+		}
 	}
+	stage_gc_chain(thmap, &kept);
+	if (hps != hpbuf) {
+		free(hps);
+	}
+	return gc;
+}
+
+void
+thmap_gc(thmap_t *thmap, void *ref)
+{
+	(void)gc_release(thmap, ref, SIZE_MAX, 0);
 }
 
 void *
-thmap_stage_gc(thmap_t *thmap)
+thmap_gc_step(thmap_t *thmap, void *ref, size_t maxobjs, unsigned usecs)
 {
-	/* Acquire from prior release in stage_mem_gc(). */
-	return atomic_exchange_explicit(&thmap->gc_list, NULL,
-	    memory_order_acquire);
+	const uint64_t deadline = usecs ?
+	    gc_clock() + (uint64_t)usecs * 1000 : 0;
+
+	return gc_release(thmap, ref, maxobjs ? maxobjs : SIZE_MAX, deadline);
 }
 
-void
-thmap_gc(thmap_t *thmap, void *ref)
+/*
+ * tree_free: release the subtree, including the leaves and the copies
+ * of their keys.  Used on map destruction, therefore no locking.
+ */
+static void
+tree_free(thmap_t *thmap, thmap_ptr_t ptr)
 {
-	thmap_gc_t *gc = ref;
+	if (THMAP_INODE_P(ptr)) {
+		thmap_inode_t *node = THMAP_NODE(thmap, ptr);
 
-	while (gc) {
-		thmap_gc_t *next = gc->next;
-		thmap->ops->free(gc->addr, gc->len);
-		free(gc);
-		gc = next;
+		for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+			const thmap_ptr_t child =
+			    atomic_load_relaxed(&node->slots[i]);
+
+			if (child != THMAP_NULL) {
+				tree_free(thmap, child);
+			}
+		}
+		mem_free(thmap, ptr, THMAP_INODE_LEN(thmap));
+	} else {
+		thmap_leaf_t *leaf = THMAP_NODE(thmap, ptr);
+
+		if (thmap->flags & THMAP_MULTI) {
+			thmap_ptr_t cur = leaf->vlist;
+
+			while (cur != THMAP_NULL && cur != THMAP_VCHUNK_SEALED) {
+				thmap_vchunk_t *chunk = THMAP_GETPTR(thmap, cur);
+
+				cur = atomic_load_relaxed(&chunk->next);
+				vchunk_free(thmap, chunk);
+			}
+		}
+		leaf_free(thmap, leaf);
 	}
 }
 
@@ -874,6 +5704,7 @@ thmap_gc(thmap_t *thmap, void *ref)
 thmap_t *
 thmap_create(uintptr_t baseptr, const thmap_ops_t *ops, unsigned flags)
 {
+	thmap_gen_t *gen;
 	thmap_t *thmap;
 	uintptr_t root;
 
@@ -883,6 +5714,47 @@ thmap_create(uintptr_t baseptr, const thmap_ops_t *ops, unsigned flags)
 	if (!THMAP_ALIGNED_P(baseptr)) {
 		return NULL;
 	}
+	if (flags & THMAP_INTRUSIVE) {
+		/* The keys of the entries are referenced. */
+		flags |= THMAP_NOCOPY;
+	}
+	if ((flags & (THMAP_NOCOPY | THMAP_KEYPREFIX)) ==
+	    (THMAP_NOCOPY | THMAP_KEYPREFIX)) {
+		/* The prefix dictionary is used for the key copies. */
+		return NULL;
+	}
+	if ((flags & (THMAP_SETROOT | THMAP_KEYPREFIX)) ==
+	    (THMAP_SETROOT | THMAP_KEYPREFIX)) {
+		/* The prefix dictionary is local to the map object. */
+		return NULL;
+	}
+	if ((flags & (THMAP_MULTI | THMAP_DIGEST)) ==
+	    (THMAP_MULTI | THMAP_DIGEST)) {
+		/* The value lists are not digested. */
+		return NULL;
+	}
+	if (ops && (ops->alloc_ctx == NULL) != (ops->free_ctx == NULL)) {
+		/* The context operations come in pairs. */
+		return NULL;
+	}
+	if ((flags & (THMAP_MULTI | THMAP_HAZARD)) ==
+	    (THMAP_MULTI | THMAP_HAZARD)) {
+		/* The value lists are not protected. */
+		return NULL;
+	}
+	if ((flags & (THMAP_HAZARD | THMAP_GRACE)) ==
+	    (THMAP_HAZARD | THMAP_GRACE)) {
+		/* Either of the lookup protection schemes. */
+		return NULL;
+	}
+	if ((flags & THMAP_INTRUSIVE) &&
+	    (flags & (THMAP_MULTI | THMAP_HAZARD | THMAP_GRACE))) {
+		/*
+		 * The entries are not staged for G/C, hence cannot be
+		 * protected from the lookups.  No value lists either.
+		 */
+		return NULL;
+	}
 	thmap = calloc(1, sizeof(thmap_t));
 	if (!thmap) {
 		return NULL;
@@ -891,27 +5763,63 @@ thmap_create(uintptr_t baseptr, const thmap_ops_t *ops, unsigned flags)
 	thmap->ops = ops ? ops : &thmap_default_ops;
 	thmap->flags = flags;
 
+	gen = calloc(1, sizeof(thmap_gen_t));
+	if (!gen) {
+		free(thmap);
+		return NULL;
+	}
+	thmap->gen = gen;
+
+	if ((flags & (THMAP_RANDSEED | THMAP_SIPHASH)) != 0 &&
+	    random_seed(gen->seed) == -1) {
+		goto err;
+	}
+
+	if (thmap->flags & THMAP_KEYPREFIX) {
+		thmap->prefix = calloc(THMAP_PREFIX_MAX,
+		    sizeof(thmap_prefix_t));
+		if (!thmap->prefix) {
+			goto err;
+		}
+	}
+	if (thmap->flags & THMAP_GRACE) {
+		grace_init();
+	}
+	if (thmap->flags & THMAP_HAZARD) {
+		thmap->hazards = calloc(1, sizeof(thmap_hzblock_t));
+		if (!thmap->hazards) {
+			goto err;
+		}
+	}
+
 	if ((thmap->flags & THMAP_SETROOT) == 0) {
 		/* Allocate the root level. */
-		root = thmap->ops->alloc(THMAP_ROOT_LEN);
-		thmap->root = THMAP_GETPTR(thmap, root);
-		if (!thmap->root) {
-			free(thmap);
-			return NULL;
+		root = mem_alloc(thmap, THMAP_ROOT_LEN);
+		gen->root = THMAP_GETPTR(thmap, root);
+		if (!gen->root) {
+			goto err;
 		}
-		memset(thmap->root, 0, THMAP_ROOT_LEN);
+		memset(gen->root, 0, THMAP_ROOT_LEN);
 		atomic_thread_fence(memory_order_release); /* XXX */
 	}
 	return thmap;
+err:
+	free(thmap->hazards);
+	free(thmap->prefix);
+	free(gen);
+	free(thmap);
+	return NULL;
 }
 
 int
 thmap_setroot(thmap_t *thmap, uintptr_t root_off)
 {
-	if (thmap->root) {
+	thmap_gen_t *gen = atomic_load_relaxed(&thmap->gen);
+
+	if (gen->root) {
 		return -1;
 	}
-	thmap->root = THMAP_GETPTR(thmap, root_off);
+	gen->root = THMAP_GETPTR(thmap, root_off);
 	atomic_thread_fence(memory_order_release); /* XXX */
 	return 0;
 }
@@ -919,20 +5827,421 @@ thmap_setroot(thmap_t *thmap, uintptr_t root_off)
 uintptr_t
 thmap_getroot(const thmap_t *thmap)
 {
-	return THMAP_GETOFF(thmap, thmap->root);
+	const thmap_gen_t *gen = atomic_load_relaxed(&thmap->gen);
+	return THMAP_GETOFF(thmap, gen->root);
+}
+
+/*
+ * thmap_getseed: get the hash seed (key) of the map.
+ */
+void
+thmap_getseed(const thmap_t *thmap, uint64_t seed[2])
+{
+	/* Acquire from prior release in thmap_reseed_step(). */
+	const thmap_gen_t *gen = atomic_load_acquire(&thmap->gen);
+
+	seed[0] = gen->seed[0];
+	seed[1] = gen->seed[1];
+}
+
+/*
+ * thmap_setseed: set the hash seed (key) of the map, e.g. to attach to
+ * the map in shared memory using the seed of the map which created it.
+ *
+ * => Must be called before the map is used; fails if it has entries.
+ */
+int
+thmap_setseed(thmap_t *thmap, const uint64_t seed[2])
+{
+	thmap_gen_t *gen = atomic_load_relaxed(&thmap->gen);
+
+	if (gen->root) {
+		for (unsigned i = 0; i < ROOT_SIZE; i++) {
+			if (atomic_load_relaxed(&gen->root[i])) {
+				return -1;
+			}
+		}
+	}
+	gen->seed[0] = seed[0];
+	gen->seed[1] = seed[1];
+	return 0;
+}
+
+/*
+ * thmap_setdtor: set the destructor of the values: the values removed
+ * by the deletes (or replaced by the transactions) are staged for G/C
+ * along with their leaves and passed to the destructor by thmap_gc().
+ *
+ * => Must be called before the map is used concurrently.
+ * => Not applicable to THMAP_MULTI or the maps with the counters, i.e.
+ *    once thmap_incr() was used (and the reverse).
+ * => Not applicable to THMAP_HAZARD or THMAP_GRACE: their G/C does not
+ *    wait for the callers of thmap_get() still using the value.
+ */
+int
+thmap_setdtor(thmap_t *thmap, thmap_dtor_func_t func, void *arg)
+{
+	if ((thmap->flags & (THMAP_MULTI | THMAP_HAZARD | THMAP_GRACE)) != 0 ||
+	    atomic_load_relaxed(&thmap->counters)) {
+		return -1;
+	}
+	thmap->dtor_func = func;
+	thmap->dtor_arg = arg;
+	return 0;
+}
+
+/*
+ * thmap_add_prefix: add a key prefix to the dictionary.
+ *
+ * => The keys inserted afterwards are front-coded against the longest
+ *    matching prefix; the already present keys are not affected.
+ * => Serialised with other thmap_add_prefix() calls by the caller.
+ */
+int
+thmap_add_prefix(thmap_t *thmap, const void *prefix, size_t len)
+{
+	const unsigned n = atomic_load_relaxed(&thmap->nprefix);
+	thmap_prefix_t *pfx;
+	uintptr_t key_off;
+
+	if ((thmap->flags & THMAP_KEYPREFIX) == 0 || n == THMAP_PREFIX_MAX) {
+		return -1;
+	}
+	if ((key_off = mem_alloc(thmap, len)) == THMAP_NULL) {
+		return -1;
+	}
+	memcpy(THMAP_GETPTR(thmap, key_off), prefix, len);
+
+	pfx = &thmap->prefix[n];
+	pfx->key = key_off;
+	pfx->len = len;
+
+	/* Release to subsequent acquire in prefix_lookup(). */
+	atomic_store_release(&thmap->nprefix, n + 1);
+	return 0;
+}
+
+/*
+ * thmap_feed_init: enable the mutation feed with the given number of
+ * rings, each holding up to nrecs records (rounded up to a power of 2).
+ *
+ * => Must be called before the map is used concurrently.
+ * => The feed is process-local, even if the map is in shared memory.
+ */
+int
+thmap_feed_init(thmap_t *thmap, unsigned nrings, size_t nrecs)
+{
+	thmap_feed_t *feed;
+	uint64_t n = 1;
+
+	if (atomic_load_relaxed(&thmap->feed) || nrings == 0 || nrecs == 0) {
+		return -1;
+	}
+	while (n < nrecs) {
+		n <<= 1;
+	}
+	feed = calloc(1, sizeof(thmap_feed_t) +
+	    nrings * sizeof(thmap_ring_t *));
+	if (!feed) {
+		return -1;
+	}
+	feed->nrings = nrings;
+
+	for (unsigned i = 0; i < nrings; i++) {
+		thmap_ring_t *ring;
+
+		ring = calloc(1, sizeof(thmap_ring_t) +
+		    n * sizeof(thmap_fslot_t));
+		if (!ring) {
+			feed_destroy(feed);
+			return -1;
+		}
+		ring->mask = n - 1;
+		for (uint64_t j = 0; j < n; j++) {
+			atomic_store_relaxed(&ring->slots[j].turn, j);
+		}
+		feed->rings[i] = ring;
+	}
+	/* Release to subsequent consume in feed_seq() and feed_emit(). */
+	atomic_store_release(&thmap->feed, feed);
+	return 0;
+}
+
+/*
+ * thmap_feed_drain: consume up to max records, passing each of them to
+ * the given function.
+ *
+ * => Returns the number of records consumed.
+ * => The records are in order within a ring, but not across the rings:
+ *    the consumer should order them by the sequence number.
+ */
+size_t
+thmap_feed_drain(thmap_t *thmap, thmap_feed_func_t func, void *arg,
+    size_t max)
+{
+	/* Acquire from prior release in thmap_feed_init(). */
+	thmap_feed_t *feed = atomic_load_acquire(&thmap->feed);
+	unsigned i, cursor;
+	size_t n = 0;
+
+	if (!feed) {
+		return 0;
+	}
+
+	/*
+	 * Start with the ring where the previous call stopped, so that
+	 * a bounded drain would not starve the other rings.
+	 */
+	cursor = atomic_load_relaxed(&feed->cursor);
+	for (i = 0; i < feed->nrings; i++) {
+		thmap_ring_t *ring = feed->rings[(cursor + i) % feed->nrings];
+
+		while (n < max && feed_dequeue(ring, func, arg)) {
+			n++;
+		}
+		if (n == max) {
+			break;
+		}
+	}
+	atomic_store_relaxed(&feed->cursor, (cursor + i) % feed->nrings);
+	return n;
+}
+
+/*
+ * thmap_feed_lost: return the number of records dropped because the
+ * ring was full (or the key could not be copied).
+ */
+uint64_t
+thmap_feed_lost(const thmap_t *thmap)
+{
+	const thmap_feed_t *feed = atomic_load_acquire(&thmap->feed);
+	return feed ? atomic_load_relaxed(&feed->lost) : 0;
 }
 
 void
 thmap_destroy(thmap_t *thmap)
 {
-	uintptr_t root = THMAP_GETOFF(thmap, thmap->root);
+	thmap_gen_t *gen = atomic_load_relaxed(&thmap->gen);
 	void *ref;
 
 	ref = thmap_stage_gc(thmap);
 	thmap_gc(thmap, ref);
 
-	if ((thmap->flags & THMAP_SETROOT) == 0) {
-		thmap->ops->free(root, THMAP_ROOT_LEN);
+	while (gen) {
+		thmap_gen_t *next = atomic_load_relaxed(&gen->next);
+
+		if ((thmap->flags & THMAP_SETROOT) == 0) {
+			/*
+			 * Release the entries which are still present,
+			 * including the generation being migrated to.
+			 * Note: the map set with thmap_setroot() does not
+			 * own the tree.
+			 */
+			for (unsigned i = 0; i < ROOT_SIZE; i++) {
+				const thmap_ptr_t nptr = THMAP_ALIGN(
+				    atomic_load_relaxed(&gen->root[i]));
+
+				if (nptr != THMAP_NULL) {
+					tree_free(thmap, nptr);
+				}
+			}
+			mem_free(thmap, THMAP_GETOFF(thmap, gen->root),
+			    THMAP_ROOT_LEN);
+		}
+		free(gen);
+		gen = next;
+	}
+	if (thmap->prefix) {
+		const unsigned n = atomic_load_relaxed(&thmap->nprefix);
+
+		for (unsigned i = 0; i < n; i++) {
+			const thmap_prefix_t *pfx = &thmap->prefix[i];
+			mem_free(thmap, pfx->key, pfx->len);
+		}
+		free(thmap->prefix);
+	}
+	if (atomic_load_relaxed(&thmap->feed)) {
+		feed_destroy(atomic_load_relaxed(&thmap->feed));
+	}
+	if (thmap->pool) {
+		pool_destroy(thmap, thmap->pool);
+	}
+	while (thmap->hazards) {
+		thmap_hzblock_t *blk = thmap->hazards;
+
+		thmap->hazards = atomic_load_relaxed(&blk->next);
+		free(blk);
 	}
 	free(thmap);
 }
+
+/*
+ * thmap_reserve: top up the reserve pool, so that it holds at least n
+ * leaves and n / 4 intermediate nodes, spread across the magazines.
+ *
+ * => May be called concurrently with the other operations, e.g.
+ *    periodically from a background thread.
+ * => Returns 0 on success and -1 on memory allocation failure.
+ */
+int
+thmap_reserve(thmap_t *thmap, size_t n)
+{
+	thmap_pool_t *pool = atomic_load_acquire(&thmap->pool);
+	size_t want[POOL_NTYPES];
+	int error = 0;
+
+	if (pool == NULL) {
+		thmap_pool_t *expected = NULL;
+
+		if ((pool = calloc(1, sizeof(thmap_pool_t))) == NULL) {
+			return -1;
+		}
+		/* Release to subsequent consume in pool_alloc(). */
+		if (!atomic_compare_exchange_strong_explicit(&thmap->pool,
+		    &expected, pool, memory_order_acq_rel,
+		    memory_order_acquire)) {
+			free(pool);
+			pool = expected;
+		}
+	}
+	/* With THMAP_INTRUSIVE, the leaves are the entries of the caller. */
+	want[POOL_LEAF] = (thmap->flags & THMAP_INTRUSIVE) ? 0 :
+	    (n + POOL_NMAGS - 1) / POOL_NMAGS;
+	want[POOL_INODE] = (n / 4 + POOL_NMAGS - 1) / POOL_NMAGS;
+	for (unsigned type = 0; type < POOL_NTYPES; type++) {
+		/* The target for the recycling, see pool_recycle(). */
+		atomic_store_relaxed(&pool->want[type], want[type]);
+	}
+
+	for (unsigned i = 0; i < POOL_NMAGS && !error; i++) {
+		thmap_mag_t *mag = &pool->mags[i];
+
+		for (unsigned type = 0; type < POOL_NTYPES; type++) {
+			const size_t len = pool_objlen(thmap, type);
+			size_t have = atomic_load_relaxed(&mag->count[type]);
+			uintptr_t head = THMAP_NULL, tail = THMAP_NULL;
+			unsigned count, nobjs = 0;
+			uintptr_t *next;
+
+			/*
+			 * Allocate the shortfall outside the magazine,
+			 * then splice it in.
+			 */
+			while (have + nobjs < want[type] && !error) {
+				uintptr_t offs[MEM_BULK];
+				size_t nalloc, k;
+
+				k = MIN(want[type] - have - nobjs, MEM_BULK);
+				nalloc = mem_alloc_bulk(thmap, len, offs, k);
+				error = nalloc < k ? -1 : 0;
+
+				for (k = 0; k < nalloc; k++) {
+					next = THMAP_GETPTR(thmap, offs[k]);
+					*next = head;
+					if (!head) {
+						tail = offs[k];
+					}
+					head = offs[k];
+				}
+				nobjs += nalloc;
+			}
+			if (nobjs == 0) {
+				continue;
+			}
+			mag_lock(mag);
+			next = THMAP_GETPTR(thmap, tail);
+			*next = mag->head[type];
+			mag->head[type] = head;
+			count = atomic_load_relaxed(&mag->count[type]);
+			atomic_store_relaxed(&mag->count[type], count + nobjs);
+			mag_unlock(mag);
+		}
+	}
+	return error;
+}
+
+/*
+ * MAP HANDLE.
+ */
+
+static void
+handle_map_dtor(thmap_t *thmap, uintptr_t addr, size_t len)
+{
+	thmap_destroy((thmap_t *)addr);
+	(void)thmap; (void)len;
+}
+
+/*
+ * thmap_handle_create: construct a handle with the given map published.
+ *
+ * => The handle takes the ownership of the map.
+ * => The handle readers do not hold a hazard record or a grace section
+ *    on the old map, therefore THMAP_HAZARD and THMAP_GRACE maps, whose
+ *    G/C does not wait for the lookups, are rejected.
+ */
+thmap_handle_t *
+thmap_handle_create(thmap_t *thmap)
+{
+	thmap_handle_t *hdl;
+
+	if (!thmap || (thmap->flags & (THMAP_HAZARD | THMAP_GRACE)) != 0) {
+		return NULL;
+	}
+	if ((hdl = malloc(sizeof(thmap_handle_t))) == NULL) {
+		return NULL;
+	}
+	atomic_store_release(&hdl->map, thmap);
+	return hdl;
+}
+
+/*
+ * thmap_handle_get: return the currently published map.
+ *
+ * => The map stays valid until the G/C cycle following its replacement.
+ */
+thmap_t *
+thmap_handle_get(thmap_handle_t *hdl)
+{
+	/* Acquire from prior release in thmap_handle_publish(). */
+	return atomic_load_acquire(&hdl->map);
+}
+
+/*
+ * thmap_handle_publish: atomically replace the published map with the
+ * new one and stage the old map for G/C on the new map.
+ *
+ * => The old map is destroyed by thmap_gc() on the new map, i.e. after
+ *    the synchronisation barrier, which must cover the handle readers.
+ * => THMAP_HAZARD and THMAP_GRACE maps are rejected, see above.
+ */
+int
+thmap_handle_publish(thmap_handle_t *hdl, thmap_t *thmap)
+{
+	thmap_t *old;
+
+	if (!thmap || (thmap->flags & (THMAP_HAZARD | THMAP_GRACE)) != 0) {
+		return -1;
+	}
+
+	/*
+	 * Release the fully built map to subsequent acquire in
+	 * thmap_handle_get() and acquire the old one for destruction.
+	 */
+	old = atomic_exchange_explicit(&hdl->map, thmap,
+	    memory_order_acq_rel);
+	if (old == thmap) {
+		return -1;
+	}
+	stage_gc(thmap, (uintptr_t)old, sizeof(thmap_t), handle_map_dtor);
+	return 0;
+}
+
+/*
+ * thmap_handle_destroy: destroy the handle and the published map.
+ */
+void
+thmap_handle_destroy(thmap_handle_t *hdl)
+{
+	thmap_destroy(atomic_load_relaxed(&hdl->map));
+	free(hdl);
+}
@@ -13,27 +13,171 @@ __BEGIN_DECLS
 struct thmap;
 typedef struct thmap thmap_t;
 
+struct thmap_handle;
+typedef struct thmap_handle thmap_handle_t;
+
+struct thmap_cache;
+typedef struct thmap_cache thmap_cache_t;
+
+struct thmap_txn;
+typedef struct thmap_txn thmap_txn_t;
+
 #define	THMAP_NOCOPY	0x01
 #define	THMAP_SETROOT	0x02
+#define	THMAP_KEYPREFIX	0x04
+#define	THMAP_MULTI	0x08
+#define	THMAP_RANDSEED	0x10
+#define	THMAP_SIPHASH	0x20
+#define	THMAP_LAZYDEL	0x40
+#define	THMAP_DIGEST	0x80
+#define	THMAP_HAZARD	0x100
+#define	THMAP_GRACE	0x200
+#define	THMAP_INTRUSIVE	0x400
+
+/*
+ * Returned by thmap_del() on THMAP_MULTI, if the key was removed.
+ */
+#define	THMAP_MULTI_DELETED	((void *)0x1)
 
 typedef struct {
 	uintptr_t	(*alloc)(size_t);
 	void		(*free)(uintptr_t, size_t);
+
+	/*
+	 * Optional: the operations taking the context, used instead of
+	 * the above if set, and the bulk operations (also given the ctx).
+	 */
+	void *		ctx;
+	uintptr_t	(*alloc_ctx)(void *, size_t);
+	void		(*free_ctx)(void *, uintptr_t, size_t);
+	size_t		(*alloc_bulk)(void *, size_t, uintptr_t *, size_t);
+	void		(*free_bulk)(void *, const uintptr_t *,
+			    const size_t *, size_t);
 } thmap_ops_t;
 
+#define	THMAP_OP_PUT	1
+#define	THMAP_OP_DEL	2
+#define	THMAP_OP_INCR	3
+
+typedef struct {
+	uint64_t	seq;
+	unsigned	op;
+	const void *	key;
+	size_t		len;
+	void *		val;
+} thmap_rec_t;
+
+typedef void (*thmap_feed_func_t)(const thmap_rec_t *, void *);
+
+/*
+ * The maximum number of keys changed by a transaction.
+ */
+#define	THMAP_TXN_MAX		8
+
+/*
+ * Set operations: see thmap_join().
+ */
+#define	THMAP_JOIN_BOTH		0x01
+#define	THMAP_JOIN_LEFT		0x02
+#define	THMAP_JOIN_RIGHT	0x04
+
+#define	THMAP_JOIN_NSLOTS	64
+
+typedef void (*thmap_join_func_t)(const void *, size_t, void *, void *, void *);
+typedef void (*thmap_sample_func_t)(const void *, size_t, void *, void *);
+typedef void (*thmap_dtor_func_t)(void *, void *);
+
+/*
+ * The state of the incremental prefetch (opaque).
+ */
+typedef struct {
+	uint64_t	priv[8];
+} thmap_prefetch_t;
+
+/*
+ * The entry embedded in the object of the caller (opaque), see
+ * thmap_put_entry().
+ */
+typedef struct {
+	uint64_t	priv[3];
+} thmap_entry_t;
+
 thmap_t *	thmap_create(uintptr_t, const thmap_ops_t *, unsigned);
 void		thmap_destroy(thmap_t *);
+int		thmap_reserve(thmap_t *, size_t);
 
 void *		thmap_get(thmap_t *, const void *, size_t);
+
+thmap_cache_t *	thmap_cache_create(thmap_t *, unsigned);
+void		thmap_cache_destroy(thmap_cache_t *);
+void *		thmap_cache_get(thmap_cache_t *, const void *, size_t);
+
+size_t		thmap_sample(thmap_t *, size_t, thmap_sample_func_t, void *);
+
+void		thmap_prefetch(thmap_t *, const void *, size_t);
+void		thmap_prefetch_start(thmap_t *, thmap_prefetch_t *,
+		    const void *, size_t);
+int		thmap_prefetch_step(thmap_t *, thmap_prefetch_t *);
 void *		thmap_put(thmap_t *, const void *, size_t, void *);
 void *		thmap_del(thmap_t *, const void *, size_t);
+int		thmap_del_if(thmap_t *, const void *, size_t, void *);
+size_t		thmap_del_batch(thmap_t *, const void *const *,
+		    const size_t *, void **, size_t);
+size_t		thmap_compact(thmap_t *);
+
+void *		thmap_put_entry(thmap_t *, thmap_entry_t *,
+		    const void *, size_t, void *);
+int		thmap_del_entry(thmap_t *, thmap_entry_t *);
+
+thmap_txn_t *	thmap_txn_begin(thmap_t *);
+int		thmap_txn_put(thmap_txn_t *, const void *, size_t, void *);
+int		thmap_txn_replace(thmap_txn_t *, const void *, size_t, void *);
+int		thmap_txn_del(thmap_txn_t *, const void *, size_t);
+int		thmap_txn_commit(thmap_txn_t *);
+void		thmap_txn_abort(thmap_txn_t *);
+int		thmap_move(thmap_t *, const void *, size_t,
+		    const void *, size_t);
+
+uintptr_t	thmap_incr(thmap_t *, const void *, size_t, uintptr_t);
+
+int		thmap_put_multi(thmap_t *, const void *, size_t, void *);
+size_t		thmap_get_multi(thmap_t *, const void *, size_t, void **, size_t);
+int		thmap_del_value(thmap_t *, const void *, size_t, void *);
 
 void *		thmap_stage_gc(thmap_t *);
 void		thmap_gc(thmap_t *, void *);
+void *		thmap_gc_step(thmap_t *, void *, size_t, unsigned);
 
 int		thmap_setroot(thmap_t *, uintptr_t);
 uintptr_t	thmap_getroot(const thmap_t *);
 
+void		thmap_getseed(const thmap_t *, uint64_t [2]);
+int		thmap_setseed(thmap_t *, const uint64_t [2]);
+int		thmap_setdtor(thmap_t *, thmap_dtor_func_t, void *);
+
+int		thmap_reseed_start(thmap_t *);
+int		thmap_reseed_step(thmap_t *, unsigned);
+
+int		thmap_join(thmap_t *, thmap_t *, unsigned, unsigned, unsigned,
+		    thmap_join_func_t, void *);
+int		thmap_intersect(thmap_t *, thmap_t *, thmap_join_func_t, void *);
+int		thmap_diff(thmap_t *, thmap_t *, thmap_join_func_t, void *);
+int		thmap_union(thmap_t *, thmap_t *, thmap_join_func_t, void *);
+
+int		thmap_digest(thmap_t *, uint64_t *);
+int		thmap_compare(thmap_t *, thmap_t *, thmap_join_func_t, void *);
+
+int		thmap_add_prefix(thmap_t *, const void *, size_t);
+
+int		thmap_feed_init(thmap_t *, unsigned, size_t);
+size_t		thmap_feed_drain(thmap_t *, thmap_feed_func_t, void *, size_t);
+uint64_t	thmap_feed_lost(const thmap_t *);
+
+thmap_handle_t *	thmap_handle_create(thmap_t *);
+thmap_t *	thmap_handle_get(thmap_handle_t *);
+int		thmap_handle_publish(thmap_handle_t *, thmap_t *);
+void		thmap_handle_destroy(thmap_handle_t *);
+
 __END_DECLS
 
 #endif
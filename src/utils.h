@@ -33,6 +33,22 @@
 #define	__predict_false(x)	__builtin_expect((x) != 0, 0)
 #endif
 
+/*
+ * Prefetch the cache line for reading.
+ */
+
+#ifndef prefetch
+#define	prefetch(x)		__builtin_prefetch(x)
+#endif
+
+/*
+ * Cast away the const qualifier.
+ */
+
+#ifndef __UNCONST
+#define	__UNCONST(a)	((void *)(uintptr_t)(const void *)(a))
+#endif
+
 /*
  * Minimum, maximum and rounding macros.
  */
@@ -139,5 +155,6 @@ do {								\
  * Hash functions.
  */
 uint32_t	murmurhash3(const void *, size_t, uint32_t);
+uint64_t	siphash24(const void *, size_t, uint64_t, uint64_t);
 
 #endif